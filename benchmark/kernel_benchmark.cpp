@@ -0,0 +1,737 @@
+// Standalone micro-benchmarks of the CPU side kernels, independent of the Vulkan renderer:
+//     MoleculeKernel::evaluateOrbital and evaluateOrbitalBatch, points per second across basis sizes
+//     MoleculeKernel::getBonds, atoms per second across system sizes
+//     MarchingCubes::Polygonise, cells per second
+//     MeshRenderer::renderOrbital, milliseconds per frame
+//     Marching Cubes against Surface Nets, triangles, milliseconds and distance of the vertices to the true isosurface
+//     MeshSimplifier::buildLodChain, milliseconds and triangles per level of detail
+// on synthetic carbon lattices and on the demo trajectory. Results are written as JSON.
+//
+// The isosurface meshes are also checked to be the same with 1 thread as with several.
+//
+// Usage: KernelBenchmark [--demo path_prefix] [--output file.json] [--quick] [--threads n]
+//     --threads: threads of the isosurface extraction, 0 (default) for one per hardware thread
+
+#include <math.h>
+#include <stdint.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "../src/molecule_struct.h"
+#include "../src/molecule_reader.h"
+#include "../src/molecule_kernel.h"
+#include "../src/mesh_renderer.h"
+#include "../src/grid_evaluator.h"
+#include "../src/mesh_simplifier.h"
+#include "../src/fast_exp.h"
+#include "../src/thread_pool.h"
+
+namespace KernelBenchmark
+{
+    double min_seconds_per_case = 0.5;
+
+    const float carbon_bond_length = 1.4f;
+    const float point_sample_margin = 3.0f; // Orbital sample points are spread over the molecule plus this margin
+    const int orbital_point_budget = 1 << 22; // evaluateOrbital cases use fewer points as the basis grows, n_point * n_AO ~ budget
+    const int orbital_point_min = 4096;
+
+    // STO-3G carbon, 1s and 2sp shells with three primitives each
+    const float carbon_1s_exponents[3]{ 71.6168370f, 13.0450960f, 3.5305122f };
+    const float carbon_1s_contractions[3]{ 0.15432897f, 0.53532814f, 0.44463454f };
+    const float carbon_2sp_exponents[3]{ 2.9412494f, 0.6834831f, 0.2222899f };
+    const float carbon_2s_contractions[3]{ -0.09996723f, 0.39951283f, 0.70011547f };
+    const float carbon_2p_contractions[3]{ 0.15591627f, 0.60768372f, 0.39195739f };
+    const int carbon_quantum_numbers[5]{ 1, 1, 4, 5, 6 };
+    const int carbon_n_ao = 5;
+    const int carbon_n_primitive = 3;
+
+    // Deterministic pseudo random numbers in [-1, 1], so that every run benchmarks the same molecule
+    float nextRandom(uint32_t& state)
+    {
+        state = state * 1664525u + 1013904223u;
+        return (state >> 8) * (2.0f / 16777216.0f) - 1.0f;
+    }
+
+    // A roughly cubic block of n_atom carbons on a simple cubic lattice with bond length spacing, slightly distorted.
+    // Every atom carries the STO-3G basis, the MO and the occupied orbitals have random coefficients.
+    MoleculeStruct::MolecularDataOneFrame* buildSyntheticCarbon(const int n_atom)
+    {
+        const int n_ao = n_atom * carbon_n_ao;
+        MoleculeStruct::MolecularDataOneFrame* frame = new MoleculeStruct::MolecularDataOneFrame(n_atom, n_ao, n_ao * carbon_n_primitive);
+
+        int n_side = 1;
+        while (n_side * n_side * n_side < n_atom)
+            n_side++;
+
+        uint32_t random_state = 12345u + n_atom;
+        for (int i_atom = 0; i_atom < n_atom; i_atom++)
+        {
+            MoleculeStruct::ChemistryAtom& atom = frame->atoms[i_atom];
+            atom.atomic_number = 6;
+            atom.rgb[0] = 0.4f, atom.rgb[1] = 0.4f, atom.rgb[2] = 0.4f;
+            atom.vdw_radius = 0.425f;
+            atom.bond_radius = 0.67f;
+            const int lattice_index[3]{ i_atom % n_side, (i_atom / n_side) % n_side, i_atom / (n_side * n_side) };
+            for (int i_xyz = 0; i_xyz < 3; i_xyz++)
+                atom.xyz[i_xyz] = lattice_index[i_xyz] * carbon_bond_length + 0.1f * nextRandom(random_state);
+
+            for (int i_ao = 0; i_ao < carbon_n_ao; i_ao++)
+            {
+                const int i_ao_total = i_atom * carbon_n_ao + i_ao;
+                MoleculeStruct::AtomicOrbital& ao = frame->aos[i_ao_total];
+                ao.quantum_number = carbon_quantum_numbers[i_ao];
+                ao.number_of_primitives = carbon_n_primitive;
+                for (int i_xyz = 0; i_xyz < 3; i_xyz++)
+                    ao.xyz[i_xyz] = atom.xyz[i_xyz];
+
+                for (int i_primitive = 0; i_primitive < carbon_n_primitive; i_primitive++)
+                {
+                    MoleculeStruct::GaussianPrimitive& primitive = frame->primitives[i_ao_total * carbon_n_primitive + i_primitive];
+                    primitive.exponent = i_ao == 0 ? carbon_1s_exponents[i_primitive] : carbon_2sp_exponents[i_primitive];
+                    primitive.contraction = i_ao == 0 ? carbon_1s_contractions[i_primitive]
+                                          : i_ao == 1 ? carbon_2s_contractions[i_primitive]
+                                          : carbon_2p_contractions[i_primitive];
+                }
+            }
+        }
+
+        for (int i_ao = 0; i_ao < n_ao; i_ao++)
+            frame->mo_coefficients[i_ao] = 0.3f * nextRandom(random_state);
+
+        const int n_occupied_mo = (n_atom * 6 + 1) / 2;
+        frame->allocateOccupiedMO(n_occupied_mo);
+        for (int i = 0; i < n_occupied_mo * n_ao; i++)
+            frame->occupied_mo_coefficients[i] = 0.3f * nextRandom(random_state);
+        for (int i_mo = 0; i_mo < n_occupied_mo; i_mo++)
+        {
+            frame->occupation_numbers[i_mo] = 2;
+            frame->spin_occupation_numbers[i_mo] = 0;
+        }
+
+        return frame;
+    }
+
+    // Calls run until min_seconds_per_case has passed, returns seconds per call
+    template <typename Function>
+    double timeRepeated(Function run, int& n_repeat)
+    {
+        n_repeat = 0;
+        auto time_begin = std::chrono::high_resolution_clock::now();
+        double seconds = 0;
+        do
+        {
+            run();
+            n_repeat++;
+            seconds = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - time_begin).count();
+        } while (seconds < min_seconds_per_case);
+        return seconds / n_repeat;
+    }
+
+    // Points scattered uniformly over the bounding box of the molecule plus a margin
+    std::vector<float> buildSamplePoints(const MoleculeStruct::MolecularDataOneFrame* const frame, const int n_point)
+    {
+        float coordinate_min[3], coordinate_max[3];
+        for (int i_xyz = 0; i_xyz < 3; i_xyz++)
+        {
+            coordinate_min[i_xyz] = coordinate_max[i_xyz] = frame->atoms[0].xyz[i_xyz];
+            for (int i_atom = 1; i_atom < frame->n_atom; i_atom++)
+            {
+                coordinate_min[i_xyz] = fminf(coordinate_min[i_xyz], frame->atoms[i_atom].xyz[i_xyz]);
+                coordinate_max[i_xyz] = fmaxf(coordinate_max[i_xyz], frame->atoms[i_atom].xyz[i_xyz]);
+            }
+        }
+
+        uint32_t random_state = 54321u;
+        std::vector<float> xyz(n_point * 3);
+        for (int i_point = 0; i_point < n_point; i_point++)
+            for (int i_xyz = 0; i_xyz < 3; i_xyz++)
+            {
+                float center = (coordinate_min[i_xyz] + coordinate_max[i_xyz]) / 2;
+                float half_width = (coordinate_max[i_xyz] - coordinate_min[i_xyz]) / 2 + point_sample_margin;
+                xyz[i_point * 3 + i_xyz] = center + half_width * nextRandom(random_state);
+            }
+        return xyz;
+    }
+
+    // A small JSON writer, objects and arrays are opened and closed explicitly and commas are tracked per level
+    class JsonWriter
+    {
+    public:
+        explicit JsonWriter(std::ostream& set_out) : out(set_out) {}
+
+        void beginObject(const char* const key = nullptr) { open(key, '{'); }
+        void endObject() { close('}'); }
+        void beginArray(const char* const key = nullptr) { open(key, '['); }
+        void endArray() { close(']'); }
+
+        void value(const char* const key, const double number)
+        {
+            writeKey(key);
+            if (isfinite(number))
+                out << number;
+            else
+                out << "null";
+        }
+        void value(const char* const key, const int number)
+        {
+            writeKey(key);
+            out << number;
+        }
+        void value(const char* const key, const std::string& text)
+        {
+            writeKey(key);
+            out << '"';
+            for (char c : text)
+            {
+                if (c == '"' || c == '\\')
+                    out << '\\';
+                out << c;
+            }
+            out << '"';
+        }
+
+    private:
+        std::ostream& out;
+        std::vector<bool> level_has_item;
+
+        void writeKey(const char* const key)
+        {
+            if (!level_has_item.empty())
+            {
+                if (level_has_item.back())
+                    out << ',';
+                level_has_item.back() = true;
+                out << '\n' << std::string(level_has_item.size() * 2, ' ');
+            }
+            if (key != nullptr)
+                out << '"' << key << "\": ";
+        }
+        void open(const char* const key, const char bracket)
+        {
+            writeKey(key);
+            out << bracket;
+            level_has_item.push_back(false);
+        }
+        void close(const char bracket)
+        {
+            bool had_item = level_has_item.back();
+            level_has_item.pop_back();
+            if (had_item)
+                out << '\n' << std::string(level_has_item.size() * 2, ' ');
+            out << bracket;
+            if (level_has_item.empty())
+                out << '\n';
+        }
+    };
+
+    void benchmarkEvaluateOrbital(JsonWriter& json, const std::string& name, const MoleculeStruct::MolecularDataOneFrame* const frame)
+    {
+        int n_point = orbital_point_budget / frame->n_AO;
+        if (n_point < orbital_point_min)
+            n_point = orbital_point_min;
+        std::vector<float> xyz = buildSamplePoints(frame, n_point);
+        std::vector<float> values(n_point);
+
+        int n_repeat_scalar, n_repeat_batch;
+        float checksum_scalar = 0;
+        double seconds_scalar = timeRepeated([&]() {
+            for (int i_point = 0; i_point < n_point; i_point++)
+                values[i_point] = MoleculeKernel::evaluateOrbital(xyz.data() + i_point * 3, frame);
+            checksum_scalar = 0;
+            for (int i_point = 0; i_point < n_point; i_point++)
+                checksum_scalar += fabsf(values[i_point]);
+        }, n_repeat_scalar);
+
+        float checksum_batch = 0;
+        double seconds_batch = timeRepeated([&]() {
+            MoleculeKernel::evaluateOrbitalBatch(n_point, xyz.data(), frame, values.data());
+            checksum_batch = 0;
+            for (int i_point = 0; i_point < n_point; i_point++)
+                checksum_batch += fabsf(values[i_point]);
+        }, n_repeat_batch);
+
+        std::cerr << "evaluateOrbital " << name << ": " << frame->n_AO << " AOs, "
+                  << n_point / seconds_scalar / 1e6 << " Mpoints/s scalar, "
+                  << n_point / seconds_batch / 1e6 << " Mpoints/s batch" << std::endl;
+
+        json.beginObject();
+        json.value("molecule", name);
+        json.value("n_atom", frame->n_atom);
+        json.value("n_ao", frame->n_AO);
+        json.value("n_primitive", frame->n_primitive);
+        json.value("n_point", n_point);
+        json.value("scalar_repeats", n_repeat_scalar);
+        json.value("scalar_seconds", seconds_scalar);
+        json.value("scalar_points_per_second", n_point / seconds_scalar);
+        json.value("batch_repeats", n_repeat_batch);
+        json.value("batch_seconds", seconds_batch);
+        json.value("batch_points_per_second", n_point / seconds_batch);
+        json.value("checksum_scalar", (double)checksum_scalar);
+        json.value("checksum_batch", (double)checksum_batch);
+        json.endObject();
+    }
+
+    void benchmarkGetBonds(JsonWriter& json, const std::string& name, const MoleculeStruct::MolecularDataOneFrame* const frame)
+    {
+        int n_repeat;
+        int n_bond = 0;
+        double seconds = timeRepeated([&]() {
+            n_bond = (int)MoleculeKernel::getBonds(frame).size();
+        }, n_repeat);
+
+        std::cerr << "getBonds " << name << ": " << frame->n_atom << " atoms, " << n_bond << " bonds, "
+                  << frame->n_atom / seconds / 1e6 << " Matoms/s" << std::endl;
+
+        json.beginObject();
+        json.value("molecule", name);
+        json.value("n_atom", frame->n_atom);
+        json.value("n_bond", n_bond);
+        json.value("repeats", n_repeat);
+        json.value("seconds", seconds);
+        json.value("atoms_per_second", frame->n_atom / seconds);
+        json.endObject();
+    }
+
+    // Cells of a grid_dimension^3 lattice over the field of a sum of Gaussian blobs, so that a realistic fraction of
+    // cells crosses the isosurface. The cells are built once, only the Polygonise calls are timed.
+    void benchmarkPolygonise(JsonWriter& json, const int grid_dimension)
+    {
+        const float isovalue = 0.5f;
+        const int n_blob = 8;
+        float blob_centers[n_blob][3];
+        uint32_t random_state = 777u;
+        for (int i_blob = 0; i_blob < n_blob; i_blob++)
+            for (int i_xyz = 0; i_xyz < 3; i_xyz++)
+                blob_centers[i_blob][i_xyz] = 0.5f + 0.3f * nextRandom(random_state);
+
+        const float spacing = 1.0f / grid_dimension;
+        const int n_lattice = grid_dimension + 1;
+        std::vector<float> lattice_values(n_lattice * n_lattice * n_lattice);
+        for (int i_x = 0; i_x < n_lattice; i_x++)
+            for (int i_y = 0; i_y < n_lattice; i_y++)
+                for (int i_z = 0; i_z < n_lattice; i_z++)
+                {
+                    float value = 0;
+                    for (int i_blob = 0; i_blob < n_blob; i_blob++)
+                    {
+                        float dx = i_x * spacing - blob_centers[i_blob][0];
+                        float dy = i_y * spacing - blob_centers[i_blob][1];
+                        float dz = i_z * spacing - blob_centers[i_blob][2];
+                        value += expf(-(dx * dx + dy * dy + dz * dz) * 60.0f);
+                    }
+                    lattice_values[(i_x * n_lattice + i_y) * n_lattice + i_z] = value;
+                }
+
+        // Standard Marching Cubes corner order, counterclockwise on the bottom face and then on the top face
+        const int corner_offsets[8][3]{ {0,0,0}, {1,0,0}, {1,1,0}, {0,1,0}, {0,0,1}, {1,0,1}, {1,1,1}, {0,1,1} };
+        const int n_cell = grid_dimension * grid_dimension * grid_dimension;
+        std::vector<MarchingCubes::GridCell> cells(n_cell);
+        int n_surface_cell = 0;
+        for (int i_cell = 0; i_cell < n_cell; i_cell++)
+        {
+            const int i_x = i_cell / (grid_dimension * grid_dimension), i_y = (i_cell / grid_dimension) % grid_dimension, i_z = i_cell % grid_dimension;
+            bool any_below = false, any_above = false;
+            for (int i_corner = 0; i_corner < 8; i_corner++)
+            {
+                const int* offset = corner_offsets[i_corner];
+                cells[i_cell].p[i_corner] = glm::vec3((i_x + offset[0]) * spacing, (i_y + offset[1]) * spacing, (i_z + offset[2]) * spacing);
+                cells[i_cell].val[i_corner] = lattice_values[((i_x + offset[0]) * n_lattice + i_y + offset[1]) * n_lattice + i_z + offset[2]];
+                (cells[i_cell].val[i_corner] < isovalue ? any_below : any_above) = true;
+            }
+            if (any_below && any_above)
+                n_surface_cell++;
+        }
+
+        std::vector<int> triangles;
+        std::vector<Vertex> vertices;
+        int n_triangle = 0;
+        int n_repeat;
+        double seconds = timeRepeated([&]() {
+            triangles.clear();
+            vertices.clear();
+            n_triangle = 0;
+            for (int i_cell = 0; i_cell < n_cell; i_cell++)
+                n_triangle += MarchingCubes::Polygonise(cells[i_cell], isovalue, triangles, vertices, glm::vec3(1, 0, 0));
+        }, n_repeat);
+
+        std::cerr << "Polygonise " << grid_dimension << "^3: " << n_surface_cell << " surface cells, " << n_triangle << " triangles, "
+                  << n_cell / seconds / 1e6 << " Mcells/s" << std::endl;
+
+        json.beginObject();
+        json.value("grid_dimension", grid_dimension);
+        json.value("n_cell", n_cell);
+        json.value("n_surface_cell", n_surface_cell);
+        json.value("n_triangle", n_triangle);
+        json.value("repeats", n_repeat);
+        json.value("seconds", seconds);
+        json.value("cells_per_second", n_cell / seconds);
+        json.value("surface_cells_per_second", n_surface_cell / seconds);
+        json.endObject();
+    }
+
+    // Every frame is rendered once, per frame times are summarized instead of repeated
+    bool benchmarkRenderOrbital(JsonWriter& json, const std::string& name, const std::vector<MoleculeStruct::MolecularDataOneFrame*>& frames)
+    {
+        double total_seconds = 0, min_seconds = INFINITY, max_seconds = 0;
+        int64_t n_vertex = 0, n_index = 0;
+        std::vector<Vertex> vertices;
+        std::vector<uint32_t> indices;
+        for (const MoleculeStruct::MolecularDataOneFrame* frame : frames)
+        {
+            vertices.clear();
+            indices.clear();
+            auto time_begin = std::chrono::high_resolution_clock::now();
+            if (!MeshRenderer::renderOrbital(frame, vertices, indices))
+                return false;
+            double seconds = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - time_begin).count();
+            total_seconds += seconds;
+            min_seconds = fmin(min_seconds, seconds);
+            max_seconds = fmax(max_seconds, seconds);
+            n_vertex += vertices.size();
+            n_index += indices.size();
+        }
+        const int n_frame = (int)frames.size();
+
+        std::cerr << "renderOrbital " << name << ": " << n_frame << " frames, " << total_seconds / n_frame * 1e3 << " ms/frame mean, "
+                  << min_seconds * 1e3 << " min, " << max_seconds * 1e3 << " max" << std::endl;
+
+        json.beginObject();
+        json.value("molecule", name);
+        json.value("n_atom", frames[0]->n_atom);
+        json.value("n_ao", frames[0]->n_AO);
+        json.value("n_frame", n_frame);
+        json.value("mean_ms_per_frame", total_seconds / n_frame * 1e3);
+        json.value("min_ms_per_frame", min_seconds * 1e3);
+        json.value("max_ms_per_frame", max_seconds * 1e3);
+        json.value("mean_vertices", (double)n_vertex / n_frame);
+        json.value("mean_indices", (double)n_index / n_frame);
+        json.endObject();
+        return true;
+    }
+
+    // The distance of a vertex to the isosurface is estimated to first order as ||psi| - isovalue| / |grad psi|
+    bool benchmarkMesher(JsonWriter& json, const std::string& name, const MeshRenderer::IsosurfaceMesher mesher,
+                         const std::vector<MoleculeStruct::MolecularDataOneFrame*>& frames)
+    {
+        const GridEvaluator::FieldType field = GridEvaluator::FieldType::Orbital;
+        const float isovalue = MeshRenderer::getIsovalue(field);
+        const char* mesher_name = mesher == MeshRenderer::IsosurfaceMesher::SurfaceNets ? "surface_nets" : "marching_cubes";
+
+        double total_seconds = 0, error_sum = 0, error_max = 0;
+        int64_t n_vertex = 0, n_triangle = 0;
+        std::vector<Vertex> vertices;
+        std::vector<uint32_t> indices;
+        std::vector<float> xyz, values, gradients;
+        for (const MoleculeStruct::MolecularDataOneFrame* frame : frames)
+        {
+            vertices.clear();
+            indices.clear();
+            auto time_begin = std::chrono::high_resolution_clock::now();
+            if (!MeshRenderer::renderOrbital(frame, vertices, indices, field, mesher))
+                return false;
+            total_seconds += std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - time_begin).count();
+            n_vertex += vertices.size();
+            n_triangle += indices.size() / 3;
+
+            const int n_point = (int)vertices.size();
+            xyz.resize(n_point * 3);
+            values.resize(n_point);
+            gradients.resize(n_point * 3);
+            for (int i_point = 0; i_point < n_point; i_point++)
+                for (int i_xyz = 0; i_xyz < 3; i_xyz++)
+                    xyz[i_point * 3 + i_xyz] = vertices[i_point].pos[i_xyz];
+            GridEvaluator::evaluateFieldWithGradient<MoleculeKernel::DoublePrecision>(field, frame, n_point, xyz.data(), values.data(), gradients.data());
+            for (int i_point = 0; i_point < n_point; i_point++)
+            {
+                const float* gradient = &gradients[i_point * 3];
+                const double gradient_norm = sqrt(gradient[0] * gradient[0] + gradient[1] * gradient[1] + gradient[2] * gradient[2]);
+                if (gradient_norm <= 0)
+                    continue;
+                const double error = fabs(fabs(values[i_point]) - isovalue) / gradient_norm;
+                error_sum += error;
+                error_max = fmax(error_max, error);
+            }
+        }
+        const int n_frame = (int)frames.size();
+
+        std::cerr << "isosurface " << mesher_name << " " << name << ": " << (double)n_triangle / n_frame << " triangles/frame, "
+                  << total_seconds / n_frame * 1e3 << " ms/frame, surface error " << error_sum / n_vertex << " A mean, " << error_max << " A max" << std::endl;
+
+        json.beginObject();
+        json.value("molecule", name);
+        json.value("mesher", std::string(mesher_name));
+        json.value("n_frame", n_frame);
+        json.value("mean_ms_per_frame", total_seconds / n_frame * 1e3);
+        json.value("mean_vertices", (double)n_vertex / n_frame);
+        json.value("mean_triangles", (double)n_triangle / n_frame);
+        json.value("mean_surface_error", error_sum / n_vertex);
+        json.value("max_surface_error", error_max);
+        json.endObject();
+        return true;
+    }
+
+    // The fixed cost of a parallelFor on the worker pool, with as many empty tasks as threads
+    void benchmarkParallelFor(JsonWriter& json, const int n_thread)
+    {
+        ThreadPool::setThreadCount(n_thread);
+        std::atomic<int> n_done{ 0 };
+        int n_repeat;
+        double seconds = timeRepeated([&]() {
+            ThreadPool::parallelFor(std::max(n_thread, 2), [&](const int) { n_done++; });
+        }, n_repeat);
+
+        std::cerr << "parallelFor " << n_thread << " threads: " << seconds * 1e6 << " us/call" << std::endl;
+
+        json.beginObject();
+        json.value("n_thread", n_thread);
+        json.value("repeats", n_repeat);
+        json.value("us_per_call", seconds * 1e6);
+        json.endObject();
+    }
+
+    inline bool sameVertex(const Vertex& a, const Vertex& b)
+    {
+        return a.pos == b.pos && a.color == b.color && a.normal == b.normal && a.render_type == b.render_type;
+    }
+
+    // Every field of every frame is rendered with 1 thread and then with each of thread_counts, the meshes have to be identical
+    bool checkThreadDeterminism(JsonWriter& json, const std::string& name, const std::vector<MoleculeStruct::MolecularDataOneFrame*>& frames,
+                                const std::vector<int>& thread_counts)
+    {
+        int n_mismatch = 0;
+        std::vector<Vertex> reference_vertices, vertices;
+        std::vector<uint32_t> reference_indices, indices;
+        for (GridEvaluator::FieldType field : { GridEvaluator::FieldType::Orbital, GridEvaluator::FieldType::Density, GridEvaluator::FieldType::SpinDensity })
+            for (const MoleculeStruct::MolecularDataOneFrame* frame : frames)
+            {
+                reference_vertices.clear();
+                reference_indices.clear();
+                ThreadPool::setThreadCount(1);
+                if (!MeshRenderer::renderOrbital(frame, reference_vertices, reference_indices, field))
+                    return false;
+                for (int n_thread : thread_counts)
+                {
+                    vertices.clear();
+                    indices.clear();
+                    ThreadPool::setThreadCount(n_thread);
+                    if (!MeshRenderer::renderOrbital(frame, vertices, indices, field))
+                        return false;
+                    if (indices != reference_indices || vertices.size() != reference_vertices.size() ||
+                        !std::equal(vertices.begin(), vertices.end(), reference_vertices.begin(), sameVertex))
+                        n_mismatch++;
+                }
+            }
+
+        std::cerr << "thread determinism " << name << ": " << frames.size() << " frames, 3 fields, "
+                  << (n_mismatch == 0 ? "identical meshes" : std::to_string(n_mismatch) + " meshes differ from 1 thread") << std::endl;
+
+        json.beginObject();
+        json.value("molecule", name);
+        json.value("n_frame", (int)frames.size());
+        json.beginArray("thread_counts");
+        for (int n_thread : thread_counts)
+            json.value(nullptr, n_thread);
+        json.endArray();
+        json.value("n_mismatch", n_mismatch);
+        json.endObject();
+        return n_mismatch == 0;
+    }
+
+    // Levels of detail of the orbital isosurface, each half of the previous one
+    bool benchmarkLodChain(JsonWriter& json, const std::string& name, const MoleculeStruct::MolecularDataOneFrame* const frame)
+    {
+        const int n_level = 5;
+        const float triangle_ratio = 0.5f;
+        std::vector<Vertex> vertices;
+        std::vector<uint32_t> indices;
+        if (!MeshRenderer::renderOrbital(frame, vertices, indices))
+            return false;
+
+        std::vector<std::vector<uint32_t>> levels;
+        int n_repeat = 0;
+        const double seconds = timeRepeated([&]()
+        {
+            MeshSimplifier::buildLodChain(vertices, indices, 0, n_level, triangle_ratio, 0, levels);
+        }, n_repeat);
+
+        std::cerr << "buildLodChain " << name << ": " << indices.size() / 3 << " triangles, " << levels.size() << " levels in " << seconds * 1e3 << " ms" << std::endl;
+
+        json.beginObject();
+        json.value("molecule", name);
+        json.value("triangle_ratio", (double)triangle_ratio);
+        json.value("ms_per_chain", seconds * 1e3);
+        json.beginArray("level_triangles");
+        for (const std::vector<uint32_t>& level : levels)
+            json.value(nullptr, (int)(level.size() / 3));
+        json.endArray();
+        json.endObject();
+        return true;
+    }
+}
+
+int main(int argc, char** argv)
+{
+    std::string demo_path = "../molecule_demo/demo";
+    std::string output_path;
+    bool quick = false;
+    int thread_count = 0;
+    for (int i_arg = 1; i_arg < argc; i_arg++)
+    {
+        std::string arg = argv[i_arg];
+        if (arg == "--demo" && i_arg + 1 < argc)
+            demo_path = argv[++i_arg];
+        else if (arg == "--output" && i_arg + 1 < argc)
+            output_path = argv[++i_arg];
+        else if (arg == "--quick")
+            quick = true;
+        else if (arg == "--threads" && i_arg + 1 < argc)
+            thread_count = std::stoi(argv[++i_arg]);
+        else
+        {
+            std::cerr << "Usage: " << argv[0] << " [--demo path_prefix] [--output file.json] [--quick] [--threads n]" << std::endl;
+            return EXIT_FAILURE;
+        }
+    }
+    if (quick)
+        KernelBenchmark::min_seconds_per_case = 0.05;
+    const int hardware_thread_count = std::max(1, (int)std::thread::hardware_concurrency());
+    const int benchmark_thread_count = thread_count > 0 ? thread_count : hardware_thread_count;
+
+    std::vector<MoleculeStruct::MolecularDataOneFrame*> trajectory = MoleculeReader::readWholeTrajectory(demo_path.c_str());
+    if (trajectory.empty())
+        std::cerr << "No demo trajectory at " << demo_path << ", only the synthetic molecules are benchmarked" << std::endl;
+
+    const std::vector<int> orbital_atom_counts = quick ? std::vector<int>{ 2, 8, 32 } : std::vector<int>{ 2, 8, 32, 128, 512 };
+    const std::vector<int> bond_atom_counts = quick ? std::vector<int>{ 64, 512 } : std::vector<int>{ 64, 512, 4096, 32768 };
+    const std::vector<int> polygonise_dimensions = quick ? std::vector<int>{ 32 } : std::vector<int>{ 32, 64, 128 };
+    const std::vector<int> render_atom_counts = quick ? std::vector<int>{ 8 } : std::vector<int>{ 8, 27, 64 };
+    const int n_render_demo_frame = quick ? 5 : (int)trajectory.size();
+
+    std::ostringstream json_text;
+    KernelBenchmark::JsonWriter json(json_text);
+    json.beginObject();
+    json.value("benchmark", std::string("kernel_benchmark"));
+    json.value("exp_backend", std::string(FastExp::getBackendName(FastExp::getBackend())));
+    json.value("min_seconds_per_case", KernelBenchmark::min_seconds_per_case);
+    json.value("thread_count", benchmark_thread_count);
+
+    json.beginArray("parallel_for");
+    for (int n_thread : { 1, 2, benchmark_thread_count })
+        KernelBenchmark::benchmarkParallelFor(json, n_thread);
+    json.endArray();
+    ThreadPool::setThreadCount(thread_count);
+
+    json.beginArray("evaluate_orbital");
+    for (int n_atom : orbital_atom_counts)
+    {
+        MoleculeStruct::MolecularDataOneFrame* frame = KernelBenchmark::buildSyntheticCarbon(n_atom);
+        KernelBenchmark::benchmarkEvaluateOrbital(json, "carbon_" + std::to_string(n_atom), frame);
+        delete frame;
+    }
+    if (!trajectory.empty())
+        KernelBenchmark::benchmarkEvaluateOrbital(json, "demo", trajectory[0]);
+    json.endArray();
+
+    json.beginArray("get_bonds");
+    for (int n_atom : bond_atom_counts)
+    {
+        MoleculeStruct::MolecularDataOneFrame* frame = KernelBenchmark::buildSyntheticCarbon(n_atom);
+        KernelBenchmark::benchmarkGetBonds(json, "carbon_" + std::to_string(n_atom), frame);
+        delete frame;
+    }
+    if (!trajectory.empty())
+        KernelBenchmark::benchmarkGetBonds(json, "demo", trajectory[0]);
+    json.endArray();
+
+    json.beginArray("polygonise");
+    for (int grid_dimension : polygonise_dimensions)
+        KernelBenchmark::benchmarkPolygonise(json, grid_dimension);
+    json.endArray();
+
+    bool success = true;
+    json.beginArray("render_orbital");
+    for (int n_atom : render_atom_counts)
+    {
+        std::vector<MoleculeStruct::MolecularDataOneFrame*> frames{ KernelBenchmark::buildSyntheticCarbon(n_atom) };
+        success = success && KernelBenchmark::benchmarkRenderOrbital(json, "carbon_" + std::to_string(n_atom), frames);
+        delete frames[0];
+    }
+    if (!trajectory.empty())
+    {
+        std::vector<MoleculeStruct::MolecularDataOneFrame*> frames(trajectory.begin(), trajectory.begin() + std::min(n_render_demo_frame, (int)trajectory.size()));
+        success = success && KernelBenchmark::benchmarkRenderOrbital(json, "demo", frames);
+    }
+    json.endArray();
+
+    // Thread counts that split the chunks unevenly as well, restored afterwards
+    json.beginArray("thread_determinism");
+    const std::vector<int> determinism_thread_counts{ 2, 3, std::max(benchmark_thread_count, 4) };
+    for (int n_atom : render_atom_counts)
+    {
+        std::vector<MoleculeStruct::MolecularDataOneFrame*> frames{ KernelBenchmark::buildSyntheticCarbon(n_atom) };
+        success = KernelBenchmark::checkThreadDeterminism(json, "carbon_" + std::to_string(n_atom), frames, determinism_thread_counts) && success;
+        delete frames[0];
+    }
+    if (!trajectory.empty())
+    {
+        std::vector<MoleculeStruct::MolecularDataOneFrame*> frames;
+        for (int i_frame = 0; i_frame < (int)trajectory.size(); i_frame += quick ? 100 : 10)
+            frames.push_back(trajectory[i_frame]);
+        success = KernelBenchmark::checkThreadDeterminism(json, "demo", frames, determinism_thread_counts) && success;
+    }
+    json.endArray();
+    ThreadPool::setThreadCount(thread_count);
+
+    json.beginArray("lod_chain");
+    for (int n_atom : render_atom_counts)
+    {
+        MoleculeStruct::MolecularDataOneFrame* frame = KernelBenchmark::buildSyntheticCarbon(n_atom);
+        success = success && KernelBenchmark::benchmarkLodChain(json, "carbon_" + std::to_string(n_atom), frame);
+        delete frame;
+    }
+    if (!trajectory.empty())
+        success = success && KernelBenchmark::benchmarkLodChain(json, "demo", trajectory[0]);
+    json.endArray();
+
+    json.beginArray("isosurface_mesher");
+    for (MeshRenderer::IsosurfaceMesher mesher : { MeshRenderer::IsosurfaceMesher::MarchingCubes, MeshRenderer::IsosurfaceMesher::SurfaceNets })
+    {
+        for (int n_atom : render_atom_counts)
+        {
+            std::vector<MoleculeStruct::MolecularDataOneFrame*> frames{ KernelBenchmark::buildSyntheticCarbon(n_atom) };
+            success = success && KernelBenchmark::benchmarkMesher(json, "carbon_" + std::to_string(n_atom), mesher, frames);
+            delete frames[0];
+        }
+        if (!trajectory.empty())
+        {
+            std::vector<MoleculeStruct::MolecularDataOneFrame*> frames(trajectory.begin(), trajectory.begin() + std::min(n_render_demo_frame, (int)trajectory.size()));
+            success = success && KernelBenchmark::benchmarkMesher(json, "demo", mesher, frames);
+        }
+    }
+    json.endArray();
+    json.endObject();
+
+    MoleculeReader::clearTrajectory(trajectory);
+
+    if (output_path.empty())
+        std::cout << json_text.str();
+    else
+    {
+        std::ofstream output_file(output_path);
+        if (!output_file)
+        {
+            std::cerr << "Cannot write " << output_path << std::endl;
+            return EXIT_FAILURE;
+        }
+        output_file << json_text.str();
+    }
+
+    return success ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -7,7 +7,6 @@
 /* layout(location = 0) in dvec3 inPosition; */
 
 layout(binding = 0) uniform UniformBufferObject {
-    mat4 model;
     mat4 view;
     mat4 proj;
     vec3 camera_pos;
@@ -15,10 +14,21 @@ layout(binding = 0) uniform UniformBufferObject {
     vec3 light_color;
 } ubo;
 
+// Same block as the vertex shader, the impostors need the model transform for their depth
+layout(push_constant) uniform DrawConstants {
+    mat4 model;
+    vec4 position_offset;
+    vec4 position_scale;
+    int render_type;
+} draw;
+
 layout(location = 0) in vec3 fragPos;
 layout(location = 1) in vec3 fragColor;
 layout(location = 2) in vec3 fragNormal;
 layout(location = 3) flat in uint fragRenderType;
+layout(location = 4) flat in vec4 fragInstancePositionRadius;
+layout(location = 5) flat in vec3 fragInstanceAxis;
+layout(location = 6) flat in vec3 fragCameraPos;
 
 layout(location = 0) out vec4 outColor;
 
@@ -33,25 +43,86 @@ vec3 Diffuse_BRDF(vec3 L, vec3 N, vec3 diffuseColor) {
     return diffuseColor * max(dot(N, L), 0.);
 }
 
+vec4 Molecule_Color(vec3 position, vec3 normal)
+{
+    vec3 N = normalize(normal);
+    vec3 L = normalize(ubo.light_pos - position);
+    // vec3 V = normalize(ubo.camera_pos - position);
+
+    vec3 color = 0.2 * fragColor; // ambient
+    color += ubo.light_color * Diffuse_BRDF(L, N, fragColor);
+    // Phong_BRDF(L, V, N, fragColor, vec3(1,1,1), 3);
+    // No decay of light over distance is accounted.
+
+    return vec4(color, 1);
+}
+
+#ifdef IMPOSTOR
+// Depth of an object space point, as the rasterizer would have written it for a mesh there
+float Fragment_Depth(vec3 position)
+{
+    vec4 clip = ubo.proj * ubo.view * draw.model * vec4(position, 1.0);
+    return clip.z / clip.w;
+}
+#endif
+
 void main()
 {
+#ifdef IMPOSTOR
+    // Compiled with -DIMPOSTOR for the pipeline of the impostor layers only, since writing the depth turns off early depth
+    // testing. Every path has to write it once one does, the impostors replace it with the depth of their hit.
+    gl_FragDepth = gl_FragCoord.z;
+    vec3 ray = normalize(fragPos - fragCameraPos);
+#endif
+
     switch (fragRenderType)
     {
     case 0: // molecule
-        vec3 N = normalize(fragNormal);
-        vec3 L = normalize(ubo.light_pos - fragPos);
-        // vec3 V = normalize(ubo.camera_pos - fragPos);
+        outColor = Molecule_Color(fragPos, fragNormal);
+        break;
+    case 1: // orbital
+        vec3 N_orbital = normalize(fragNormal);
+        vec3 L_orbital = normalize(ubo.light_pos - fragPos);
 
-        vec3 color = 0.2 * fragColor; // ambient
-        color += ubo.light_color * Diffuse_BRDF(L, N, fragColor);
-        // Phong_BRDF(L, V, N, fragColor, vec3(1,1,1), 3);
-        // No decay of light over distance is accounted.
+        vec3 color_orbital = 0.4 * fragColor; // ambient, brighter than molecule since the surface is transparent
+        color_orbital += ubo.light_color * Diffuse_BRDF(L_orbital, N_orbital, fragColor);
 
-        outColor = vec4(color, 1);
+        outColor = vec4(color_orbital, 0.25);
         break;
-    case 1: // orbital
-        outColor = vec4(fragColor, 0.25);
+#ifdef IMPOSTOR
+    case 4: // sphere impostor, nearest intersection of the view ray with the atom
+        vec3 to_camera = fragCameraPos - fragInstancePositionRadius.xyz;
+        float b = dot(to_camera, ray);
+        float h = b * b - dot(to_camera, to_camera) + fragInstancePositionRadius.w * fragInstancePositionRadius.w;
+        if (h < 0)
+            discard;
+        vec3 sphere_hit = fragCameraPos + (-b - sqrt(h)) * ray;
+
+        outColor = Molecule_Color(sphere_hit, sphere_hit - fragInstancePositionRadius.xyz);
+        gl_FragDepth = Fragment_Depth(sphere_hit);
+        break;
+    case 5: // cylinder impostor, nearest intersection with the side of the half bond, the ends are inside the atom or the other half
+        float half_bond_length = length(fragInstanceAxis);
+        vec3 axis = fragInstanceAxis / half_bond_length;
+        float cylinder_radius = 0.5 * fragInstancePositionRadius.w; // radius of the cylinder mesh
+        vec3 from_start = fragCameraPos - fragInstancePositionRadius.xyz;
+        vec3 ray_across = ray - dot(ray, axis) * axis;
+        vec3 from_start_across = from_start - dot(from_start, axis) * axis;
+
+        float qa = dot(ray_across, ray_across);
+        float qb = dot(from_start_across, ray_across);
+        float qh = qb * qb - qa * (dot(from_start_across, from_start_across) - cylinder_radius * cylinder_radius);
+        if (qa < 1e-12 || qh < 0) // looking down the axis, or missing the infinite cylinder
+            discard;
+        vec3 cylinder_hit = fragCameraPos + ((-qb - sqrt(qh)) / qa) * ray;
+        float along_axis = dot(cylinder_hit - fragInstancePositionRadius.xyz, axis);
+        if (along_axis < 0 || along_axis > half_bond_length)
+            discard;
+
+        outColor = Molecule_Color(cylinder_hit, cylinder_hit - fragInstancePositionRadius.xyz - along_axis * axis);
+        gl_FragDepth = Fragment_Depth(cylinder_hit);
         break;
+#endif
     default:
         outColor = vec4(0.5,0.5,0.5,1);
         break;
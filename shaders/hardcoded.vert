@@ -3,7 +3,6 @@
 
 // binding is like location for uniforms
 layout(binding = 0) uniform UniformBufferObject {
-    mat4 model;
     mat4 view;
     mat4 proj;
     vec3 camera_pos;
@@ -11,24 +10,122 @@ layout(binding = 0) uniform UniformBufferObject {
     vec3 light_color;
 } ubo;
 
+// Per draw: the object to world transform, the bounding box that CompactVertex positions are quantized in, and the render
+// type of every vertex of the draw, -1 to read it from the vertices
+layout(push_constant) uniform DrawConstants {
+    mat4 model;
+    vec4 position_offset;
+    vec4 position_scale;
+    int render_type;
+} draw;
+
+#ifdef COMPACT_VERTEX
+// CompactVertex: the position is a unorm in the bounding box of the bound vertex buffer, the normal is octahedral encoded
+layout(location = 0) in vec3 inQuantizedPosition;
+layout(location = 1) in vec3 inColor;
+layout(location = 2) in vec2 inOctahedralNormal;
+layout(location = 3) in uint inRenderType;
+
+vec3 decodeOctahedral(vec2 encoded)
+{
+    vec3 normal = vec3(encoded, 1.0 - abs(encoded.x) - abs(encoded.y));
+    float fold = max(-normal.z, 0.0); // unfolds the lower half
+    normal.x += normal.x >= 0.0 ? -fold : fold;
+    normal.y += normal.y >= 0.0 ? -fold : fold;
+    return normal; // normalized by the fragment shader
+}
+#else
 layout(location = 0) in vec3 inPosition;
 layout(location = 1) in vec3 inColor;
 layout(location = 2) in vec3 inNormal;
 layout(location = 3) in uint inRenderType;
+#endif
+// Per instance, only read by the instanced sphere and cylinder meshes and their impostors
+layout(location = 4) in vec4 inInstancePositionRadius;
+layout(location = 5) in vec3 inInstanceAxis;
+layout(location = 6) in vec4 inInstanceColor;
 
 layout(location = 0) out vec3 fragPos;
 layout(location = 1) out vec3 fragColor;
 layout(location = 2) out vec3 fragNormal;
 layout(location = 3) flat out uint fragRenderType;
+// For the impostors to ray cast their instance in object space
+layout(location = 4) flat out vec4 fragInstancePositionRadius;
+layout(location = 5) flat out vec3 fragInstanceAxis;
+layout(location = 6) flat out vec3 fragCameraPos;
 
 // gl_VertexIndex is an implicit input variable for vertex shaders
 // gl_Position is a built_in output
 void main() 
 {
-    gl_Position = ubo.proj * ubo.view * ubo.model * vec4(inPosition, 1.0);
+#ifdef COMPACT_VERTEX
+    vec3 inPosition = draw.position_offset.xyz + draw.position_scale.xyz * inQuantizedPosition;
+    vec3 inNormal = decodeOctahedral(inOctahedralNormal);
+#endif
+    vec3 camera_pos = (inverse(draw.model) * vec4(ubo.camera_pos, 1.0)).xyz;
+    vec3 position = inPosition;
+    vec3 color = inColor;
+    vec3 normal = inNormal;
+    uint vertex_render_type = draw.render_type >= 0 ? uint(draw.render_type) : inRenderType;
+    uint render_type = vertex_render_type;
+
+    if (vertex_render_type == 2u) // sphere mesh, one instance per atom
+    {
+        position = inInstancePositionRadius.xyz + inInstancePositionRadius.w * inPosition;
+        color = inInstanceColor.rgb;
+        render_type = 0u;
+    }
+    else if (vertex_render_type == 3u) // cylinder mesh along y from 0 to 2, one instance per half bond
+    {
+        float half_bond_length = length(inInstanceAxis);
+        vec3 direction = inInstanceAxis / half_bond_length;
+        vec3 side = cross(vec3(0, 0, 1), direction);
+        if (dot(side, side) < 1e-6) // bond along z
+            side = cross(vec3(1, 0, 0), direction);
+        side = normalize(side);
+        mat3 rotation = mat3(side, direction, normalize(cross(side, direction)));
+
+        float radius = inInstancePositionRadius.w;
+        position = inInstancePositionRadius.xyz + rotation * (vec3(radius, half_bond_length / 2, radius) * inPosition);
+        normal = rotation * inNormal;
+        color = inInstanceColor.rgb;
+        render_type = 0u;
+    }
+    else if (vertex_render_type == 4u) // sphere impostor, a quad in front of the atom facing the camera that covers its silhouette
+    {
+        vec3 center = inInstancePositionRadius.xyz;
+        float radius = inInstancePositionRadius.w;
+        vec3 toward = normalize(camera_pos - center);
+        vec3 right = cross(toward, vec3(0, 0, 1));
+        if (dot(right, right) < 1e-6) // camera straight above or below
+            right = cross(toward, vec3(1, 0, 0));
+        right = normalize(right);
+        vec3 up = cross(right, toward);
+        position = center + radius * (toward + inPosition.x * right + inPosition.y * up);
+        color = inInstanceColor.rgb;
+    }
+    else if (vertex_render_type == 5u) // cylinder impostor, the box around the cylinder mesh of the same half bond
+    {
+        float half_bond_length = length(inInstanceAxis);
+        vec3 direction = inInstanceAxis / half_bond_length;
+        vec3 side = cross(vec3(0, 0, 1), direction);
+        if (dot(side, side) < 1e-6)
+            side = cross(vec3(1, 0, 0), direction);
+        side = normalize(side);
+        mat3 rotation = mat3(side, direction, normalize(cross(side, direction)));
+
+        float radius = inInstancePositionRadius.w;
+        position = inInstancePositionRadius.xyz + rotation * (vec3(radius, half_bond_length / 2, radius) * inPosition);
+        color = inInstanceColor.rgb;
+    }
+
+    gl_Position = ubo.proj * ubo.view * draw.model * vec4(position, 1.0);
 
-    fragColor = inColor;
-    fragNormal = inNormal;
-    fragPos = inPosition;
-    fragRenderType = inRenderType;
+    fragColor = color;
+    fragNormal = normal;
+    fragPos = position;
+    fragRenderType = render_type;
+    fragInstancePositionRadius = inInstancePositionRadius;
+    fragInstanceAxis = inInstanceAxis;
+    fragCameraPos = camera_pos;
 }
@@ -0,0 +1,273 @@
+#include <math.h>
+#include <stdint.h>
+#include <chrono>
+#include <iostream>
+#include <unordered_map>
+
+#include "accuracy_harness.h"
+#include "fast_exp.h"
+#include "grid_evaluator.h"
+#include "mesh_renderer.h"
+
+namespace AccuracyHarness
+{
+    const float sample_grid_spacing = 0.2f;
+    const float sample_grid_extension = 3.0f;
+    const float relative_error_floor = 1e-3f; // Relative psi error is only counted where |psi| is above this, far below the isovalue
+    const float vertex_hash_cell = 0.125f; // The finest voxel of renderOrbital
+    const float far_from_origin_translation = 100.0f; // Where float coordinates start to lose digits in x - X
+
+    int64_t vertexHashKey(const int i_x, const int i_y, const int i_z)
+    {
+        return ((int64_t)(i_x & 0x1fffff) << 42) | ((int64_t)(i_y & 0x1fffff) << 21) | (int64_t)(i_z & 0x1fffff);
+    }
+
+    // For every test vertex the distance to the nearest reference vertex, searched in the 27 neighboring hash cells.
+    // Test vertices without any reference vertex in that neighborhood are counted as unmatched.
+    void measureVertexDisplacement(const std::vector<Vertex>& reference, const std::vector<Vertex>& test,
+                                   float& max_displacement, float& mean_displacement, int& n_unmatched)
+    {
+        std::unordered_map<int64_t, std::vector<int>> reference_hash;
+        for (int i_vertex = 0; i_vertex < (int)reference.size(); i_vertex++)
+        {
+            glm::vec3 cell = glm::floor(reference[i_vertex].pos / vertex_hash_cell);
+            reference_hash[vertexHashKey((int)cell.x, (int)cell.y, (int)cell.z)].push_back(i_vertex);
+        }
+
+        max_displacement = 0, mean_displacement = 0, n_unmatched = 0;
+        int n_matched = 0;
+        for (const Vertex& vertex : test)
+        {
+            glm::vec3 cell = glm::floor(vertex.pos / vertex_hash_cell);
+            float nearest_distance = INFINITY;
+            for (int i_x = -1; i_x <= 1; i_x++)
+                for (int i_y = -1; i_y <= 1; i_y++)
+                    for (int i_z = -1; i_z <= 1; i_z++)
+                    {
+                        auto found = reference_hash.find(vertexHashKey((int)cell.x + i_x, (int)cell.y + i_y, (int)cell.z + i_z));
+                        if (found == reference_hash.end())
+                            continue;
+                        for (int i_reference : found->second)
+                            nearest_distance = fminf(nearest_distance, glm::distance(vertex.pos, reference[i_reference].pos));
+                    }
+
+            if (isinf(nearest_distance))
+            {
+                n_unmatched++;
+                continue;
+            }
+            max_displacement = fmaxf(max_displacement, nearest_distance);
+            mean_displacement += nearest_distance;
+            n_matched++;
+        }
+        if (n_matched > 0)
+            mean_displacement /= n_matched;
+    }
+
+    // Axis aligned sample grid over the molecule plus a margin
+    int buildSampleGrid(const MoleculeStruct::MolecularDataOneFrame* const frame, float grid_origin[3], float grid_unit_cell[3], int grid_dimension[3])
+    {
+        for (int i_xyz = 0; i_xyz < 3; i_xyz++)
+        {
+            float coordinate_min = frame->atoms[0].xyz[i_xyz], coordinate_max = frame->atoms[0].xyz[i_xyz];
+            for (int i_atom = 1; i_atom < frame->n_atom; i_atom++)
+            {
+                coordinate_min = fminf(coordinate_min, frame->atoms[i_atom].xyz[i_xyz]);
+                coordinate_max = fmaxf(coordinate_max, frame->atoms[i_atom].xyz[i_xyz]);
+            }
+            grid_origin[i_xyz] = coordinate_min - sample_grid_extension;
+            grid_unit_cell[i_xyz] = sample_grid_spacing;
+            grid_dimension[i_xyz] = ceilf((coordinate_max - coordinate_min + 2 * sample_grid_extension) / sample_grid_spacing);
+        }
+        return (grid_dimension[0] + 1) * (grid_dimension[1] + 1) * (grid_dimension[2] + 1);
+    }
+
+    bool compareExpBackends(const std::vector<MoleculeStruct::MolecularDataOneFrame*>& trajectory)
+    {
+        if (trajectory.empty())
+        {
+            std::cout << "No frame to compare exp backends on!" << std::endl;
+            return false;
+        }
+
+        const FastExp::Backend backend_before = FastExp::getBackend();
+        const int reference_frames[3]{ 0, (int)trajectory.size() / 2, (int)trajectory.size() - 1 };
+
+        for (int i_reference = 0; i_reference < 3; i_reference++)
+        {
+            if (i_reference > 0 && reference_frames[i_reference] == reference_frames[i_reference - 1])
+                continue;
+            const MoleculeStruct::MolecularDataOneFrame* const frame = trajectory[reference_frames[i_reference]];
+
+            float grid_origin[3], grid_unit_cell[3];
+            int grid_dimension[3];
+            const int n_point = buildSampleGrid(frame, grid_origin, grid_unit_cell, grid_dimension);
+
+            std::vector<float> reference_values(n_point), test_values(n_point);
+            std::vector<Vertex> reference_vertices;
+
+            std::cout << "Frame " << reference_frames[i_reference] << ", " << n_point << " sample points" << std::endl;
+            for (int i_backend = 0; i_backend < FastExp::n_backend; i_backend++)
+            {
+                const FastExp::Backend backend = (FastExp::Backend)i_backend;
+                FastExp::setBackend(backend);
+                std::vector<float>& values = backend == FastExp::Backend::Libm ? reference_values : test_values;
+
+                auto time_begin = std::chrono::high_resolution_clock::now();
+                GridEvaluator::evaluateGrid(GridEvaluator::FieldType::Orbital, frame, grid_origin, grid_unit_cell, grid_dimension, values.data());
+                auto time_end = std::chrono::high_resolution_clock::now();
+                double seconds = std::chrono::duration<double>(time_end - time_begin).count();
+
+                std::vector<Vertex> vertices;
+                std::vector<uint32_t> indices;
+                if (!MeshRenderer::renderOrbital(frame, vertices, indices))
+                {
+                    FastExp::setBackend(backend_before);
+                    return false;
+                }
+
+                std::cout << "    " << FastExp::getBackendName(backend) << ": " << n_point / seconds / 1e6 << " Mpoints/s";
+                if (backend == FastExp::Backend::Libm)
+                {
+                    reference_vertices = vertices;
+                    std::cout << ", reference with " << vertices.size() << " vertices" << std::endl;
+                    continue;
+                }
+
+                float max_absolute_error = 0, max_relative_error = 0;
+                for (int i_point = 0; i_point < n_point; i_point++)
+                {
+                    float error = fabsf(test_values[i_point] - reference_values[i_point]);
+                    max_absolute_error = fmaxf(max_absolute_error, error);
+                    if (fabsf(reference_values[i_point]) > relative_error_floor)
+                        max_relative_error = fmaxf(max_relative_error, error / fabsf(reference_values[i_point]));
+                }
+
+                float max_displacement, mean_displacement;
+                int n_unmatched;
+                measureVertexDisplacement(reference_vertices, vertices, max_displacement, mean_displacement, n_unmatched);
+
+                std::cout << ", max |dpsi| " << max_absolute_error
+                          << ", max relative dpsi " << max_relative_error
+                          << ", vertices " << vertices.size() << " (" << (int)vertices.size() - (int)reference_vertices.size() << ")"
+                          << ", vertex displacement max " << max_displacement << " A mean " << mean_displacement << " A"
+                          << ", unmatched " << n_unmatched << std::endl;
+            }
+        }
+
+        FastExp::setBackend(backend_before);
+        return true;
+    }
+
+    struct PrecisionResult
+    {
+        std::vector<float> orbital, density;
+        std::vector<Vertex> vertices;
+        double orbital_seconds, density_seconds, mesh_seconds;
+    };
+
+    template <typename Precision>
+    bool runPrecision(const MoleculeStruct::MolecularDataOneFrame* const frame, PrecisionResult& result)
+    {
+        float grid_origin[3], grid_unit_cell[3];
+        int grid_dimension[3];
+        const int n_point = buildSampleGrid(frame, grid_origin, grid_unit_cell, grid_dimension);
+        result.orbital.resize(n_point);
+        result.density.resize(n_point);
+
+        auto time_begin = std::chrono::high_resolution_clock::now();
+        GridEvaluator::evaluateGrid<Precision>(GridEvaluator::FieldType::Orbital, frame, grid_origin, grid_unit_cell, grid_dimension, result.orbital.data());
+        auto time_orbital = std::chrono::high_resolution_clock::now();
+        GridEvaluator::evaluateGrid<Precision>(GridEvaluator::FieldType::Density, frame, grid_origin, grid_unit_cell, grid_dimension, result.density.data());
+        auto time_density = std::chrono::high_resolution_clock::now();
+        std::vector<uint32_t> indices;
+        bool success = MeshRenderer::renderOrbital<Precision>(frame, result.vertices, indices);
+        auto time_mesh = std::chrono::high_resolution_clock::now();
+
+        result.orbital_seconds = std::chrono::duration<double>(time_orbital - time_begin).count();
+        result.density_seconds = std::chrono::duration<double>(time_density - time_orbital).count();
+        result.mesh_seconds = std::chrono::duration<double>(time_mesh - time_density).count();
+        return success;
+    }
+
+    void printPrecisionResult(const char* const name, const PrecisionResult& result, const PrecisionResult& reference)
+    {
+        const int n_point = reference.orbital.size();
+        float max_orbital_error = 0, max_orbital_relative_error = 0, max_density_error = 0;
+        for (int i_point = 0; i_point < n_point; i_point++)
+        {
+            float orbital_error = fabsf(result.orbital[i_point] - reference.orbital[i_point]);
+            max_orbital_error = fmaxf(max_orbital_error, orbital_error);
+            if (fabsf(reference.orbital[i_point]) > relative_error_floor)
+                max_orbital_relative_error = fmaxf(max_orbital_relative_error, orbital_error / fabsf(reference.orbital[i_point]));
+            max_density_error = fmaxf(max_density_error, fabsf(result.density[i_point] - reference.density[i_point]));
+        }
+
+        float max_displacement, mean_displacement;
+        int n_unmatched;
+        measureVertexDisplacement(reference.vertices, result.vertices, max_displacement, mean_displacement, n_unmatched);
+
+        std::cout << "    " << name << ": psi " << n_point / result.orbital_seconds / 1e6 << " Mpoints/s"
+                  << ", density " << n_point / result.density_seconds / 1e6 << " Mpoints/s"
+                  << ", isosurface " << result.mesh_seconds * 1e3 << " ms"
+                  << ", max |dpsi| " << max_orbital_error
+                  << ", max relative dpsi " << max_orbital_relative_error
+                  << ", max |drho| " << max_density_error
+                  << ", vertex displacement max " << max_displacement << " A mean " << mean_displacement << " A"
+                  << ", unmatched " << n_unmatched << std::endl;
+    }
+
+    bool comparePrecisions(const std::vector<MoleculeStruct::MolecularDataOneFrame*>& trajectory)
+    {
+        if (trajectory.empty())
+        {
+            std::cout << "No frame to compare precisions on!" << std::endl;
+            return false;
+        }
+        const MoleculeStruct::MolecularDataOneFrame* const frame = trajectory[trajectory.size() / 2];
+
+        // The same frame moved away from the origin, all other data copied
+        MoleculeStruct::MolecularDataOneFrame far_frame(frame->n_atom, frame->n_AO, frame->n_primitive);
+        far_frame.allocateOccupiedMO(frame->n_occupied_MO);
+        for (int i_atom = 0; i_atom < frame->n_atom; i_atom++)
+        {
+            far_frame.atoms[i_atom] = frame->atoms[i_atom];
+            for (int i_xyz = 0; i_xyz < 3; i_xyz++)
+                far_frame.atoms[i_atom].xyz[i_xyz] += far_from_origin_translation;
+        }
+        for (int i_ao = 0; i_ao < frame->n_AO; i_ao++)
+        {
+            far_frame.aos[i_ao] = frame->aos[i_ao];
+            for (int i_xyz = 0; i_xyz < 3; i_xyz++)
+                far_frame.aos[i_ao].xyz[i_xyz] += far_from_origin_translation;
+            far_frame.mo_coefficients[i_ao] = frame->mo_coefficients[i_ao];
+        }
+        for (int i_prim = 0; i_prim < frame->n_primitive; i_prim++)
+            far_frame.primitives[i_prim] = frame->primitives[i_prim];
+        for (int i = 0; i < frame->n_occupied_MO * frame->n_AO; i++)
+            far_frame.occupied_mo_coefficients[i] = frame->occupied_mo_coefficients[i];
+        for (int i_mo = 0; i_mo < frame->n_occupied_MO; i_mo++)
+        {
+            far_frame.occupation_numbers[i_mo] = frame->occupation_numbers[i_mo];
+            far_frame.spin_occupation_numbers[i_mo] = frame->spin_occupation_numbers[i_mo];
+        }
+
+        const MoleculeStruct::MolecularDataOneFrame* const test_frames[2]{ frame, &far_frame };
+        for (int i_test = 0; i_test < 2; i_test++)
+        {
+            PrecisionResult result_float, result_mixed, result_double;
+            if (!runPrecision<MoleculeKernel::DoublePrecision>(test_frames[i_test], result_double)
+                || !runPrecision<MoleculeKernel::MixedPrecision>(test_frames[i_test], result_mixed)
+                || !runPrecision<MoleculeKernel::FloatPrecision>(test_frames[i_test], result_float))
+                return false;
+
+            std::cout << "Frame " << trajectory.size() / 2 << (i_test == 0 ? "" : ", moved far from the origin")
+                      << ", " << result_double.orbital.size() << " sample points, errors against double" << std::endl;
+            printPrecisionResult("double", result_double, result_double);
+            printPrecisionResult("mixed", result_mixed, result_double);
+            printPrecisionResult("float", result_float, result_double);
+        }
+
+        return true;
+    }
+}
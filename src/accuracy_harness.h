@@ -0,0 +1,16 @@
+#pragma once
+
+#include <vector>
+
+#include "molecule_struct.h"
+
+namespace AccuracyHarness
+{
+    // Compares every exp backend against libm on the first, middle and last frame of the trajectory:
+    // maximum psi error on a grid around the molecule, evaluation time, and how far the isosurface vertices move.
+    bool compareExpBackends(const std::vector<MoleculeStruct::MolecularDataOneFrame*>& trajectory);
+
+    // Times the float, mixed and double kernels on the middle frame, in place and moved far from the origin,
+    // and reports their psi and density error and isosurface vertex displacement against double.
+    bool comparePrecisions(const std::vector<MoleculeStruct::MolecularDataOneFrame*>& trajectory);
+}
@@ -0,0 +1,141 @@
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define FAST_EXP_SSE2
+#include <emmintrin.h>
+#endif
+
+#include "fast_exp.h"
+
+// exp(x) = 2^n * exp(r), n = round(x / ln2), r = x - n * ln2 in [-ln2/2, ln2/2].
+// ln2 is split in two so that n * LN2_HIGH is exact in float.
+#define LOG2E 1.44269504089f
+#define LN2_HIGH 0.693359375f
+#define LN2_LOW -2.12194440e-4f
+// exp of anything below is flushed to zero, about 1.8e-35. This keeps the results and their products with
+// the primitive prefactors out of the denormal range, where every arithmetic instruction becomes very slow.
+#define EXP_ARGUMENT_MIN -80.0f
+#define EXP_ARGUMENT_MAX 88.37626266f
+#define EXP_ROUNDING_MAGIC 12582912.0f
+
+// Minimax coefficients of (exp(r) - 1 - r) / r^2 on [-ln2/2, ln2/2], from Cephes expf
+#define EXP_P0 1.9875691500e-4f
+#define EXP_P1 1.3981999507e-3f
+#define EXP_P2 8.3334519073e-3f
+#define EXP_P3 4.1665795894e-2f
+#define EXP_P4 1.6666665459e-1f
+#define EXP_P5 5.0000001201e-1f
+
+namespace FastExp
+{
+    Backend selected_backend = Backend::Libm;
+
+    void setBackend(const Backend backend)
+    {
+        selected_backend = backend;
+    }
+
+    Backend getBackend()
+    {
+        return selected_backend;
+    }
+
+    const char* getBackendName(const Backend backend)
+    {
+        switch (backend)
+        {
+        case Backend::Libm:
+            return "libm";
+        case Backend::Polynomial:
+            return "polynomial";
+        case Backend::Vectorized:
+#ifdef FAST_EXP_SSE2
+            return "vectorized (SSE2)";
+#else
+            return "vectorized (scalar fallback)";
+#endif
+        default:
+            return "unknown";
+        }
+    }
+
+    float expPolynomial(const float x)
+    {
+        if (x < EXP_ARGUMENT_MIN)
+            return 0;
+        float x_clamped = fminf(x, EXP_ARGUMENT_MAX);
+
+        // Adding 1.5 * 2^23 rounds to the nearest integer without a call to floorf
+        float n = (x_clamped * LOG2E + EXP_ROUNDING_MAGIC) - EXP_ROUNDING_MAGIC;
+        float r = x_clamped - n * LN2_HIGH - n * LN2_LOW;
+
+        float p = EXP_P0;
+        p = p * r + EXP_P1;
+        p = p * r + EXP_P2;
+        p = p * r + EXP_P3;
+        p = p * r + EXP_P4;
+        p = p * r + EXP_P5;
+        float exp_r = p * r * r + r + 1;
+
+        // 2^n assembled directly in the exponent bits
+        int32_t two_to_n_bits = ((int32_t)n + 127) << 23;
+        float two_to_n;
+        memcpy(&two_to_n, &two_to_n_bits, sizeof(float));
+
+        return exp_r * two_to_n;
+    }
+
+#ifdef FAST_EXP_SSE2
+    inline __m128 expSSE2(const __m128 x)
+    {
+        __m128 underflow_mask = _mm_cmpge_ps(x, _mm_set1_ps(EXP_ARGUMENT_MIN));
+        __m128 x_clamped = _mm_min_ps(_mm_max_ps(x, _mm_set1_ps(EXP_ARGUMENT_MIN)), _mm_set1_ps(EXP_ARGUMENT_MAX));
+
+        // Rounding to nearest is the default MXCSR mode
+        __m128i n_int = _mm_cvtps_epi32(_mm_mul_ps(x_clamped, _mm_set1_ps(LOG2E)));
+        __m128 n = _mm_cvtepi32_ps(n_int);
+        __m128 r = _mm_sub_ps(_mm_sub_ps(x_clamped, _mm_mul_ps(n, _mm_set1_ps(LN2_HIGH))), _mm_mul_ps(n, _mm_set1_ps(LN2_LOW)));
+
+        __m128 p = _mm_set1_ps(EXP_P0);
+        p = _mm_add_ps(_mm_mul_ps(p, r), _mm_set1_ps(EXP_P1));
+        p = _mm_add_ps(_mm_mul_ps(p, r), _mm_set1_ps(EXP_P2));
+        p = _mm_add_ps(_mm_mul_ps(p, r), _mm_set1_ps(EXP_P3));
+        p = _mm_add_ps(_mm_mul_ps(p, r), _mm_set1_ps(EXP_P4));
+        p = _mm_add_ps(_mm_mul_ps(p, r), _mm_set1_ps(EXP_P5));
+        __m128 exp_r = _mm_add_ps(_mm_add_ps(_mm_mul_ps(p, _mm_mul_ps(r, r)), r), _mm_set1_ps(1));
+
+        __m128 two_to_n = _mm_castsi128_ps(_mm_slli_epi32(_mm_add_epi32(n_int, _mm_set1_epi32(127)), 23));
+
+        return _mm_and_ps(_mm_mul_ps(exp_r, two_to_n), underflow_mask);
+    }
+#endif
+
+    void expInPlace(float* const values, const int n)
+    {
+        expInPlace(selected_backend, values, n);
+    }
+
+    void expInPlace(const Backend backend, float* const values, const int n)
+    {
+        int i = 0;
+        switch (backend)
+        {
+        case Backend::Libm:
+            for (; i < n; i++)
+                values[i] = expf(values[i]);
+            break;
+        case Backend::Vectorized:
+#ifdef FAST_EXP_SSE2
+            for (; i + 4 <= n; i += 4)
+                _mm_storeu_ps(values + i, expSSE2(_mm_loadu_ps(values + i)));
+#endif
+            // The tail, or everything without SSE2, goes through the scalar polynomial
+        case Backend::Polynomial:
+            for (; i < n; i++)
+                values[i] = expPolynomial(values[i]);
+            break;
+        }
+    }
+}
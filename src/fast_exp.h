@@ -0,0 +1,22 @@
+#pragma once
+
+namespace FastExp
+{
+    enum class Backend
+    {
+        Libm, // expf from the C library, the reference
+        Polynomial, // Cody-Waite range reduction and a degree 7 polynomial, ~1e-7 relative error
+        Vectorized, // The same polynomial on 4 floats at a time with SSE2, scalar polynomial if SSE2 is not available
+    };
+    const int n_backend = 3;
+
+    void setBackend(const Backend backend);
+    Backend getBackend();
+    const char* getBackendName(const Backend backend);
+
+    // values[i] = exp(values[i]) with the selected backend. Arguments below -80 return 0 except with libm.
+    void expInPlace(float* const values, const int n);
+    void expInPlace(const Backend backend, float* const values, const int n);
+
+    float expPolynomial(const float x);
+}
@@ -0,0 +1,123 @@
+#include <stdexcept>
+
+#ifdef _WIN32
+#include <fcntl.h>
+#include <io.h>
+#else
+#include <signal.h>
+#endif
+
+#include "frame_sink.h"
+
+ImageSequenceSink::ImageSequenceSink(const std::string& output_prefix, const ImageWriter::Format format, const int encoder_thread_count)
+    : output_prefix(output_prefix), format(format), encoders(encoder_thread_count)
+{
+}
+
+std::future<void> ImageSequenceSink::write(const int i_frame,
+                                           const uint8_t* rgba,
+                                           const uint32_t width,
+                                           const uint32_t height,
+                                           const size_t row_pitch)
+{
+    std::string index = std::to_string(i_frame);
+    index.insert(0, index.size() < 5 ? 5 - index.size() : 0, '0');
+    return encoders.enqueue(output_prefix + index + ImageWriter::extension(format), format, rgba, width, height, row_pitch);
+}
+
+VideoStreamSink::VideoStreamSink(const std::string& path, const Format format, const int frame_rate)
+    : format(format), frame_rate(frame_rate), writer(new ImageWriter::EncoderPool(1))
+{
+    if (path == "-")
+    {
+        stream = stdout;
+#ifdef _WIN32
+        _setmode(_fileno(stdout), _O_BINARY); // no newline translation in the frames
+#endif
+    }
+    else
+    {
+        // A named pipe opens like a file, once its reader is there
+        stream = fopen(path.c_str(), "wb");
+        owns_stream = true;
+        if (stream == nullptr)
+            throw std::runtime_error("Failed to open video stream " + path);
+    }
+#ifndef _WIN32
+    // A reader that goes away would kill the process on the next write, rather fail that write with EPIPE and throw
+    previous_sigpipe_handler = signal(SIGPIPE, SIG_IGN);
+#endif
+}
+
+VideoStreamSink::~VideoStreamSink()
+{
+    writer.reset();
+    if (owns_stream)
+        fclose(stream);
+    else
+        fflush(stream);
+#ifndef _WIN32
+    signal(SIGPIPE, previous_sigpipe_handler);
+#endif
+}
+
+std::future<void> VideoStreamSink::write(const int /*i_frame*/,
+                                         const uint8_t* rgba,
+                                         const uint32_t width,
+                                         const uint32_t height,
+                                         const size_t row_pitch)
+{
+    return writer->enqueue([=]() { writeFrame(rgba, width, height, row_pitch); });
+}
+
+void VideoStreamSink::writeFrame(const uint8_t* rgba, const uint32_t width, const uint32_t height, const size_t row_pitch)
+{
+    bool success = true;
+    if (!header_written && format == Format::Y4M)
+    {
+        const std::string header = "YUV4MPEG2 W" + std::to_string(width) + " H" + std::to_string(height) + " F" +
+                                   std::to_string(frame_rate) + ":1 Ip A1:1 C444\n";
+        success &= fwrite(header.data(), 1, header.size(), stream) == header.size();
+    }
+    header_written = true;
+
+    if (format == Format::RGBA)
+    {
+        // Straight from the read back buffer, in one call when its rows are packed
+        const size_t row_size = 4 * (size_t)width;
+        if (row_pitch == row_size)
+            success &= fwrite(rgba, 1, row_size * height, stream) == row_size * height;
+        else
+            for (uint32_t i_row = 0; i_row < height; i_row++)
+                success &= fwrite(rgba + i_row * row_pitch, 1, row_size, stream) == row_size;
+    }
+    else
+    {
+        // Y, U and V planes at full resolution, BT.601 limited range in 8 bit fixed point
+        const size_t plane_size = (size_t)width * height;
+        planes.resize(3 * plane_size);
+        uint8_t* y_plane = planes.data();
+        uint8_t* u_plane = y_plane + plane_size;
+        uint8_t* v_plane = u_plane + plane_size;
+        for (uint32_t i_row = 0; i_row < height; i_row++)
+        {
+            const uint8_t* pixel = rgba + i_row * row_pitch;
+            for (uint32_t i_x = 0; i_x < width; i_x++, pixel += 4)
+            {
+                const int r = pixel[0], g = pixel[1], b = pixel[2];
+                const size_t i_pixel = (size_t)i_row * width + i_x;
+                y_plane[i_pixel] = (uint8_t)(((66 * r + 129 * g + 25 * b + 128) >> 8) + 16);
+                u_plane[i_pixel] = (uint8_t)(((-38 * r - 74 * g + 112 * b + 128) >> 8) + 128);
+                v_plane[i_pixel] = (uint8_t)(((112 * r - 94 * g - 18 * b + 128) >> 8) + 128);
+            }
+        }
+        const char frame_header[] = "FRAME\n";
+        success &= fwrite(frame_header, 1, sizeof(frame_header) - 1, stream) == sizeof(frame_header) - 1;
+        success &= fwrite(planes.data(), 1, planes.size(), stream) == planes.size();
+    }
+
+    // The encoder on the other end gets the frame now rather than when the buffer fills
+    success &= fflush(stream) == 0;
+    if (!success)
+        throw std::runtime_error("Failed to write a frame to the video stream");
+}
@@ -0,0 +1,79 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+#include <future>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "image_writer.h"
+
+// Where offscreen frames go once read back. The pixels are 8 bit RGBA rows, row_pitch bytes apart from the top one, and
+// have to stay valid until the returned future is ready, which rethrows a failed write.
+class FrameSink
+{
+public:
+    virtual ~FrameSink() = default;
+
+    virtual std::future<void> write(const int i_frame,
+                                    const uint8_t* rgba,
+                                    const uint32_t width,
+                                    const uint32_t height,
+                                    const size_t row_pitch) = 0;
+};
+
+// An image file per frame, output_prefix followed by the 5 digit frame index and the extension, encoded on worker threads
+class ImageSequenceSink : public FrameSink
+{
+public:
+    // encoder_thread_count 0 for half the hardware threads
+    ImageSequenceSink(const std::string& output_prefix, const ImageWriter::Format format, const int encoder_thread_count);
+
+    std::future<void> write(const int i_frame,
+                            const uint8_t* rgba,
+                            const uint32_t width,
+                            const uint32_t height,
+                            const size_t row_pitch) override;
+
+private:
+    std::string output_prefix;
+    ImageWriter::Format format;
+    ImageWriter::EncoderPool encoders;
+};
+
+// Frames streamed one after the other to stdout or a named pipe, for a video encoder such as ffmpeg to read as they come
+class VideoStreamSink : public FrameSink
+{
+public:
+    enum class Format
+    {
+        Y4M, // YUV4MPEG2, a header with the resolution and frame rate then 4:4:4 BT.601 frames: ffmpeg -i -
+        RGBA, // raw, written straight from the read back buffers: ffmpeg -f rawvideo -pixel_format rgba -video_size WxH -framerate F -i -
+    };
+
+    // path "-" for stdout. Throws std::runtime_error when the path cannot be opened.
+    VideoStreamSink(const std::string& path, const Format format, const int frame_rate);
+    // Writes the queued frames, closes the stream and restores the SIGPIPE handler
+    ~VideoStreamSink();
+
+    std::future<void> write(const int i_frame,
+                            const uint8_t* rgba,
+                            const uint32_t width,
+                            const uint32_t height,
+                            const size_t row_pitch) override;
+
+private:
+    void writeFrame(const uint8_t* rgba, const uint32_t width, const uint32_t height, const size_t row_pitch);
+
+    FILE* stream = nullptr;
+    bool owns_stream = false;
+    Format format;
+    int frame_rate;
+    bool header_written = false;
+    std::vector<uint8_t> planes; // Y4M frame converted from RGBA, only used by the writer thread
+    std::unique_ptr<ImageWriter::EncoderPool> writer; // a single thread, so that frames are written in order
+#ifndef _WIN32
+    void (*previous_sigpipe_handler)(int) = nullptr; // SIGPIPE is ignored while the sink is open
+#endif
+};
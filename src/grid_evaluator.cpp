@@ -0,0 +1,270 @@
+#include <math.h>
+#include <algorithm>
+#include <vector>
+
+#include "grid_evaluator.h"
+#include "molecule_kernel.h"
+
+namespace GridEvaluator
+{
+    template <typename Precision>
+    void evaluateField(const FieldType field,
+                       const MoleculeStruct::MolecularDataOneFrame* const frame,
+                       const int n_point,
+                       const float* const xyz,
+                       float* const values)
+    {
+        switch (field)
+        {
+        case FieldType::Orbital:
+            MoleculeKernel::evaluateOrbitalBatch<Precision>(n_point, xyz, frame, values);
+            break;
+        case FieldType::Density:
+            MoleculeKernel::evaluateDensity<Precision>(n_point, xyz, frame, values, nullptr);
+            break;
+        case FieldType::SpinDensity:
+            MoleculeKernel::evaluateDensity<Precision>(n_point, xyz, frame, nullptr, values);
+            break;
+        }
+    }
+
+    template <typename Precision>
+    void evaluateFieldWithGradient(const FieldType field,
+                                   const MoleculeStruct::MolecularDataOneFrame* const frame,
+                                   const int n_point,
+                                   const float* const xyz,
+                                   float* const values,
+                                   float* const gradients)
+    {
+        switch (field)
+        {
+        case FieldType::Orbital:
+            MoleculeKernel::evaluateOrbitalBatch<Precision>(n_point, xyz, frame, values, gradients);
+            break;
+        case FieldType::Density:
+            MoleculeKernel::evaluateDensityWithGradient<Precision>(n_point, xyz, frame, values, nullptr, gradients, nullptr);
+            break;
+        case FieldType::SpinDensity:
+            MoleculeKernel::evaluateDensityWithGradient<Precision>(n_point, xyz, frame, nullptr, values, nullptr, gradients);
+            break;
+        }
+    }
+
+    template <typename Precision>
+    void evaluateGrid(const FieldType field,
+                      const MoleculeStruct::MolecularDataOneFrame* const frame,
+                      const float origin[3],
+                      const float unit_cell[3],
+                      const int grid_dimension[3],
+                      float* const values)
+    {
+        const int n_point = (grid_dimension[0] + 1) * (grid_dimension[1] + 1) * (grid_dimension[2] + 1);
+        std::vector<float> xyz(n_point * 3);
+
+        for (int i_x = 0; i_x < grid_dimension[0] + 1; i_x++)
+            for (int i_y = 0; i_y < grid_dimension[1] + 1; i_y++)
+                for (int i_z = 0; i_z < grid_dimension[2] + 1; i_z++)
+                {
+                    int i_point = i_x * (grid_dimension[1] + 1) * (grid_dimension[2] + 1) + i_y * (grid_dimension[2] + 1) + i_z;
+                    xyz[i_point * 3 + 0] = origin[0] + i_x * unit_cell[0];
+                    xyz[i_point * 3 + 1] = origin[1] + i_y * unit_cell[1];
+                    xyz[i_point * 3 + 2] = origin[2] + i_z * unit_cell[2];
+                }
+
+        evaluateField<Precision>(field, frame, n_point, xyz.data(), values);
+    }
+
+    int getSparseBlockCount(const int grid_dimension[3], int n_block[3])
+    {
+        for (int i_xyz = 0; i_xyz < 3; i_xyz++)
+            n_block[i_xyz] = (grid_dimension[i_xyz] + 1 + sparse_block_size - 1) / sparse_block_size;
+        return n_block[0] * n_block[1] * n_block[2];
+    }
+
+    // The sorted basis restricted to the significant AOs of one block, rebuilt for every block.
+    // Picking AOs in increasing sorted order keeps the runs of equal angular type intact.
+    struct BlockBasis
+    {
+        std::vector<MoleculeStruct::AtomicOrbital> aos;
+        std::vector<MoleculeStruct::GaussianPrimitive> prims;
+        std::vector<float> C, occupied_C;
+        std::vector<int> significant_aos;
+    };
+
+    // Evaluates n_point points inside the box [box_min, box_max] with the AOs whose extent reaches the box.
+    // Returns false without touching values if there is no such AO, the field is zero there.
+    template <typename Precision>
+    bool evaluateScreenedBlock(const FieldType field,
+                               const MoleculeStruct::MolecularDataOneFrame* const frame,
+                               const MoleculeKernel::SortedBasis& basis,
+                               const float* const ao_extents,
+                               const float box_min[3],
+                               const float box_max[3],
+                               const int n_point,
+                               const float* const xyz,
+                               float* const values,
+                               BlockBasis& block)
+    {
+        const int n_ao = frame->n_AO, n_mo = frame->n_occupied_MO;
+
+        // Box test: distance from the AO center to the nearest point of the block's bounding box
+        block.significant_aos.clear();
+        for (int i_ao = 0; i_ao < n_ao; i_ao++)
+        {
+            float distance_square = 0;
+            for (int i_xyz = 0; i_xyz < 3; i_xyz++)
+            {
+                float center = basis.aos[i_ao].xyz[i_xyz];
+                float outside = fmaxf(fmaxf(box_min[i_xyz] - center, center - box_max[i_xyz]), 0.0f);
+                distance_square += outside * outside;
+            }
+            if (distance_square <= ao_extents[i_ao] * ao_extents[i_ao])
+                block.significant_aos.push_back(i_ao);
+        }
+        if (block.significant_aos.empty())
+            return false;
+
+        const int n_block_ao = block.significant_aos.size();
+        block.aos.clear();
+        block.prims.clear();
+        block.C.resize(n_block_ao);
+        block.occupied_C.resize(n_block_ao * n_mo);
+        for (int i = 0; i < n_block_ao; i++)
+        {
+            const int i_ao = block.significant_aos[i];
+            block.aos.push_back(basis.aos[i_ao]);
+            block.prims.insert(block.prims.end(), basis.primitives.begin() + basis.first_primitives[i_ao],
+                               basis.primitives.begin() + basis.first_primitives[i_ao] + basis.aos[i_ao].number_of_primitives);
+            block.C[i] = basis.mo_coefficients[i_ao];
+            for (int i_mo = 0; i_mo < n_mo; i_mo++)
+                block.occupied_C[i + i_mo * n_block_ao] = basis.occupied_mo_coefficients[i_ao + i_mo * n_ao];
+        }
+
+        switch (field)
+        {
+        case FieldType::Orbital:
+            MoleculeKernel::evaluateOrbitalBatch<Precision>(n_point, xyz, n_block_ao, block.aos.data(), block.prims.data(),
+                                                            block.C.data(), values);
+            break;
+        case FieldType::Density:
+            MoleculeKernel::evaluateDensity<Precision>(n_point, xyz, n_block_ao, block.aos.data(), block.prims.data(),
+                                                       n_mo, block.occupied_C.data(), frame->occupation_numbers, frame->spin_occupation_numbers,
+                                                       values, nullptr);
+            break;
+        case FieldType::SpinDensity:
+            MoleculeKernel::evaluateDensity<Precision>(n_point, xyz, n_block_ao, block.aos.data(), block.prims.data(),
+                                                       n_mo, block.occupied_C.data(), frame->occupation_numbers, frame->spin_occupation_numbers,
+                                                       nullptr, values);
+            break;
+        }
+        return true;
+    }
+
+    template <typename Precision>
+    void evaluateGridBlockSparse(const FieldType field,
+                                 const MoleculeStruct::MolecularDataOneFrame* const frame,
+                                 const MoleculeKernel::SortedBasis& basis,
+                                 const float* const ao_extents,
+                                 const float origin[3],
+                                 const float unit_cell[3],
+                                 const int grid_dimension[3],
+                                 float* const values,
+                                 bool* const block_empty)
+    {
+        const int n_point_x = grid_dimension[0] + 1, n_point_y = grid_dimension[1] + 1, n_point_z = grid_dimension[2] + 1;
+        int n_block[3];
+        getSparseBlockCount(grid_dimension, n_block);
+
+        BlockBasis block;
+        std::vector<float> block_xyz(sparse_block_size * sparse_block_size * sparse_block_size * 3);
+        std::vector<float> block_values(sparse_block_size * sparse_block_size * sparse_block_size);
+
+        for (int i_block_x = 0; i_block_x < n_block[0]; i_block_x++)
+            for (int i_block_y = 0; i_block_y < n_block[1]; i_block_y++)
+                for (int i_block_z = 0; i_block_z < n_block[2]; i_block_z++)
+                {
+                    const int i_begin[3]{ i_block_x * sparse_block_size, i_block_y * sparse_block_size, i_block_z * sparse_block_size, };
+                    const int i_end[3]{ std::min(i_begin[0] + sparse_block_size, n_point_x),
+                                        std::min(i_begin[1] + sparse_block_size, n_point_y),
+                                        std::min(i_begin[2] + sparse_block_size, n_point_z), };
+                    float box_min[3], box_max[3];
+                    for (int i_xyz = 0; i_xyz < 3; i_xyz++)
+                    {
+                        box_min[i_xyz] = origin[i_xyz] + i_begin[i_xyz] * unit_cell[i_xyz];
+                        box_max[i_xyz] = origin[i_xyz] + (i_end[i_xyz] - 1) * unit_cell[i_xyz];
+                    }
+
+                    int n_block_point = 0;
+                    for (int i_x = i_begin[0]; i_x < i_end[0]; i_x++)
+                        for (int i_y = i_begin[1]; i_y < i_end[1]; i_y++)
+                            for (int i_z = i_begin[2]; i_z < i_end[2]; i_z++, n_block_point++)
+                            {
+                                block_xyz[n_block_point * 3 + 0] = origin[0] + i_x * unit_cell[0];
+                                block_xyz[n_block_point * 3 + 1] = origin[1] + i_y * unit_cell[1];
+                                block_xyz[n_block_point * 3 + 2] = origin[2] + i_z * unit_cell[2];
+                            }
+
+                    bool any_ao = evaluateScreenedBlock<Precision>(field, frame, basis, ao_extents, box_min, box_max,
+                                                                   n_block_point, block_xyz.data(), block_values.data(), block);
+                    if (!any_ao)
+                        std::fill(block_values.begin(), block_values.begin() + n_block_point, 0.0f);
+
+                    const int i_block = i_block_x * n_block[1] * n_block[2] + i_block_y * n_block[2] + i_block_z;
+                    if (block_empty != nullptr)
+                        block_empty[i_block] = !any_ao;
+
+                    n_block_point = 0;
+                    for (int i_x = i_begin[0]; i_x < i_end[0]; i_x++)
+                        for (int i_y = i_begin[1]; i_y < i_end[1]; i_y++)
+                            for (int i_z = i_begin[2]; i_z < i_end[2]; i_z++, n_block_point++)
+                                values[i_x * n_point_y * n_point_z + i_y * n_point_z + i_z] = block_values[n_block_point];
+                }
+    }
+
+    template <typename Precision>
+    void evaluatePointGroupsSparse(const FieldType field,
+                                   const MoleculeStruct::MolecularDataOneFrame* const frame,
+                                   const MoleculeKernel::SortedBasis& basis,
+                                   const float* const ao_extents,
+                                   const int n_group,
+                                   const int* const group_offsets,
+                                   const float* const xyz,
+                                   float* const values)
+    {
+        BlockBasis block;
+        for (int i_group = 0; i_group < n_group; i_group++)
+        {
+            const int i_begin = group_offsets[i_group], n_group_point = group_offsets[i_group + 1] - i_begin;
+            if (n_group_point <= 0)
+                continue;
+
+            float box_min[3], box_max[3];
+            for (int i_xyz = 0; i_xyz < 3; i_xyz++)
+                box_min[i_xyz] = box_max[i_xyz] = xyz[i_begin * 3 + i_xyz];
+            for (int i_point = i_begin + 1; i_point < i_begin + n_group_point; i_point++)
+                for (int i_xyz = 0; i_xyz < 3; i_xyz++)
+                {
+                    box_min[i_xyz] = fminf(box_min[i_xyz], xyz[i_point * 3 + i_xyz]);
+                    box_max[i_xyz] = fmaxf(box_max[i_xyz], xyz[i_point * 3 + i_xyz]);
+                }
+
+            if (!evaluateScreenedBlock<Precision>(field, frame, basis, ao_extents, box_min, box_max,
+                                                  n_group_point, xyz + i_begin * 3, values + i_begin, block))
+                std::fill(values + i_begin, values + i_begin + n_group_point, 0.0f);
+        }
+    }
+
+#define INSTANTIATE_PRECISION(Precision) \
+    template void evaluateGridBlockSparse<Precision>(const FieldType, const MoleculeStruct::MolecularDataOneFrame* const, \
+                                                     const MoleculeKernel::SortedBasis&, const float* const, const float[3], const float[3], const int[3], float* const, bool* const); \
+    template void evaluatePointGroupsSparse<Precision>(const FieldType, const MoleculeStruct::MolecularDataOneFrame* const, \
+                                                       const MoleculeKernel::SortedBasis&, const float* const, const int, const int* const, const float* const, float* const); \
+    template void evaluateField<Precision>(const FieldType, const MoleculeStruct::MolecularDataOneFrame* const, const int, const float* const, float* const); \
+    template void evaluateFieldWithGradient<Precision>(const FieldType, const MoleculeStruct::MolecularDataOneFrame* const, const int, const float* const, float* const, float* const); \
+    template void evaluateGrid<Precision>(const FieldType, const MoleculeStruct::MolecularDataOneFrame* const, const float[3], const float[3], const int[3], float* const);
+
+    INSTANTIATE_PRECISION(MoleculeKernel::FloatPrecision)
+    INSTANTIATE_PRECISION(MoleculeKernel::DoublePrecision)
+    INSTANTIATE_PRECISION(MoleculeKernel::MixedPrecision)
+#undef INSTANTIATE_PRECISION
+}
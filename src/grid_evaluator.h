@@ -0,0 +1,76 @@
+#pragma once
+
+#include "molecule_struct.h"
+#include "molecule_kernel.h"
+
+namespace GridEvaluator
+{
+    enum class FieldType
+    {
+        Orbital, // psi of the plotted MO
+        Density, // sum_i n_i |psi_i|^2 over occupied orbitals
+        SpinDensity, // sum_i (n_alpha_i - n_beta_i) |psi_i|^2 over occupied orbitals
+    };
+
+    // The Precision template parameter is one of the MoleculeKernel precision policies, the output is float either way.
+
+    // Evaluates the field on n_point positions stored as xyz[i_point * 3 + i_xyz]
+    template <typename Precision = MoleculeKernel::FloatPrecision>
+    void evaluateField(const FieldType field,
+                       const MoleculeStruct::MolecularDataOneFrame* const frame,
+                       const int n_point,
+                       const float* const xyz,
+                       float* const values);
+
+    // Same as evaluateField, plus the gradient stored as gradients[i_point * 3 + i_xyz]
+    template <typename Precision = MoleculeKernel::FloatPrecision>
+    void evaluateFieldWithGradient(const FieldType field,
+                                   const MoleculeStruct::MolecularDataOneFrame* const frame,
+                                   const int n_point,
+                                   const float* const xyz,
+                                   float* const values,
+                                   float* const gradients);
+
+    const int sparse_block_size = 8; // Grid points per block edge in evaluateGridBlockSparse
+    const float ao_extent_threshold = 1e-7f; // AO values below this are treated as zero outside of their extent
+
+    // Number of sparse blocks along each axis of a grid with grid_dimension voxels, returns their total count
+    int getSparseBlockCount(const int grid_dimension[3], int n_block[3]);
+
+    // Same output as evaluateGrid, but the grid points are tiled into sparse_block_size^3 blocks and each block only evaluates
+    // the AOs whose extent (from MoleculeKernel::getAOExtents, in the order of the sorted basis) reaches its bounding box.
+    // Blocks without any such AO are filled with zeros and, if block_empty is not nullptr, marked in
+    // block_empty[i_block_x * n_block_y * n_block_z + i_block_y * n_block_z + i_block_z].
+    template <typename Precision = MoleculeKernel::FloatPrecision>
+    void evaluateGridBlockSparse(const FieldType field,
+                                 const MoleculeStruct::MolecularDataOneFrame* const frame,
+                                 const MoleculeKernel::SortedBasis& basis,
+                                 const float* const ao_extents,
+                                 const float origin[3],
+                                 const float unit_cell[3],
+                                 const int grid_dimension[3],
+                                 float* const values,
+                                 bool* const block_empty = nullptr);
+
+    // Block screening for scattered points: the points of group i are xyz[group_offsets[i] * 3] up to xyz[group_offsets[i + 1] * 3],
+    // and each group only evaluates the AOs whose extent reaches the bounding box of its points. Groups should be spatially compact.
+    template <typename Precision = MoleculeKernel::FloatPrecision>
+    void evaluatePointGroupsSparse(const FieldType field,
+                                   const MoleculeStruct::MolecularDataOneFrame* const frame,
+                                   const MoleculeKernel::SortedBasis& basis,
+                                   const float* const ao_extents,
+                                   const int n_group,
+                                   const int* const group_offsets,
+                                   const float* const xyz,
+                                   float* const values);
+
+    // Evaluates the field on the (n_x + 1) * (n_y + 1) * (n_z + 1) corners of a voxel grid,
+    // stored as values[i_x * (n_y + 1) * (n_z + 1) + i_y * (n_z + 1) + i_z]
+    template <typename Precision = MoleculeKernel::FloatPrecision>
+    void evaluateGrid(const FieldType field,
+                      const MoleculeStruct::MolecularDataOneFrame* const frame,
+                      const float origin[3],
+                      const float unit_cell[3],
+                      const int grid_dimension[3],
+                      float* const values);
+}
@@ -0,0 +1,208 @@
+#include <algorithm>
+#include <array>
+#include <fstream>
+#include <stdexcept>
+#include <vector>
+
+#include "image_writer.h"
+
+namespace ImageWriter
+{
+    const char* extension(const Format format)
+    {
+        return format == Format::PNG ? ".png" : ".ppm";
+    }
+
+    inline void appendBigEndian(std::vector<uint8_t>& out, const uint32_t value)
+    {
+        out.push_back((uint8_t)(value >> 24));
+        out.push_back((uint8_t)(value >> 16));
+        out.push_back((uint8_t)(value >> 8));
+        out.push_back((uint8_t)value);
+    }
+
+    uint32_t crc32(const uint8_t* data, const size_t size, uint32_t crc)
+    {
+        // Built once, also when several encoder threads get here first
+        static const std::array<uint32_t, 256> table = []()
+        {
+            std::array<uint32_t, 256> entries;
+            for (uint32_t i_entry = 0; i_entry < 256; i_entry++)
+            {
+                uint32_t value = i_entry;
+                for (int i_bit = 0; i_bit < 8; i_bit++)
+                    value = (value & 1) ? 0xEDB88320u ^ (value >> 1) : value >> 1;
+                entries[i_entry] = value;
+            }
+            return entries;
+        }();
+        crc = ~crc;
+        for (size_t i = 0; i < size; i++)
+            crc = table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+        return ~crc;
+    }
+
+    // Length, type, data and the CRC of type and data
+    void appendChunk(std::vector<uint8_t>& out, const char* type, const std::vector<uint8_t>& data)
+    {
+        appendBigEndian(out, (uint32_t)data.size());
+        const size_t i_type = out.size();
+        out.insert(out.end(), type, type + 4);
+        out.insert(out.end(), data.begin(), data.end());
+        appendBigEndian(out, crc32(out.data() + i_type, 4 + data.size(), 0));
+    }
+
+    void encodePng(const uint8_t* rgba, const uint32_t width, const uint32_t height, const size_t row_pitch, std::vector<uint8_t>& out)
+    {
+        const uint8_t signature[] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+        out.assign(signature, signature + sizeof(signature));
+
+        std::vector<uint8_t> header;
+        appendBigEndian(header, width);
+        appendBigEndian(header, height);
+        header.push_back(8); // bits per channel
+        header.push_back(2); // RGB
+        header.push_back(0); // deflate
+        header.push_back(0); // adaptive filtering
+        header.push_back(0); // not interlaced
+        appendChunk(out, "IHDR", header);
+
+        // Every row starts with its filter type, none
+        const size_t row_size = 1 + 3 * (size_t)width;
+        std::vector<uint8_t> scanlines(row_size * height);
+        for (uint32_t i_row = 0; i_row < height; i_row++)
+        {
+            uint8_t* scanline = scanlines.data() + i_row * row_size;
+            const uint8_t* pixel = rgba + i_row * row_pitch;
+            scanline[0] = 0;
+            for (uint32_t i_x = 0; i_x < width; i_x++)
+                for (int i_channel = 0; i_channel < 3; i_channel++)
+                    scanline[1 + 3 * i_x + i_channel] = pixel[4 * i_x + i_channel];
+        }
+
+        // A zlib stream of stored deflate blocks, which hold at most 65535 bytes each
+        std::vector<uint8_t> stream = { 0x78, 0x01 };
+        const size_t max_block_size = 65535;
+        size_t i_byte = 0;
+        do
+        {
+            const size_t block_size = std::min(max_block_size, scanlines.size() - i_byte);
+            const bool final_block = i_byte + block_size == scanlines.size();
+            stream.push_back(final_block ? 1 : 0);
+            stream.push_back((uint8_t)block_size);
+            stream.push_back((uint8_t)(block_size >> 8));
+            stream.push_back((uint8_t)~block_size);
+            stream.push_back((uint8_t)(~block_size >> 8));
+            stream.insert(stream.end(), scanlines.begin() + i_byte, scanlines.begin() + i_byte + block_size);
+            i_byte += block_size;
+        } while (i_byte < scanlines.size());
+
+        // Adler-32, the sums stay below 2^32 for 5552 bytes between reductions
+        uint32_t sum_a = 1, sum_b = 0;
+        for (size_t i_start = 0; i_start < scanlines.size(); i_start += 5552)
+        {
+            const size_t i_end = std::min(scanlines.size(), i_start + 5552);
+            for (size_t i = i_start; i < i_end; i++)
+            {
+                sum_a += scanlines[i];
+                sum_b += sum_a;
+            }
+            sum_a %= 65521;
+            sum_b %= 65521;
+        }
+        appendBigEndian(stream, (sum_b << 16) | sum_a);
+
+        appendChunk(out, "IDAT", stream);
+        appendChunk(out, "IEND", {});
+    }
+
+    void encodePpm(const uint8_t* rgba, const uint32_t width, const uint32_t height, const size_t row_pitch, std::vector<uint8_t>& out)
+    {
+        const std::string header = "P6\n" + std::to_string(width) + " " + std::to_string(height) + "\n255\n";
+        out.assign(header.begin(), header.end());
+        out.reserve(header.size() + 3 * (size_t)width * height);
+        for (uint32_t i_row = 0; i_row < height; i_row++)
+        {
+            const uint8_t* pixel = rgba + i_row * row_pitch;
+            for (uint32_t i_x = 0; i_x < width; i_x++)
+                out.insert(out.end(), pixel + 4 * i_x, pixel + 4 * i_x + 3);
+        }
+    }
+
+    void writeImage(const std::string& path,
+                    const Format format,
+                    const uint8_t* rgba,
+                    const uint32_t width,
+                    const uint32_t height,
+                    const size_t row_pitch)
+    {
+        std::vector<uint8_t> encoded;
+        if (format == Format::PNG)
+            encodePng(rgba, width, height, row_pitch, encoded);
+        else
+            encodePpm(rgba, width, height, row_pitch, encoded);
+
+        std::ofstream file(path, std::ios::binary);
+        file.write(reinterpret_cast<const char*>(encoded.data()), encoded.size());
+        if (!file)
+            throw std::runtime_error("Failed to write image " + path);
+    }
+
+    EncoderPool::EncoderPool(int n_thread)
+    {
+        if (n_thread <= 0)
+            n_thread = std::max(1, (int)std::thread::hardware_concurrency() / 2);
+        for (int i_thread = 0; i_thread < n_thread; i_thread++)
+            threads.emplace_back(&EncoderPool::work, this);
+    }
+
+    EncoderPool::~EncoderPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        task_available.notify_all();
+        for (std::thread& thread : threads)
+            thread.join();
+    }
+
+    std::future<void> EncoderPool::enqueue(const std::string& path,
+                                           const Format format,
+                                           const uint8_t* rgba,
+                                           const uint32_t width,
+                                           const uint32_t height,
+                                           const size_t row_pitch)
+    {
+        return enqueue([=]() { writeImage(path, format, rgba, width, height, row_pitch); });
+    }
+
+    std::future<void> EncoderPool::enqueue(std::function<void()> write)
+    {
+        std::packaged_task<void()> task(std::move(write));
+        std::future<void> done = task.get_future();
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            tasks.push_back(std::move(task));
+        }
+        task_available.notify_one();
+        return done;
+    }
+
+    void EncoderPool::work()
+    {
+        while (true)
+        {
+            std::packaged_task<void()> task;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                task_available.wait(lock, [this]() { return stopping || !tasks.empty(); });
+                if (tasks.empty())
+                    return;
+                task = std::move(tasks.front());
+                tasks.pop_front();
+            }
+            task();
+        }
+    }
+}
@@ -0,0 +1,62 @@
+#pragma once
+
+#include <stdint.h>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace ImageWriter
+{
+    enum class Format
+    {
+        PNG, // 8 bit RGB, stored without compression so that writing costs no more than copying the pixels
+        PPM, // binary P6
+    };
+
+    // ".png" or ".ppm"
+    const char* extension(const Format format);
+
+    // Writes 8 bit RGBA pixels, rows row_pitch bytes apart from the top one, without their alpha.
+    // Throws std::runtime_error when the file cannot be written.
+    void writeImage(const std::string& path,
+                    const Format format,
+                    const uint8_t* rgba,
+                    const uint32_t width,
+                    const uint32_t height,
+                    const size_t row_pitch);
+
+    // Worker threads that write images in the order they are queued, so that encoding overlaps rendering. With one thread
+    // they are also written one after the other in that order.
+    class EncoderPool
+    {
+    public:
+        // 0 for half the hardware threads
+        explicit EncoderPool(int n_thread);
+        // Writes the queued images first
+        ~EncoderPool();
+
+        // rgba has to stay valid until the future is ready, which rethrows the error of writeImage if any
+        std::future<void> enqueue(const std::string& path,
+                                  const Format format,
+                                  const uint8_t* rgba,
+                                  const uint32_t width,
+                                  const uint32_t height,
+                                  const size_t row_pitch);
+        // Any other writing task, the future rethrows what it throws
+        std::future<void> enqueue(std::function<void()> write);
+
+    private:
+        void work();
+
+        std::vector<std::thread> threads;
+        std::deque<std::packaged_task<void()>> tasks;
+        std::mutex mutex;
+        std::condition_variable task_available;
+        bool stopping = false;
+    };
+}
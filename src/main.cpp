@@ -1,14 +1,101 @@
 
+#include <cstdio>
+#include <memory>
+
 #include "molecule_struct.h"
 #include "molecule_reader.h"
 
 #include "renderer.h"
+#include "accuracy_harness.h"
 
-int main() {
+int main(int argc, char** argv) {
     try {
+        // --offscreen [output prefix] [--size WxH] [--frames first:last] [--format png|ppm] [--encoder-threads n]
+        //             [--video path|- [--video-format y4m|rgba] [--fps n]]: render trajectory frames without a window, last
+        // -1 for the end of the trajectory, to image files or with --video as one stream to a file, a named pipe or stdout
+        OffscreenSettings settings;
+        std::string output_prefix = "frame", video_path;
+        ImageWriter::Format format = ImageWriter::Format::PNG;
+        VideoStreamSink::Format video_format = VideoStreamSink::Format::Y4M;
+        int encoder_thread_count = 0, frame_rate = 10; // the window shows a frame every 0.1 s
+        const bool offscreen = argc > 1 && std::string(argv[1]) == "--offscreen";
+        if (offscreen) {
+            for (int i_arg = 2; i_arg < argc; i_arg++) {
+                const std::string arg = argv[i_arg];
+                const bool has_value = i_arg + 1 < argc;
+                if (arg == "--size" && has_value) {
+                    if (sscanf(argv[++i_arg], "%ux%u", &settings.width, &settings.height) != 2 || settings.width == 0 || settings.height == 0)
+                        throw std::runtime_error("--size expects WIDTHxHEIGHT");
+                }
+                else if (arg == "--frames" && has_value) {
+                    if (sscanf(argv[++i_arg], "%d:%d", &settings.first_frame, &settings.last_frame) != 2)
+                        throw std::runtime_error("--frames expects FIRST:LAST");
+                }
+                else if (arg == "--format" && has_value) {
+                    const std::string value = argv[++i_arg];
+                    if (value != "png" && value != "ppm")
+                        throw std::runtime_error("--format expects png or ppm");
+                    format = value == "png" ? ImageWriter::Format::PNG : ImageWriter::Format::PPM;
+                }
+                else if (arg == "--encoder-threads" && has_value)
+                    encoder_thread_count = std::stoi(argv[++i_arg]);
+                else if (arg == "--video" && has_value)
+                    video_path = argv[++i_arg];
+                else if (arg == "--video-format" && has_value) {
+                    const std::string value = argv[++i_arg];
+                    if (value != "y4m" && value != "rgba")
+                        throw std::runtime_error("--video-format expects y4m or rgba");
+                    video_format = value == "y4m" ? VideoStreamSink::Format::Y4M : VideoStreamSink::Format::RGBA;
+                }
+                else if (arg == "--fps" && has_value) {
+                    frame_rate = std::stoi(argv[++i_arg]);
+                    if (frame_rate <= 0)
+                        throw std::runtime_error("--fps expects a positive frame rate");
+                }
+                else if (arg.rfind("--", 0) != 0)
+                    output_prefix = arg;
+                else
+                    throw std::runtime_error("Unknown offscreen option " + arg);
+            }
+        }
+        // The frames own stdout with --video -, so the log goes to stderr from the start, loading the trajectory included
+        if (video_path == "-")
+            std::cout.rdbuf(std::cerr.rdbuf());
+
         std::vector<MoleculeStruct::MolecularDataOneFrame*> trajectory
             = MoleculeReader::readWholeTrajectory("../molecule_demo/demo");
 
+        // --exp-accuracy: report the cost of each exp backend instead of opening the window
+        if (argc > 1 && std::string(argv[1]) == "--exp-accuracy") {
+            bool success = AccuracyHarness::compareExpBackends(trajectory);
+            MoleculeReader::clearTrajectory(trajectory);
+            return success ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+        // --precision-benchmark: time and compare the float, mixed and double kernels
+        if (argc > 1 && std::string(argv[1]) == "--precision-benchmark") {
+            bool success = AccuracyHarness::comparePrecisions(trajectory);
+            MoleculeReader::clearTrajectory(trajectory);
+            return success ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+
+        if (offscreen) {
+            std::unique_ptr<FrameSink> sink;
+            if (video_path.empty())
+                sink.reset(new ImageSequenceSink(output_prefix, format, encoder_thread_count));
+            else {
+                sink.reset(new VideoStreamSink(video_path, video_format, frame_rate));
+                if (video_format == VideoStreamSink::Format::RGBA)
+                    std::cerr << "Raw frames, read them with ffmpeg -f rawvideo -pixel_format rgba -video_size "
+                              << settings.width << "x" << settings.height << " -framerate " << frame_rate << " -i "
+                              << video_path << "\n";
+            }
+
+            TriangleRenderer app(trajectory);
+            app.renderOffscreen(settings, *sink);
+            MoleculeReader::clearTrajectory(trajectory);
+            return EXIT_SUCCESS;
+        }
+
         TriangleRenderer app(trajectory);
 
         app.run();
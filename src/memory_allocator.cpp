@@ -0,0 +1,222 @@
+#include <algorithm>
+#include <stdexcept>
+#include <utility>
+
+#include "memory_allocator.h"
+
+const VkDeviceSize no_fit = ~(VkDeviceSize)0;
+
+inline VkDeviceSize alignUp(const VkDeviceSize offset, const VkDeviceSize alignment)
+{
+    return (offset + alignment - 1) / alignment * alignment;
+}
+
+void DeviceMemoryAllocator::init(VkPhysicalDevice physical_device, VkDevice device, const VkDeviceSize block_size)
+{
+    this->device = device;
+    this->block_size = block_size;
+    vkGetPhysicalDeviceMemoryProperties(physical_device, &memory_properties);
+}
+
+void DeviceMemoryAllocator::destroy()
+{
+    for (Block& block : blocks)
+    {
+        if (block.memory == VK_NULL_HANDLE)
+            continue;
+        if (block.mapped != nullptr)
+            vkUnmapMemory(device, block.memory);
+        vkFreeMemory(device, block.memory, nullptr);
+    }
+    blocks.clear();
+    statistics.block_count = 0;
+    statistics.block_bytes = 0;
+}
+
+uint32_t DeviceMemoryAllocator::findMemoryType(const uint32_t type_filter, const VkMemoryPropertyFlags properties) const
+{
+    for (uint32_t i_type = 0; i_type < memory_properties.memoryTypeCount; i_type++)
+        if ((type_filter & (1 << i_type)) && (memory_properties.memoryTypes[i_type].propertyFlags & properties) == properties)
+            return i_type;
+    throw std::runtime_error("Failed to find a suitable memory type");
+}
+
+int DeviceMemoryAllocator::createBlock(const uint32_t memory_type, const VkDeviceSize size, const Strategy strategy, const bool optimal_tiling_image, const bool dedicated)
+{
+    VkMemoryAllocateInfo allocInfo{};
+    allocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+    allocInfo.allocationSize = size;
+    allocInfo.memoryTypeIndex = memory_type;
+
+    Block block;
+    if (vkAllocateMemory(device, &allocInfo, nullptr, &block.memory) != VK_SUCCESS)
+        throw std::runtime_error("Failed to allocate device memory block!");
+    block.size = size;
+    block.memory_type = memory_type;
+    block.strategy = strategy;
+    block.optimal_tiling_image = optimal_tiling_image;
+    block.dedicated = dedicated;
+    block.free_ranges[0] = size;
+    if (memory_properties.memoryTypes[memory_type].propertyFlags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT)
+    {
+        void* mapped;
+        if (vkMapMemory(device, block.memory, 0, size, 0, &mapped) != VK_SUCCESS)
+        {
+            vkFreeMemory(device, block.memory, nullptr);
+            throw std::runtime_error("Failed to map device memory block!");
+        }
+        block.mapped = static_cast<char*>(mapped);
+    }
+
+    statistics.block_count++;
+    statistics.block_bytes += size;
+    statistics.total_block_count++;
+
+    for (int i_block = 0; i_block < (int)blocks.size(); i_block++)
+        if (blocks[i_block].memory == VK_NULL_HANDLE)
+        {
+            blocks[i_block] = std::move(block);
+            return i_block;
+        }
+    blocks.push_back(std::move(block));
+    return (int)blocks.size() - 1;
+}
+
+VkDeviceSize DeviceMemoryAllocator::tryAllocate(Block& block, const VkMemoryRequirements& requirements)
+{
+    if (block.strategy == Strategy::Linear)
+    {
+        const VkDeviceSize offset = alignUp(block.head, requirements.alignment);
+        if (offset + requirements.size > block.size)
+            return no_fit;
+        block.head = offset + requirements.size;
+        return offset;
+    }
+
+    for (auto range = block.free_ranges.begin(); range != block.free_ranges.end(); ++range)
+    {
+        const VkDeviceSize range_offset = range->first, range_end = range->first + range->second;
+        const VkDeviceSize offset = alignUp(range_offset, requirements.alignment);
+        if (offset + requirements.size > range_end)
+            continue;
+
+        // The alignment padding before and the rest after stay free
+        block.free_ranges.erase(range);
+        if (offset > range_offset)
+            block.free_ranges[range_offset] = offset - range_offset;
+        if (offset + requirements.size < range_end)
+            block.free_ranges[offset + requirements.size] = range_end - (offset + requirements.size);
+        return offset;
+    }
+    return no_fit;
+}
+
+MemoryAllocation DeviceMemoryAllocator::allocate(const VkMemoryRequirements& requirements,
+                                                 const VkMemoryPropertyFlags properties,
+                                                 const Strategy strategy,
+                                                 const bool optimal_tiling_image)
+{
+    const uint32_t memory_type = findMemoryType(requirements.memoryTypeBits, properties);
+
+    int i_block = -1;
+    VkDeviceSize offset = no_fit;
+    if (requirements.size > block_size)
+    {
+        i_block = createBlock(memory_type, requirements.size, strategy, optimal_tiling_image, true);
+        offset = tryAllocate(blocks[i_block], requirements);
+    }
+    else
+    {
+        for (int i_candidate = 0; i_candidate < (int)blocks.size() && offset == no_fit; i_candidate++)
+        {
+            Block& block = blocks[i_candidate];
+            if (block.memory == VK_NULL_HANDLE || block.dedicated || block.memory_type != memory_type || block.strategy != strategy || block.optimal_tiling_image != optimal_tiling_image)
+                continue;
+            offset = tryAllocate(block, requirements);
+            i_block = i_candidate;
+        }
+        if (offset == no_fit)
+        {
+            i_block = createBlock(memory_type, block_size, strategy, optimal_tiling_image, false);
+            offset = tryAllocate(blocks[i_block], requirements);
+        }
+    }
+
+    Block& block = blocks[i_block];
+    block.allocation_count++;
+    statistics.allocation_count++;
+    statistics.allocated_bytes += requirements.size;
+    statistics.peak_allocated_bytes = std::max(statistics.peak_allocated_bytes, statistics.allocated_bytes);
+    statistics.total_allocation_count++;
+
+    MemoryAllocation allocation;
+    allocation.memory = block.memory;
+    allocation.offset = offset;
+    allocation.size = requirements.size;
+    allocation.mapped = block.mapped != nullptr ? block.mapped + offset : nullptr;
+    allocation.i_block = i_block;
+    return allocation;
+}
+
+void DeviceMemoryAllocator::free(MemoryAllocation& allocation)
+{
+    if (allocation.i_block < 0)
+        return;
+    Block& block = blocks[allocation.i_block];
+    block.allocation_count--;
+    statistics.allocation_count--;
+    statistics.allocated_bytes -= allocation.size;
+
+    if (block.dedicated && block.allocation_count == 0)
+    {
+        if (block.mapped != nullptr)
+            vkUnmapMemory(device, block.memory);
+        vkFreeMemory(device, block.memory, nullptr);
+        statistics.block_count--;
+        statistics.block_bytes -= block.size;
+        block = Block();
+    }
+    else if (block.strategy == Strategy::Linear)
+    {
+        if (block.allocation_count == 0)
+            block.head = 0;
+    }
+    else
+    {
+        // Merges with the free ranges right after and right before
+        VkDeviceSize offset = allocation.offset, size = allocation.size;
+        auto next = block.free_ranges.find(offset + size);
+        if (next != block.free_ranges.end())
+        {
+            size += next->second;
+            block.free_ranges.erase(next);
+        }
+        auto previous = block.free_ranges.lower_bound(offset);
+        if (previous != block.free_ranges.begin())
+        {
+            --previous;
+            if (previous->first + previous->second == offset)
+            {
+                offset = previous->first;
+                size += previous->second;
+                block.free_ranges.erase(previous);
+            }
+        }
+        block.free_ranges[offset] = size;
+    }
+    allocation = MemoryAllocation();
+}
+
+MemoryStatistics DeviceMemoryAllocator::getStatistics() const
+{
+    return statistics;
+}
+
+void DeviceMemoryAllocator::printStatistics(std::ostream& out) const
+{
+    const double mib = 1024.0 * 1024.0;
+    out << "Device memory: " << statistics.block_count << " blocks of " << statistics.block_bytes / mib << " MiB, "
+        << statistics.allocation_count << " allocations of " << statistics.allocated_bytes / mib << " MiB, peak "
+        << statistics.peak_allocated_bytes / mib << " MiB, " << statistics.total_allocation_count << " allocations in "
+        << statistics.total_block_count << " vkAllocateMemory calls overall\n";
+}
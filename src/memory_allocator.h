@@ -0,0 +1,82 @@
+#pragma once
+
+#include <map>
+#include <ostream>
+#include <vector>
+
+#include <vulkan/vulkan.h>
+
+// A sub-range of a device memory block, what vkBindBufferMemory and vkBindImageMemory take
+struct MemoryAllocation
+{
+    VkDeviceMemory memory = VK_NULL_HANDLE;
+    VkDeviceSize offset = 0;
+    VkDeviceSize size = 0;
+    void* mapped = nullptr; // the range in host memory, for host visible memory types
+    int i_block = -1; // -1 when not allocated
+};
+
+struct MemoryStatistics
+{
+    size_t block_count = 0; // vkAllocateMemory calls currently held
+    VkDeviceSize block_bytes = 0;
+    size_t allocation_count = 0; // sub-ranges currently handed out
+    VkDeviceSize allocated_bytes = 0;
+    VkDeviceSize peak_allocated_bytes = 0;
+    size_t total_block_count = 0; // over the lifetime of the allocator
+    size_t total_allocation_count = 0;
+};
+
+// Takes device memory in large blocks per memory type and hands out aligned sub-ranges of them, so that buffers and images
+// share a few vkAllocateMemory calls. Host visible blocks are mapped once for their lifetime.
+class DeviceMemoryAllocator
+{
+public:
+    enum class Strategy
+    {
+        FreeList, // long lived resources: first fit in the sorted free ranges of a block, merged again on free
+        Linear, // transient ones such as staging buffers: bumps an offset that goes back to the start once the block is empty
+    };
+
+    // Requests larger than block_size get a block of their own, freed with them
+    void init(VkPhysicalDevice physical_device, VkDevice device, const VkDeviceSize block_size);
+    // Every allocation must have been freed
+    void destroy();
+
+    // Throws when no memory type has the properties or the device is out of memory
+    MemoryAllocation allocate(const VkMemoryRequirements& requirements,
+                              const VkMemoryPropertyFlags properties,
+                              const Strategy strategy,
+                              const bool optimal_tiling_image);
+    void free(MemoryAllocation& allocation);
+
+    MemoryStatistics getStatistics() const;
+    void printStatistics(std::ostream& out) const;
+
+private:
+    struct Block
+    {
+        VkDeviceMemory memory = VK_NULL_HANDLE; // VK_NULL_HANDLE once a dedicated block is freed, the slot is reused
+        VkDeviceSize size = 0;
+        uint32_t memory_type = 0;
+        Strategy strategy = Strategy::FreeList;
+        // Images with optimal tiling are kept apart from buffers, so that bufferImageGranularity never applies
+        bool optimal_tiling_image = false;
+        bool dedicated = false;
+        char* mapped = nullptr;
+        std::map<VkDeviceSize, VkDeviceSize> free_ranges; // offset to size, for FreeList
+        VkDeviceSize head = 0; // for Linear
+        size_t allocation_count = 0;
+    };
+
+    uint32_t findMemoryType(const uint32_t type_filter, const VkMemoryPropertyFlags properties) const;
+    int createBlock(const uint32_t memory_type, const VkDeviceSize size, const Strategy strategy, const bool optimal_tiling_image, const bool dedicated);
+    // Offset of the allocation in the block, or -1 when it does not fit
+    VkDeviceSize tryAllocate(Block& block, const VkMemoryRequirements& requirements);
+
+    VkDevice device = VK_NULL_HANDLE;
+    VkPhysicalDeviceMemoryProperties memory_properties{};
+    VkDeviceSize block_size = 0;
+    std::vector<Block> blocks;
+    MemoryStatistics statistics;
+};
@@ -1,6 +1,14 @@
+#include <stdint.h>
+#include <algorithm>
+#include <cmath>
+#include <unordered_map>
+#include <unordered_set>
+
 #include "mesh_renderer.h"
 #include "molecule_kernel.h"
+#include "grid_evaluator.h"
 #include "primitive_geometry_mesh.h"
+#include "thread_pool.h"
 
 namespace MarchingCubes
 {
@@ -297,18 +305,32 @@ namespace MarchingCubes
         {0, 3, 8, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
         {-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1} };
 
+    // Corner i of the tables sits at CornerOffset[i] in the cell, around the bottom face and then around the top face
+    const int CornerOffset[8][3] = {
+        {0, 0, 0}, {1, 0, 0}, {1, 1, 0}, {0, 1, 0},
+        {0, 0, 1}, {1, 0, 1}, {1, 1, 1}, {0, 1, 1} };
+
+    // Edge i of the tables runs from corner EdgeCorner[i][0] to corner EdgeCorner[i][1]
+    const int EdgeCorner[12][2] = {
+        {0, 1}, {1, 2}, {2, 3}, {3, 0},
+        {4, 5}, {5, 6}, {6, 7}, {7, 4},
+        {0, 4}, {1, 5}, {2, 6}, {3, 7} };
+
+    int CubeIndex(const float val[8], const float isovalue)
+    {
+        int Index = 0;
+        for (int i = 0; i < 8; i++)
+            if (val[i] < isovalue)
+                Index |= 1 << i;
+        return Index;
+    }
+
     glm::vec3 VertexInterp(const glm::vec3& p1, const glm::vec3& p2, float valp1, float valp2, float isolevel)
     {
         float t = (isolevel - valp1) / (valp2 - valp1);
         return p2 * t + p1 * (1.0f - t);
     }
 
-    struct GridCell
-    {
-        glm::vec3 p[8];
-        float val[8];
-    };
-
     int Polygonise(const GridCell Grid, const float isovalue, std::vector<int>& Triangles, std::vector<Vertex>& Vertices, const glm::vec3 color)
     {
         glm::vec3 VertexList[12];
@@ -317,15 +339,7 @@ namespace MarchingCubes
 
         //Determine the index into the edge table which
         //tells us which vertices are inside of the surface
-        int CubeIndex = 0;
-        if (Grid.val[0] < isovalue) CubeIndex |= 1;
-        if (Grid.val[1] < isovalue) CubeIndex |= 2;
-        if (Grid.val[2] < isovalue) CubeIndex |= 4;
-        if (Grid.val[3] < isovalue) CubeIndex |= 8;
-        if (Grid.val[4] < isovalue) CubeIndex |= 16;
-        if (Grid.val[5] < isovalue) CubeIndex |= 32;
-        if (Grid.val[6] < isovalue) CubeIndex |= 64;
-        if (Grid.val[7] < isovalue) CubeIndex |= 128;
+        int CubeIndex = MarchingCubes::CubeIndex(Grid.val, isovalue);
 
         //Cube is entirely in/out of the surface
         if (edgeTable[CubeIndex] == 0)
@@ -489,127 +503,775 @@ namespace MeshRenderer
         return true;
     }
 
+    // Two triangles, turned to the camera and put in front of the sphere by the vertex shader
+    const float impostor_quad_vertices[4 * 3]{ -1, -1, 0, 1, -1, 0, 1, 1, 0, -1, 1, 0 };
+    const int impostor_quad_triangles[2 * 3]{ 0, 1, 2, 0, 2, 3 };
+
+    // The box around the cylinder mesh, radius 0.5 and y from 0 to 2
+    const float impostor_box_vertices[8 * 3]{ -0.5, 0, -0.5, 0.5, 0, -0.5, 0.5, 0, 0.5, -0.5, 0, 0.5,
+                                              -0.5, 2, -0.5, 0.5, 2, -0.5, 0.5, 2, 0.5, -0.5, 2, 0.5 };
+    const int impostor_box_triangles[12 * 3]{ 0, 2, 1, 0, 3, 2, 4, 5, 6, 4, 6, 7,
+                                              0, 1, 5, 0, 5, 4, 1, 2, 6, 1, 6, 5,
+                                              2, 3, 7, 2, 7, 6, 3, 0, 4, 3, 4, 7 };
+
+    void getMoleculeMeshes(const bool impostor,
+                           std::vector<Vertex>& out_vertices,
+                           std::vector<uint32_t>& out_indices,
+                           uint32_t& out_sphere_vertex_count,
+                           uint32_t& out_sphere_index_count)
+    {
+        if (impostor)
+        {
+            const float* const mesh_vertices[2]{ impostor_quad_vertices, impostor_box_vertices };
+            const int* const mesh_triangles[2]{ impostor_quad_triangles, impostor_box_triangles };
+            const int n_vertex[2]{ 4, 8 }, n_triangle[2]{ 2, 12 };
+            for (int i_mesh = 0; i_mesh < 2; i_mesh++)
+            {
+                for (int i_vertex = 0; i_vertex < n_vertex[i_mesh]; i_vertex++)
+                {
+                    glm::vec3 vertex_object_space{ mesh_vertices[i_mesh][i_vertex * 3 + 0], mesh_vertices[i_mesh][i_vertex * 3 + 1], mesh_vertices[i_mesh][i_vertex * 3 + 2], };
+                    out_vertices.push_back(Vertex{ vertex_object_space, glm::vec3{1,1,1}, glm::vec3{0,0,0}, (uint32_t)(4 + i_mesh) });
+                }
+                for (int i_index = 0; i_index < n_triangle[i_mesh] * 3; i_index++)
+                    out_indices.push_back(mesh_triangles[i_mesh][i_index]);
+
+                if (i_mesh == 0)
+                {
+                    out_sphere_vertex_count = out_vertices.size();
+                    out_sphere_index_count = out_indices.size();
+                }
+            }
+            return;
+        }
+
+        const PrimitiveGeometryMesh::GeometryMesh* const meshes[2]{ &PrimitiveGeometryMesh::SphereMesh, &PrimitiveGeometryMesh::CylinderMesh };
+        for (int i_mesh = 0; i_mesh < 2; i_mesh++)
+        {
+            const PrimitiveGeometryMesh::GeometryMesh& mesh = *meshes[i_mesh];
+            for (int i_vertex = 0; i_vertex < mesh.vertex_count_times_three / 3; i_vertex++)
+            {
+                glm::vec3 vertex_object_space{ mesh.vertices[i_vertex * 3 + 0], mesh.vertices[i_vertex * 3 + 1], mesh.vertices[i_vertex * 3 + 2], };
+                // Same normals as renderMolecule, the cylinder ones are rotated in the vertex shader
+                glm::vec3 normal_object_space = i_mesh == 0 ? vertex_object_space : glm::vec3{ vertex_object_space.x, 0, vertex_object_space.z };
+                out_vertices.push_back(Vertex{ vertex_object_space, glm::vec3{1,1,1}, normal_object_space, (uint32_t)(2 + i_mesh) });
+            }
+
+            for (int i_triangle = 0; i_triangle < mesh.triangle_count_times_three / 3; i_triangle++)
+            {
+                out_indices.push_back(mesh.triangles[i_triangle * 3 + 0]);
+                out_indices.push_back(mesh.triangles[i_triangle * 3 + 2]);
+                out_indices.push_back(mesh.triangles[i_triangle * 3 + 1]); // The ordering is different
+            }
+
+            if (i_mesh == 0)
+            {
+                out_sphere_vertex_count = out_vertices.size();
+                out_sphere_index_count = out_indices.size();
+            }
+        }
+    }
+
+    inline uint32_t packColor(const float rgb[3])
+    {
+        uint32_t color = 255u << 24;
+        for (int i = 0; i < 3; i++)
+            color |= (uint32_t)(std::min(std::max(rgb[i], 0.0f), 1.0f) * 255.0f + 0.5f) << (8 * i);
+        return color;
+    }
+
+    void renderMoleculeInstances(const MoleculeStruct::MolecularDataOneFrame* const frame,
+                                 std::vector<MoleculeInstance>& out_instances)
+    {
+        for (int i_atom = 0; i_atom < frame->n_atom; i_atom++)
+        {
+            const MoleculeStruct::ChemistryAtom& atom = frame->atoms[i_atom];
+            out_instances.push_back(MoleculeInstance{ { atom.xyz[0], atom.xyz[1], atom.xyz[2] }, atom.vdw_radius, { 0, 0, 0 }, packColor(atom.rgb) });
+        }
+
+        std::vector<MoleculeStruct::ChemicalBond> bonds = MoleculeKernel::getBonds(frame);
+        for (const MoleculeStruct::ChemicalBond& bond : bonds)
+        {
+            const float* const center[2]{ bond.atom1_xyz, bond.atom2_xyz };
+            const float* const rgb[2]{ bond.atom1_rgb, bond.atom2_rgb };
+            for (int i_half_bond = 0; i_half_bond < 2; i_half_bond++)
+            {
+                MoleculeInstance instance{ { center[i_half_bond][0], center[i_half_bond][1], center[i_half_bond][2] }, bond_radius, {}, packColor(rgb[i_half_bond]) };
+                for (int i_xyz = 0; i_xyz < 3; i_xyz++)
+                    instance.axis[i_xyz] = 0.5f * (center[1 - i_half_bond][i_xyz] - center[i_half_bond][i_xyz]);
+                out_instances.push_back(instance);
+            }
+        }
+    }
+
+    inline int16_t packSnorm16(const float value)
+    {
+        return (int16_t)std::round(std::min(std::max(value, -1.0f), 1.0f) * 32767.0f);
+    }
+
+    // Normal projected on the octahedron |x| + |y| + |z| = 1, the lower half folded over the upper one, as the xy coordinates
+    inline void packOctahedralNormal(const glm::vec3& normal, int16_t out_normal[2])
+    {
+        const float norm_l1 = std::abs(normal.x) + std::abs(normal.y) + std::abs(normal.z);
+        if (norm_l1 == 0) // the impostor vertices have no normal
+        {
+            out_normal[0] = out_normal[1] = 0;
+            return;
+        }
+        float x = normal.x / norm_l1, y = normal.y / norm_l1;
+        if (normal.z < 0)
+        {
+            const float folded_x = (1 - std::abs(y)) * (x >= 0 ? 1 : -1);
+            y = (1 - std::abs(x)) * (y >= 0 ? 1 : -1);
+            x = folded_x;
+        }
+        out_normal[0] = packSnorm16(x);
+        out_normal[1] = packSnorm16(y);
+    }
+
+    void compactVertices(const std::vector<Vertex>& vertices,
+                         std::vector<CompactVertex>& out_vertices,
+                         VertexBounds& out_bounds)
+    {
+        glm::vec3 position_min(0), position_max(0);
+        if (!vertices.empty())
+            position_min = position_max = vertices[0].pos;
+        for (const Vertex& vertex : vertices)
+        {
+            position_min = glm::min(position_min, vertex.pos);
+            position_max = glm::max(position_max, vertex.pos);
+        }
+        const glm::vec3 position_scale = position_max - position_min;
+        out_bounds.position_offset = glm::vec4(position_min, 0);
+        out_bounds.position_scale = glm::vec4(position_scale, 0);
+
+        out_vertices.resize(vertices.size());
+        for (size_t i_vertex = 0; i_vertex < vertices.size(); i_vertex++)
+        {
+            const Vertex& vertex = vertices[i_vertex];
+            CompactVertex& compact_vertex = out_vertices[i_vertex];
+            for (int i_xyz = 0; i_xyz < 3; i_xyz++)
+                compact_vertex.position[i_xyz] = position_scale[i_xyz] > 0 ? (uint16_t)std::round((vertex.pos[i_xyz] - position_min[i_xyz]) / position_scale[i_xyz] * 65535.0f) : 0;
+            compact_vertex.render_type = (uint16_t)vertex.render_type;
+            packOctahedralNormal(vertex.normal, compact_vertex.normal);
+            const float rgb[3]{ vertex.color.x, vertex.color.y, vertex.color.z };
+            compact_vertex.color = packColor(rgb);
+        }
+    }
+
     const float bounding_box_additional_extension = 3.0f;
     const float top_level_minimal_resolution = 0.5f;
     const int octree_level = 3;
     const float isosurface_threshold = 0.08f;
+    const float density_isosurface_threshold = 0.02f;
+    const float spin_density_isosurface_threshold = 0.002f;
     const glm::vec3 orbital_color[2]{ glm::vec3(1,0,0), glm::vec3(0,0,1) };
 
-    bool renderOrbitalRecursive(const MoleculeStruct::MolecularDataOneFrame* const frame,
-                                const glm::vec3 voxel_origin,
-                                const glm::vec3 voxel_unit_cell,
-                                const int voxel_grid_dimension[3],
-                                const float isovalue,
-                                const int layer,
-                                std::vector<Vertex>& out_vertices,
-                                std::vector<uint32_t>& out_indices)
+    // Every level of the octree lies on the lattice of the finest level, 2^(octree_level - 1) finest cells per top level cell.
+    // Samples are keyed by their lattice index. An isosurface vertex is keyed by the finest lattice edge it lies on: the lattice
+    // index of the lower end of the edge, the axis of the edge and the lobe sign, so the cells around an edge share its vertex.
+    const int lattice_key_bits = 20;
+    const int octree_top_level_step = 1 << (octree_level - 1);
+
+    inline uint64_t latticePointKey(const int lattice_index[3])
+    {
+        return ((uint64_t)lattice_index[0] << (2 * lattice_key_bits))
+             | ((uint64_t)lattice_index[1] << lattice_key_bits)
+             | (uint64_t)lattice_index[2];
+    }
+
+    inline uint64_t latticeEdgeKey(const int lattice_index[3], const int axis, const int i_sign)
+    {
+        return (latticePointKey(lattice_index) << 3) | (uint64_t)(axis << 1) | (uint64_t)(i_sign > 0 ? 1 : 0);
+    }
+
+    // Field samples of the adaptive octree, each lattice point is evaluated once however many cells and levels share it.
+    // The top level is a dense grid, the finer points off it are hashed.
+    struct OctreeSamples
+    {
+        int top_level_dimension[3];
+        std::vector<float> top_level_values; // As evaluateGridBlockSparse stores them
+        std::unordered_map<uint64_t, float> refined_values;
+
+        float get(const int lattice_index[3]) const
+        {
+            if (lattice_index[0] % octree_top_level_step == 0 && lattice_index[1] % octree_top_level_step == 0 && lattice_index[2] % octree_top_level_step == 0)
+                return top_level_values[(lattice_index[0] / octree_top_level_step) * (top_level_dimension[1] + 1) * (top_level_dimension[2] + 1)
+                                        + (lattice_index[1] / octree_top_level_step) * (top_level_dimension[2] + 1)
+                                        + lattice_index[2] / octree_top_level_step];
+            return refined_values.find(latticePointKey(lattice_index))->second;
+        }
+    };
+
+    // Corner values of the cell of size step at lattice_index, in the corner order of the Marching Cubes tables
+    void getCellValues(const OctreeSamples& samples, const int lattice_index[3], const int step, float corner_values[8])
+    {
+        for (int i_corner = 0; i_corner < 8; i_corner++)
+        {
+            const int* corner_offset = MarchingCubes::CornerOffset[i_corner];
+            const int corner_lattice_index[3]{ lattice_index[0] + corner_offset[0] * step,
+                                               lattice_index[1] + corner_offset[1] * step,
+                                               lattice_index[2] + corner_offset[2] * step, };
+            corner_values[i_corner] = samples.get(corner_lattice_index);
+        }
+    }
+
+    inline bool crossesIsovalue(const float corner_values[8], const float isovalue)
+    {
+        float evaluation_max = corner_values[0], evaluation_min = corner_values[0];
+        for (int i = 1; i < 8; i++)
+        {
+            evaluation_max = fmaxf(evaluation_max, corner_values[i]);
+            evaluation_min = fminf(evaluation_min, corner_values[i]);
+        }
+        return (evaluation_min < isovalue && isovalue < evaluation_max) || (evaluation_min < -isovalue && -isovalue < evaluation_max);
+    }
+
+    struct OctreeCell
+    {
+        int lattice_index[3]; // Lower corner, or the point itself where lists of lattice points reuse the struct
+    };
+
+    // Evaluates the lattice points that are not sampled yet in one call, grouped into the sparse blocks of the top level
+    // so that they are screened alike. Points of the top level grid are always sampled.
+    template <typename Precision>
+    void sampleLatticePoints(const MoleculeStruct::MolecularDataOneFrame* const frame,
+                             const GridEvaluator::FieldType field,
+                             const MoleculeKernel::SortedBasis& basis,
+                             const float* const ao_extents,
+                             const glm::vec3 origin,
+                             const glm::vec3 lattice_unit_cell,
+                             const std::vector<OctreeCell>& points,
+                             OctreeSamples& samples)
+    {
+        int group_shift = 0;
+        while ((1 << group_shift) < octree_top_level_step * GridEvaluator::sparse_block_size)
+            group_shift++;
+
+        // (group key, point key), sorted so that the points of a group are contiguous and in a deterministic order
+        std::vector<std::pair<uint64_t, uint64_t>> new_points;
+        for (const OctreeCell& point : points)
+        {
+            const int* lattice_index = point.lattice_index;
+            if (lattice_index[0] % octree_top_level_step == 0 && lattice_index[1] % octree_top_level_step == 0 && lattice_index[2] % octree_top_level_step == 0)
+                continue;
+            const uint64_t point_key = latticePointKey(lattice_index);
+            if (!samples.refined_values.emplace(point_key, 0.0f).second)
+                continue;
+            const int group_index[3]{ lattice_index[0] >> group_shift, lattice_index[1] >> group_shift, lattice_index[2] >> group_shift, };
+            new_points.emplace_back(latticePointKey(group_index), point_key);
+        }
+        if (new_points.empty())
+            return;
+        std::sort(new_points.begin(), new_points.end());
+
+        const int n_point = new_points.size();
+        std::vector<float> xyz(n_point * 3), values(n_point);
+        std::vector<int> group_offsets{ 0 };
+        const uint64_t lattice_mask = (1ull << lattice_key_bits) - 1;
+        for (int i_point = 0; i_point < n_point; i_point++)
+        {
+            if (i_point > 0 && new_points[i_point].first != new_points[i_point - 1].first)
+                group_offsets.push_back(i_point);
+            const uint64_t point_key = new_points[i_point].second;
+            xyz[i_point * 3 + 0] = origin.x + (point_key >> (2 * lattice_key_bits)) * lattice_unit_cell.x;
+            xyz[i_point * 3 + 1] = origin.y + ((point_key >> lattice_key_bits) & lattice_mask) * lattice_unit_cell.y;
+            xyz[i_point * 3 + 2] = origin.z + (point_key & lattice_mask) * lattice_unit_cell.z;
+        }
+        group_offsets.push_back(n_point);
+
+        GridEvaluator::evaluatePointGroupsSparse<Precision>(field, frame, basis, ao_extents, group_offsets.size() - 1, group_offsets.data(), xyz.data(), values.data());
+
+        for (int i_point = 0; i_point < n_point; i_point++)
+            samples.refined_values[new_points[i_point].second] = values[i_point];
+    }
+
+    // The lattice points of the cells split in two along each axis
+    void appendSubcellPoints(const std::vector<OctreeCell>& cells, const int step, std::vector<OctreeCell>& points)
+    {
+        const int half_step = step / 2;
+        for (const OctreeCell& cell : cells)
+            for (int i_x = 0; i_x <= 2; i_x++)
+                for (int i_y = 0; i_y <= 2; i_y++)
+                    for (int i_z = 0; i_z <= 2; i_z++)
+                        if (i_x % 2 == 1 || i_y % 2 == 1 || i_z % 2 == 1) // The corners are sampled already
+                            points.push_back(OctreeCell{ { cell.lattice_index[0] + i_x * half_step,
+                                                           cell.lattice_index[1] + i_y * half_step,
+                                                           cell.lattice_index[2] + i_z * half_step, } });
+    }
+
+    // Key of the finest lattice edge that edge i_edge of the tables is on in the cell
+    inline uint64_t cellEdgeKey(const OctreeCell& cell, const int i_edge, const int i_sign)
+    {
+        const int* offset_a = MarchingCubes::CornerOffset[MarchingCubes::EdgeCorner[i_edge][0]];
+        const int* offset_b = MarchingCubes::CornerOffset[MarchingCubes::EdgeCorner[i_edge][1]];
+        int edge_lattice_index[3], axis = 0;
+        for (int i_xyz = 0; i_xyz < 3; i_xyz++)
+        {
+            edge_lattice_index[i_xyz] = cell.lattice_index[i_xyz] + std::min(offset_a[i_xyz], offset_b[i_xyz]);
+            if (offset_a[i_xyz] != offset_b[i_xyz])
+                axis = i_xyz;
+        }
+        return latticeEdgeKey(edge_lattice_index, axis, i_sign);
+    }
+
+    const int extraction_chunk_size = 256; // Cells or vertices per task of the parallel extraction
+
+    // Marching Cubes on the finest level cells, in parallel over fixed chunks of the cells sorted by lattice key:
+    // a counting pass collects the edge keys and triangle count of each chunk, the exclusive prefix sum of the triangle counts
+    // gives each chunk its place in out_indices, and the sorted unique edge keys number the vertices. Vertices and triangles
+    // are then written in parallel into the preallocated output, which is the same for any thread count.
+    bool extractMarchingCubes(const std::vector<OctreeCell>& cells,
+                              const OctreeSamples& samples,
+                              const glm::vec3 origin,
+                              const glm::vec3 lattice_unit_cell,
+                              const float isovalue,
+                              std::vector<Vertex>& out_vertices,
+                              std::vector<uint32_t>& out_indices)
     {
-        float* evaluation_pool = new float[(voxel_grid_dimension[0] + 1) * (voxel_grid_dimension[1] + 1) * (voxel_grid_dimension[2] + 1)];
+        const int n_cell = cells.size();
+        const int n_chunk = (n_cell + extraction_chunk_size - 1) / extraction_chunk_size;
 
-        for (int i_x = 0; i_x < voxel_grid_dimension[0] + 1; i_x++)
-            for (int i_y = 0; i_y < voxel_grid_dimension[1] + 1; i_y++)
-                for (int i_z = 0; i_z < voxel_grid_dimension[2] + 1; i_z++)
+        // Counting pass
+        std::vector<std::vector<uint64_t>> chunk_edge_keys(n_chunk);
+        std::vector<int64_t> chunk_triangle_offsets(n_chunk + 1, 0);
+        ThreadPool::parallelFor(n_chunk, [&](const int i_chunk)
+        {
+            std::vector<uint64_t>& edge_keys = chunk_edge_keys[i_chunk];
+            int64_t n_triangle = 0;
+            float corner_values[8];
+            for (int i_cell = i_chunk * extraction_chunk_size; i_cell < std::min(n_cell, (i_chunk + 1) * extraction_chunk_size); i_cell++)
+            {
+                getCellValues(samples, cells[i_cell].lattice_index, 1, corner_values);
+                for (int i_sign = 1; i_sign >= -1; i_sign -= 2)
                 {
-                    int i_pool = i_x * (voxel_grid_dimension[1] + 1) * (voxel_grid_dimension[2] + 1) + i_y * (voxel_grid_dimension[2] + 1) + i_z;
-                    float evulation_position[3]{ voxel_origin.x + i_x * voxel_unit_cell.x,
-                                                 voxel_origin.y + i_y * voxel_unit_cell.y,
-                                                 voxel_origin.z + i_z * voxel_unit_cell.z, };
-                    evaluation_pool[i_pool] = MoleculeKernel::evaluateOrbital(evulation_position, frame);
+                    const char* triangle_edges = MarchingCubes::triTable[MarchingCubes::CubeIndex(corner_values, isovalue * i_sign)];
+                    for (int i = 0; triangle_edges[i] != -1; i++)
+                        edge_keys.push_back(cellEdgeKey(cells[i_cell], triangle_edges[i], i_sign));
+                    for (int i = 0; triangle_edges[i] != -1; i += 3)
+                        n_triangle++;
                 }
+            }
+            std::sort(edge_keys.begin(), edge_keys.end());
+            edge_keys.erase(std::unique(edge_keys.begin(), edge_keys.end()), edge_keys.end());
+            chunk_triangle_offsets[i_chunk + 1] = n_triangle;
+        });
+
+        for (int i_chunk = 0; i_chunk < n_chunk; i_chunk++)
+            chunk_triangle_offsets[i_chunk + 1] += chunk_triangle_offsets[i_chunk];
+
+        // Vertex i is the i-th smallest edge key
+        std::vector<uint64_t> edge_keys;
+        for (const std::vector<uint64_t>& keys : chunk_edge_keys)
+            edge_keys.insert(edge_keys.end(), keys.begin(), keys.end());
+        std::sort(edge_keys.begin(), edge_keys.end());
+        edge_keys.erase(std::unique(edge_keys.begin(), edge_keys.end()), edge_keys.end());
+
+        const size_t i_first_vertex = out_vertices.size(), i_first_index = out_indices.size();
+        if (i_first_vertex + edge_keys.size() > UINT32_MAX)
+        {
+            std::cout << "Too many vertices in your mesh!" << std::endl;
+            return false;
+        }
+        out_vertices.resize(i_first_vertex + edge_keys.size());
+        out_indices.resize(i_first_index + chunk_triangle_offsets[n_chunk] * 3);
 
-        for (int i_x = 0; i_x < voxel_grid_dimension[0]; i_x++)
-            for (int i_y = 0; i_y < voxel_grid_dimension[1]; i_y++)
-                for (int i_z = 0; i_z < voxel_grid_dimension[2]; i_z++)
+        // Vertex pass, interpolated from the lower end of the edge
+        const int n_vertex = edge_keys.size();
+        const uint64_t lattice_mask = (1ull << lattice_key_bits) - 1;
+        ThreadPool::parallelFor((n_vertex + extraction_chunk_size - 1) / extraction_chunk_size, [&](const int i_chunk)
+        {
+            for (int i_vertex = i_chunk * extraction_chunk_size; i_vertex < std::min(n_vertex, (i_chunk + 1) * extraction_chunk_size); i_vertex++)
+            {
+                const uint64_t edge_key = edge_keys[i_vertex];
+                const int i_sign = (edge_key & 1) ? 1 : -1, axis = (edge_key >> 1) & 3;
+                const uint64_t point_key = edge_key >> 3;
+                int lower_index[3]{ (int)(point_key >> (2 * lattice_key_bits)), (int)((point_key >> lattice_key_bits) & lattice_mask), (int)(point_key & lattice_mask), };
+                int upper_index[3]{ lower_index[0], lower_index[1], lower_index[2], };
+                upper_index[axis]++;
+
+                glm::vec3 lower_position = origin + glm::vec3(lower_index[0], lower_index[1], lower_index[2]) * lattice_unit_cell;
+                glm::vec3 upper_position = lower_position;
+                upper_position[axis] += lattice_unit_cell[axis];
+                glm::vec3 position = MarchingCubes::VertexInterp(lower_position, upper_position,
+                    samples.get(lower_index), samples.get(upper_index), isovalue * i_sign);
+
+                out_vertices[i_first_vertex + i_vertex] = Vertex{ position, i_sign > 0 ? orbital_color[0] : orbital_color[1], glm::vec3{0,0,0}, 1 };
+            }
+        });
+
+        // Triangle pass
+        ThreadPool::parallelFor(n_chunk, [&](const int i_chunk)
+        {
+            size_t i_index = i_first_index + chunk_triangle_offsets[i_chunk] * 3;
+            float corner_values[8];
+            for (int i_cell = i_chunk * extraction_chunk_size; i_cell < std::min(n_cell, (i_chunk + 1) * extraction_chunk_size); i_cell++)
+            {
+                getCellValues(samples, cells[i_cell].lattice_index, 1, corner_values);
+                for (int i_sign = 1; i_sign >= -1; i_sign -= 2)
                 {
-                    float evaluation_voxel[8];
-                    for (int i_x_voxel = 0; i_x_voxel < 2; i_x_voxel++)
-                        for (int i_y_voxel = 0; i_y_voxel < 2; i_y_voxel++)
-                            for (int i_z_voxel = 0; i_z_voxel < 2; i_z_voxel++)
-                            {
-                                int i_pool = (i_x + i_x_voxel) * (voxel_grid_dimension[1] + 1) * (voxel_grid_dimension[2] + 1)
-                                    + (i_y + i_y_voxel) * (voxel_grid_dimension[2] + 1)
-                                    + i_z + i_z_voxel;
-                                int i_voxel = i_x_voxel * 4 + i_y_voxel * 2 + i_z_voxel;
-
-                                evaluation_voxel[i_voxel] = evaluation_pool[i_pool];
-                            }
-
-                    float evaluation_max = evaluation_voxel[0], evaluation_min = evaluation_voxel[0];
-                    for (int i = 1; i < 8; i++)
+                    const char* triangle_edges = MarchingCubes::triTable[MarchingCubes::CubeIndex(corner_values, isovalue * i_sign)];
+                    for (int i_triangle = 0; triangle_edges[i_triangle * 3] != -1; i_triangle++)
                     {
-                        evaluation_max = fmaxf(evaluation_max, evaluation_voxel[i]);
-                        evaluation_min = fminf(evaluation_min, evaluation_voxel[i]);
-                    }
-
-                    for (int i_sign = 1; i_sign >= -1; i_sign -= 2)
-                        if (evaluation_min < isovalue * i_sign && isovalue * i_sign < evaluation_max)
+                        uint32_t triangle_vertices[3];
+                        for (int i_vertex = 0; i_vertex < 3; i_vertex++)
                         {
-                            glm::vec3 evulation_position = voxel_origin + glm::vec3(i_x, i_y, i_z) * voxel_unit_cell;
-
-                            if (layer == 0) // Resolve
-                            {
-                                MarchingCubes::GridCell voxel{};
-                                for (int i_x_voxel = 0; i_x_voxel < 2; i_x_voxel++)
-                                    for (int i_y_voxel = 0; i_y_voxel < 2; i_y_voxel++)
-                                        for (int i_z_voxel = 0; i_z_voxel < 2; i_z_voxel++)
-                                        {
-                                            int i_voxel = i_x_voxel * 4 + i_y_voxel * 2 + i_z_voxel;
-                                            voxel.p[i_voxel] = evulation_position + glm::vec3(i_x_voxel, i_y_voxel, i_z_voxel) * voxel_unit_cell;
-                                            voxel.val[i_voxel] = evaluation_voxel[i_voxel];
-                                        }
-
-                                std::vector<int> triangles_temp;
-                                int vertices_count_before = out_vertices.size();
-                                int n_new_triangles = MarchingCubes::Polygonise(voxel,
-                                    isovalue * i_sign,
-                                    triangles_temp,
-                                    out_vertices,
-                                    i_sign > 0 ? orbital_color[0] : orbital_color[1]);
-
-                                if (n_new_triangles * 3 + vertices_count_before > UINT32_MAX)
-                                {
-                                    std::cout << "Too many vertices in your mesh!" << std::endl;
-                                    delete[] evaluation_pool;
-                                    return false;
-                                }
-
-                                for (int i = 0; i < n_new_triangles; i++)
-                                {
-                                    out_indices.push_back(triangles_temp[i * 3 + 0] + vertices_count_before);
-                                    out_indices.push_back(triangles_temp[i * 3 + 1] + vertices_count_before);
-                                    out_indices.push_back(triangles_temp[i * 3 + 2] + vertices_count_before);
-                                }
-                            }
-                            else // Recursive
-                            {
-                                int unitcell_division[3]{ 2,2,2 };
-
-                                bool success = renderOrbitalRecursive(frame,
-                                    evulation_position,
-                                    voxel_unit_cell * 0.5f,
-                                    unitcell_division,
-                                    isovalue,
-                                    layer - 1,
-                                    out_vertices,
-                                    out_indices);
-
-                                if (!success)
-                                {
-                                    delete[] evaluation_pool;
-                                    return false;
-                                }
-                            }
+                            const uint64_t edge_key = cellEdgeKey(cells[i_cell], triangle_edges[i_triangle * 3 + i_vertex], i_sign);
+                            triangle_vertices[i_vertex] = i_first_vertex + (std::lower_bound(edge_keys.begin(), edge_keys.end(), edge_key) - edge_keys.begin());
                         }
+
+                        // The tables mark corners below the isovalue, which is outside of a positive lobe and inside of a negative one.
+                        // Flip the positive lobe so that both wind like the atom spheres seen from outside.
+                        out_indices[i_index++] = triangle_vertices[0];
+                        out_indices[i_index++] = triangle_vertices[i_sign > 0 ? 2 : 1];
+                        out_indices[i_index++] = triangle_vertices[i_sign > 0 ? 1 : 2];
+                    }
+                }
+            }
+        });
+
+        return true;
+    }
+
+    // Surface Nets on the finest level cells sorted by lattice key, in the same chunks as extractMarchingCubes.
+    // Every cell crossing an isovalue gets one vertex at the mean of its edge crossings, and every crossed lattice edge becomes
+    // a quad joining the vertices of the four cells around it. The quad of an edge is emitted by the cell it starts at.
+    bool extractSurfaceNets(const std::vector<OctreeCell>& cells,
+                            const OctreeSamples& samples,
+                            const glm::vec3 origin,
+                            const glm::vec3 lattice_unit_cell,
+                            const float isovalue,
+                            std::vector<Vertex>& out_vertices,
+                            std::vector<uint32_t>& out_indices)
+    {
+        const int n_cell = cells.size();
+        const int n_chunk = (n_cell + extraction_chunk_size - 1) / extraction_chunk_size;
+        std::vector<uint64_t> cell_keys(n_cell);
+        for (int i_cell = 0; i_cell < n_cell; i_cell++)
+            cell_keys[i_cell] = latticePointKey(cells[i_cell].lattice_index);
+
+        // The cells around the edge from the lower corner of the cell along axis, counterclockwise seen from the positive axis.
+        // Returns false if one of them is not extracted.
+        auto findEdgeCells = [&](const OctreeCell& cell, const int axis, int edge_cells[4])
+        {
+            const int axis_b = (axis + 1) % 3, axis_c = (axis + 2) % 3;
+            const int offsets[4][2]{ { 0, 0 }, { -1, 0 }, { -1, -1 }, { 0, -1 } };
+            for (int i = 0; i < 4; i++)
+            {
+                OctreeCell neighbor = cell;
+                neighbor.lattice_index[axis_b] += offsets[i][0];
+                neighbor.lattice_index[axis_c] += offsets[i][1];
+                if (neighbor.lattice_index[axis_b] < 0 || neighbor.lattice_index[axis_c] < 0)
+                    return false;
+                const uint64_t key = latticePointKey(neighbor.lattice_index);
+                auto found = std::lower_bound(cell_keys.begin(), cell_keys.end(), key);
+                if (found == cell_keys.end() || *found != key)
+                    return false;
+                edge_cells[i] = found - cell_keys.begin();
+            }
+            return true;
+        };
+
+        // Counting pass, vertices and quads of each chunk
+        std::vector<int64_t> chunk_vertex_offsets(n_chunk + 1, 0), chunk_quad_offsets(n_chunk + 1, 0);
+        ThreadPool::parallelFor(n_chunk, [&](const int i_chunk)
+        {
+            float corner_values[8];
+            int edge_cells[4];
+            for (int i_cell = i_chunk * extraction_chunk_size; i_cell < std::min(n_cell, (i_chunk + 1) * extraction_chunk_size); i_cell++)
+            {
+                getCellValues(samples, cells[i_cell].lattice_index, 1, corner_values);
+                for (int i_sign = 1; i_sign >= -1; i_sign -= 2)
+                {
+                    const int cube_index = MarchingCubes::CubeIndex(corner_values, isovalue * i_sign);
+                    if (cube_index == 0 || cube_index == 255)
+                        continue;
+                    chunk_vertex_offsets[i_chunk + 1]++;
+                    for (int axis = 0; axis < 3; axis++)
+                    {
+                        const bool lower_below = corner_values[0] < isovalue * i_sign;
+                        const bool upper_below = corner_values[axis == 0 ? 1 : axis == 1 ? 3 : 4] < isovalue * i_sign;
+                        if (lower_below != upper_below && findEdgeCells(cells[i_cell], axis, edge_cells))
+                            chunk_quad_offsets[i_chunk + 1]++;
+                    }
                 }
+            }
+        });
+
+        for (int i_chunk = 0; i_chunk < n_chunk; i_chunk++)
+        {
+            chunk_vertex_offsets[i_chunk + 1] += chunk_vertex_offsets[i_chunk];
+            chunk_quad_offsets[i_chunk + 1] += chunk_quad_offsets[i_chunk];
+        }
+
+        const size_t i_first_vertex = out_vertices.size(), i_first_index = out_indices.size();
+        if (i_first_vertex + chunk_vertex_offsets[n_chunk] > UINT32_MAX)
+        {
+            std::cout << "Too many vertices in your mesh!" << std::endl;
+            return false;
+        }
+        out_vertices.resize(i_first_vertex + chunk_vertex_offsets[n_chunk]);
+        out_indices.resize(i_first_index + chunk_quad_offsets[n_chunk] * 6);
+
+        // Vertex pass, cell_vertices[i_cell * 2 + (i_sign > 0 ? 0 : 1)] is the vertex of the cell for that lobe
+        std::vector<uint32_t> cell_vertices(n_cell * 2, UINT32_MAX);
+        ThreadPool::parallelFor(n_chunk, [&](const int i_chunk)
+        {
+            size_t i_vertex = i_first_vertex + chunk_vertex_offsets[i_chunk];
+            float corner_values[8];
+            for (int i_cell = i_chunk * extraction_chunk_size; i_cell < std::min(n_cell, (i_chunk + 1) * extraction_chunk_size); i_cell++)
+            {
+                getCellValues(samples, cells[i_cell].lattice_index, 1, corner_values);
+                const glm::vec3 cell_position = origin + glm::vec3(cells[i_cell].lattice_index[0], cells[i_cell].lattice_index[1], cells[i_cell].lattice_index[2]) * lattice_unit_cell;
+                for (int i_sign = 1; i_sign >= -1; i_sign -= 2)
+                {
+                    const float signed_isovalue = isovalue * i_sign;
+                    const int cube_index = MarchingCubes::CubeIndex(corner_values, signed_isovalue);
+                    if (cube_index == 0 || cube_index == 255)
+                        continue;
+
+                    glm::vec3 crossing_sum{ 0, 0, 0 };
+                    int n_crossing = 0;
+                    for (int i_edge = 0; i_edge < 12; i_edge++)
+                    {
+                        const int* corners = MarchingCubes::EdgeCorner[i_edge];
+                        if ((corner_values[corners[0]] < signed_isovalue) == (corner_values[corners[1]] < signed_isovalue))
+                            continue;
+                        const int* offset_a = MarchingCubes::CornerOffset[corners[0]];
+                        const int* offset_b = MarchingCubes::CornerOffset[corners[1]];
+                        crossing_sum += MarchingCubes::VertexInterp(glm::vec3(offset_a[0], offset_a[1], offset_a[2]), glm::vec3(offset_b[0], offset_b[1], offset_b[2]),
+                                                                    corner_values[corners[0]], corner_values[corners[1]], signed_isovalue);
+                        n_crossing++;
+                    }
+
+                    cell_vertices[i_cell * 2 + (i_sign > 0 ? 0 : 1)] = i_vertex;
+                    out_vertices[i_vertex++] = Vertex{ cell_position + crossing_sum / float(n_crossing) * lattice_unit_cell,
+                                                       i_sign > 0 ? orbital_color[0] : orbital_color[1], glm::vec3{0,0,0}, 1 };
+                }
+            }
+        });
+
+        // Quad pass
+        ThreadPool::parallelFor(n_chunk, [&](const int i_chunk)
+        {
+            size_t i_index = i_first_index + chunk_quad_offsets[i_chunk] * 6;
+            float corner_values[8];
+            int edge_cells[4];
+            for (int i_cell = i_chunk * extraction_chunk_size; i_cell < std::min(n_cell, (i_chunk + 1) * extraction_chunk_size); i_cell++)
+            {
+                getCellValues(samples, cells[i_cell].lattice_index, 1, corner_values);
+                for (int i_sign = 1; i_sign >= -1; i_sign -= 2)
+                {
+                    const int cube_index = MarchingCubes::CubeIndex(corner_values, isovalue * i_sign);
+                    if (cube_index == 0 || cube_index == 255)
+                        continue;
+                    for (int axis = 0; axis < 3; axis++)
+                    {
+                        const bool lower_below = corner_values[0] < isovalue * i_sign;
+                        const bool upper_below = corner_values[axis == 0 ? 1 : axis == 1 ? 3 : 4] < isovalue * i_sign;
+                        if (lower_below == upper_below || !findEdgeCells(cells[i_cell], axis, edge_cells))
+                            continue;
+
+                        uint32_t quad[4];
+                        for (int i = 0; i < 4; i++)
+                            quad[i] = cell_vertices[edge_cells[i] * 2 + (i_sign > 0 ? 0 : 1)];
 
-        delete[] evaluation_pool;
+                        // Counterclockwise around the edge faces along the axis. The lobe is on the side above the isovalue
+                        // for the positive sign and below it for the negative one, and faces outwards like the atom spheres.
+                        const bool counterclockwise = lower_below == (i_sign > 0);
+                        if (!counterclockwise)
+                            std::swap(quad[1], quad[3]);
+
+                        // Split along the shorter diagonal
+                        const float diagonal_02 = glm::distance(out_vertices[quad[0]].pos, out_vertices[quad[2]].pos);
+                        const float diagonal_13 = glm::distance(out_vertices[quad[1]].pos, out_vertices[quad[3]].pos);
+                        const int first = diagonal_02 <= diagonal_13 ? 0 : 1;
+                        for (int i = 0; i < 3; i++)
+                            out_indices[i_index++] = quad[(first + i) % 4];
+                        for (int i = 0; i < 3; i++)
+                            out_indices[i_index++] = quad[(first + 2 + i) % 4];
+                    }
+                }
+            }
+        });
 
         return true;
     }
 
+    // Adaptive octree: the cells of each level crossing an isovalue are split in two along each axis, down to the finest
+    // level where Marching Cubes runs. Refinement is decided from the sample cache, which every level adds its new points to.
+    template <typename Precision>
+    bool renderOrbitalOctree(const MoleculeStruct::MolecularDataOneFrame* const frame,
+                             const GridEvaluator::FieldType field,
+                             const MoleculeKernel::SortedBasis& basis,
+                             const float* const ao_extents,
+                             const glm::vec3 origin,
+                             const glm::vec3 top_level_unit_cell,
+                             const int top_level_dimension[3],
+                             const float isovalue,
+                             const IsosurfaceMesher mesher,
+                             std::vector<Vertex>& out_vertices,
+                             std::vector<uint32_t>& out_indices)
+    {
+        const glm::vec3 lattice_unit_cell = top_level_unit_cell / float(octree_top_level_step);
+
+        OctreeSamples samples;
+        for (int i_xyz = 0; i_xyz < 3; i_xyz++)
+            samples.top_level_dimension[i_xyz] = top_level_dimension[i_xyz];
+        samples.top_level_values.resize((top_level_dimension[0] + 1) * (top_level_dimension[1] + 1) * (top_level_dimension[2] + 1));
+        float grid_origin[3]{ origin.x, origin.y, origin.z, };
+        float grid_unit_cell[3]{ top_level_unit_cell.x, top_level_unit_cell.y, top_level_unit_cell.z, };
+        GridEvaluator::evaluateGridBlockSparse<Precision>(field, frame, basis, ao_extents, grid_origin, grid_unit_cell, top_level_dimension, samples.top_level_values.data());
+
+        std::vector<OctreeCell> cells, subcells;
+        float corner_values[8];
+        for (int i_x = 0; i_x < top_level_dimension[0]; i_x++)
+            for (int i_y = 0; i_y < top_level_dimension[1]; i_y++)
+                for (int i_z = 0; i_z < top_level_dimension[2]; i_z++)
+                {
+                    OctreeCell cell{ { i_x * octree_top_level_step, i_y * octree_top_level_step, i_z * octree_top_level_step, } };
+                    getCellValues(samples, cell.lattice_index, octree_top_level_step, corner_values);
+                    if (crossesIsovalue(corner_values, isovalue))
+                        cells.push_back(cell);
+                }
+
+        std::vector<OctreeCell> points;
+        for (int step = octree_top_level_step; step > 1; step /= 2)
+        {
+            points.clear();
+            appendSubcellPoints(cells, step, points);
+            sampleLatticePoints<Precision>(frame, field, basis, ao_extents, origin, lattice_unit_cell, points, samples);
+
+            const int half_step = step / 2;
+            subcells.clear();
+            for (const OctreeCell& cell : cells)
+                for (int i_corner = 0; i_corner < 8; i_corner++)
+                {
+                    const int* corner_offset = MarchingCubes::CornerOffset[i_corner];
+                    OctreeCell subcell{ { cell.lattice_index[0] + corner_offset[0] * half_step,
+                                          cell.lattice_index[1] + corner_offset[1] * half_step,
+                                          cell.lattice_index[2] + corner_offset[2] * half_step, } };
+                    getCellValues(samples, subcell.lattice_index, half_step, corner_values);
+                    if (crossesIsovalue(corner_values, isovalue))
+                        subcells.push_back(subcell);
+                }
+            std::swap(cells, subcells);
+        }
+
+        // The refinement misses finest cells whose coarser ancestors had no sign change at their corners, which would leave holes
+        // where the surface leaves the refined region. Follow the surface instead: every face of an extracted cell that the
+        // surface crosses pulls in the neighbor behind it, until no open face is left. All cells are on the finest level,
+        // so neighbors always agree on the vertices of the shared face and the result is one closed surface.
+        const int lattice_dimension[3]{ top_level_dimension[0] * octree_top_level_step,
+                                        top_level_dimension[1] * octree_top_level_step,
+                                        top_level_dimension[2] * octree_top_level_step, };
+        std::unordered_set<uint64_t> visited_cells;
+        for (const OctreeCell& cell : cells)
+            visited_cells.insert(latticePointKey(cell.lattice_index));
+
+        std::vector<OctreeCell> finest_cells;
+        while (!cells.empty())
+        {
+            finest_cells.insert(finest_cells.end(), cells.begin(), cells.end());
+            subcells.clear();
+            for (const OctreeCell& cell : cells)
+            {
+                getCellValues(samples, cell.lattice_index, 1, corner_values);
+
+                for (int i_face = 0; i_face < 6; i_face++)
+                {
+                    const int axis = i_face / 2, side = i_face % 2;
+                    OctreeCell neighbor = cell;
+                    neighbor.lattice_index[axis] += side == 0 ? -1 : 1;
+                    if (neighbor.lattice_index[axis] < 0 || neighbor.lattice_index[axis] >= lattice_dimension[axis])
+                        continue;
+
+                    float face_values[4];
+                    int n_face_corner = 0;
+                    for (int i_corner = 0; i_corner < 8; i_corner++)
+                        if (MarchingCubes::CornerOffset[i_corner][axis] == side)
+                            face_values[n_face_corner++] = corner_values[i_corner];
+                    float face_max = fmaxf(fmaxf(face_values[0], face_values[1]), fmaxf(face_values[2], face_values[3]));
+                    float face_min = fminf(fminf(face_values[0], face_values[1]), fminf(face_values[2], face_values[3]));
+                    bool face_crossed = (face_min < isovalue && isovalue <= face_max) || (face_min < -isovalue && -isovalue <= face_max);
+                    if (!face_crossed || !visited_cells.insert(latticePointKey(neighbor.lattice_index)).second)
+                        continue;
+
+                    subcells.push_back(neighbor);
+                }
+            }
+
+            points.clear();
+            for (const OctreeCell& cell : subcells)
+                for (int i_corner = 0; i_corner < 8; i_corner++)
+                {
+                    const int* corner_offset = MarchingCubes::CornerOffset[i_corner];
+                    points.push_back(OctreeCell{ { cell.lattice_index[0] + corner_offset[0],
+                                                   cell.lattice_index[1] + corner_offset[1],
+                                                   cell.lattice_index[2] + corner_offset[2], } });
+                }
+            sampleLatticePoints<Precision>(frame, field, basis, ao_extents, origin, lattice_unit_cell, points, samples);
+
+            std::swap(cells, subcells);
+        }
+
+        std::sort(finest_cells.begin(), finest_cells.end(), [](const OctreeCell& a, const OctreeCell& b)
+        {
+            return latticePointKey(a.lattice_index) < latticePointKey(b.lattice_index);
+        });
+        if (mesher == IsosurfaceMesher::SurfaceNets)
+            return extractSurfaceNets(finest_cells, samples, origin, lattice_unit_cell, isovalue, out_vertices, out_indices);
+        return extractMarchingCubes(finest_cells, samples, origin, lattice_unit_cell, isovalue, out_vertices, out_indices);
+    }
+
+    // Smooth normals from the analytic gradient at the vertex positions, pointing out of the lobe.
+    // Inside a positive lobe the field increases inwards, inside a negative lobe it decreases inwards.
+    template <typename Precision>
+    void computeIsosurfaceNormals(const MoleculeStruct::MolecularDataOneFrame* const frame,
+                                  const GridEvaluator::FieldType field,
+                                  std::vector<Vertex>& vertices,
+                                  const int i_first_vertex)
+    {
+        const int n_vertex = vertices.size() - i_first_vertex;
+        if (n_vertex <= 0)
+            return;
+
+        std::vector<float> xyz(n_vertex * 3), values(n_vertex), gradients(n_vertex * 3);
+        for (int i_vertex = 0; i_vertex < n_vertex; i_vertex++)
+            for (int i_xyz = 0; i_xyz < 3; i_xyz++)
+                xyz[i_vertex * 3 + i_xyz] = vertices[i_first_vertex + i_vertex].pos[i_xyz];
+
+        // The same chunks as the extraction, each evaluated on its own
+        ThreadPool::parallelFor((n_vertex + extraction_chunk_size - 1) / extraction_chunk_size, [&](const int i_chunk)
+        {
+            const int i_begin = i_chunk * extraction_chunk_size, n_chunk_vertex = std::min(extraction_chunk_size, n_vertex - i_begin);
+            GridEvaluator::evaluateFieldWithGradient<Precision>(field, frame, n_chunk_vertex, xyz.data() + i_begin * 3,
+                                                                values.data() + i_begin, gradients.data() + i_begin * 3);
+        });
+
+        for (int i_vertex = 0; i_vertex < n_vertex; i_vertex++)
+        {
+            glm::vec3 gradient{ gradients[i_vertex * 3 + 0], gradients[i_vertex * 3 + 1], gradients[i_vertex * 3 + 2], };
+            float gradient_length = glm::length(gradient);
+            if (gradient_length > 0)
+                vertices[i_first_vertex + i_vertex].normal = (values[i_vertex] > 0 ? -1.0f : 1.0f) / gradient_length * gradient;
+        }
+    }
+
+    float getIsovalue(const GridEvaluator::FieldType field)
+    {
+        if (field == GridEvaluator::FieldType::Density)
+            return density_isosurface_threshold;
+        else if (field == GridEvaluator::FieldType::SpinDensity)
+            return spin_density_isosurface_threshold;
+        return isosurface_threshold;
+    }
+
+    template <typename Precision>
     bool renderOrbital(const MoleculeStruct::MolecularDataOneFrame* const frame,
                        std::vector<Vertex>& out_vertices,
-                       std::vector<uint32_t>& out_indices)
+                       std::vector<uint32_t>& out_indices,
+                       const GridEvaluator::FieldType field,
+                       const IsosurfaceMesher mesher)
     {
         float bounding_box[2][3]; // min, max
         if (frame->n_atom > 0)
@@ -636,13 +1298,37 @@ namespace MeshRenderer
         glm::vec3 bounding_box_origin_v3{ bounding_box_origin[0], bounding_box_origin[1], bounding_box_origin[2], };
         glm::vec3 bounding_box_grid_unitlength_v3{ bounding_box_grid_unitlength[0], bounding_box_grid_unitlength[1], bounding_box_grid_unitlength[2], };
 
-        return renderOrbitalRecursive(frame,
+        const float isovalue = getIsovalue(field);
+
+        // Every grid, down to the finest level, only evaluates the AOs reaching it, in runs of equal angular type
+        MoleculeKernel::SortedBasis basis;
+        MoleculeKernel::sortBasis(frame, basis);
+        std::vector<float> frame_ao_extents(frame->n_AO), ao_extents(frame->n_AO);
+        MoleculeKernel::getAOExtents(frame, GridEvaluator::ao_extent_threshold, frame_ao_extents.data());
+        for (int i_ao = 0; i_ao < frame->n_AO; i_ao++)
+            ao_extents[i_ao] = frame_ao_extents[basis.sorted_to_original[i_ao]];
+
+        const int i_first_vertex = out_vertices.size();
+        bool success = renderOrbitalOctree<Precision>(frame,
+            field,
+            basis,
+            ao_extents.data(),
             bounding_box_origin_v3,
             bounding_box_grid_unitlength_v3,
             top_level_grid_dimension,
-            isosurface_threshold,
-            octree_level - 1,
+            isovalue,
+            mesher,
             out_vertices,
             out_indices);
+        if (!success)
+            return false;
+
+        computeIsosurfaceNormals<Precision>(frame, field, out_vertices, i_first_vertex);
+
+        return true;
     }
+
+    template bool renderOrbital<MoleculeKernel::FloatPrecision>(const MoleculeStruct::MolecularDataOneFrame* const, std::vector<Vertex>&, std::vector<uint32_t>&, const GridEvaluator::FieldType, const IsosurfaceMesher);
+    template bool renderOrbital<MoleculeKernel::DoublePrecision>(const MoleculeStruct::MolecularDataOneFrame* const, std::vector<Vertex>&, std::vector<uint32_t>&, const GridEvaluator::FieldType, const IsosurfaceMesher);
+    template bool renderOrbital<MoleculeKernel::MixedPrecision>(const MoleculeStruct::MolecularDataOneFrame* const, std::vector<Vertex>&, std::vector<uint32_t>&, const GridEvaluator::FieldType, const IsosurfaceMesher);
 }
\ No newline at end of file
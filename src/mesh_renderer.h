@@ -3,15 +3,62 @@
 #include <vector>
 
 #include "molecule_struct.h"
+#include "grid_evaluator.h"
 #include "renderer.h"
 
+namespace MarchingCubes
+{
+    struct GridCell
+    {
+        glm::vec3 p[8];
+        float val[8];
+    };
+
+    // Appends the triangles of one cell to Vertices and Triangles, the indices are local to the cell. Returns the triangle count.
+    int Polygonise(const GridCell Grid, const float isovalue, std::vector<int>& Triangles, std::vector<Vertex>& Vertices, const glm::vec3 color);
+}
+
 namespace MeshRenderer
 {
     bool renderMolecule(const MoleculeStruct::MolecularDataOneFrame* const frame,
                         std::vector<Vertex>& out_vertices,
                         std::vector<uint32_t>& out_indices);
 
+    // The unit sphere and the half bond cylinder of renderMolecule in object space, render types 2 and 3, for the instanced path.
+    // With impostor, a quad turned to the camera in the vertex shader and the box around the cylinder instead, render types 4 and 5,
+    // that the fragment shader ray casts. The cylinder indices follow the sphere ones and are numbered from the first cylinder vertex.
+    void getMoleculeMeshes(const bool impostor,
+                           std::vector<Vertex>& out_vertices,
+                           std::vector<uint32_t>& out_indices,
+                           uint32_t& out_sphere_vertex_count,
+                           uint32_t& out_sphere_index_count);
+
+    // The same atoms and bonds as renderMolecule, as one instance per atom in atom order followed by one per half bond
+    void renderMoleculeInstances(const MoleculeStruct::MolecularDataOneFrame* const frame,
+                                 std::vector<MoleculeInstance>& out_instances);
+
+    // Quantizes vertices for upload, the positions relative to out_bounds, their bounding box.
+    // Positions move by at most half a 1/65535 step of the box and normals turn by less than 0.01 degree.
+    void compactVertices(const std::vector<Vertex>& vertices,
+                         std::vector<CompactVertex>& out_vertices,
+                         VertexBounds& out_bounds);
+
+    enum class IsosurfaceMesher
+    {
+        MarchingCubes, // Vertices on the lattice edges
+        SurfaceNets, // One vertex per cell and one quad per crossed lattice edge, no slivers, but two sheets in a cell share a vertex
+    };
+
+    // The isovalue renderOrbital uses for the field, the surfaces are at +isovalue and -isovalue
+    float getIsovalue(const GridEvaluator::FieldType field);
+
+    // Isosurfaces of the chosen field, positive and negative lobes in different colors.
+    // Precision is the MoleculeKernel precision policy the field is evaluated with.
+    // Extracted on the ThreadPool threads, the mesh is the same for any thread count.
+    template <typename Precision = MoleculeKernel::FloatPrecision>
     bool renderOrbital(const MoleculeStruct::MolecularDataOneFrame* const frame,
                        std::vector<Vertex>& out_vertices,
-                       std::vector<uint32_t>& out_indices);
+                       std::vector<uint32_t>& out_indices,
+                       const GridEvaluator::FieldType field = GridEvaluator::FieldType::Orbital,
+                       const IsosurfaceMesher mesher = IsosurfaceMesher::MarchingCubes);
 }
\ No newline at end of file
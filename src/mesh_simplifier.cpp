@@ -0,0 +1,476 @@
+#include <math.h>
+#include <stdint.h>
+#include <algorithm>
+#include <queue>
+
+#include "mesh_simplifier.h"
+#include "thread_pool.h"
+
+namespace MeshSimplifier
+{
+    const int partition_triangles = 4096; // Triangles per spatial partition, about
+    const int max_partitions_per_axis = 16;
+    const float min_turn_cosine = 0.2f; // A collapse may not turn a triangle by more than ~78 degrees
+    const int min_component_triangles = 4; // A closed lobe never gets smaller than a tetrahedron
+
+    // Vertex states besides the index of the partition holding all of its triangles
+    const int vertex_on_partition_border = -1;
+    const int vertex_on_open_edge = -2; // Edges in one or more than two triangles, such vertices never move
+    const int vertex_unused = -3;
+
+    // Sum of squared distances to a set of planes, a symmetric 4x4 matrix stored as xx xy xz xw yy yz yw zz zw ww
+    struct Quadric
+    {
+        double a[10];
+
+        void add(const Quadric& other)
+        {
+            for (int i = 0; i < 10; i++)
+                a[i] += other.a[i];
+        }
+
+        double evaluate(const glm::vec3 p) const
+        {
+            const double x = p.x, y = p.y, z = p.z;
+            const double value = a[0] * x * x + 2 * a[1] * x * y + 2 * a[2] * x * z + 2 * a[3] * x
+                               + a[4] * y * y + 2 * a[5] * y * z + 2 * a[6] * y
+                               + a[7] * z * z + 2 * a[8] * z
+                               + a[9];
+            return std::max(0.0, value);
+        }
+    };
+
+    void computeQuadrics(const std::vector<Vertex>& vertices, const std::vector<uint32_t>& indices, const size_t i_first_index,
+                         std::vector<Quadric>& quadrics)
+    {
+        quadrics.assign(vertices.size(), Quadric{});
+        for (size_t i_index = i_first_index; i_index + 2 < indices.size(); i_index += 3)
+        {
+            const glm::vec3 p0 = vertices[indices[i_index]].pos, p1 = vertices[indices[i_index + 1]].pos, p2 = vertices[indices[i_index + 2]].pos;
+            glm::dvec3 normal = glm::cross(glm::dvec3(p1 - p0), glm::dvec3(p2 - p0));
+            const double normal_length = glm::length(normal);
+            if (normal_length == 0)
+                continue;
+            normal /= normal_length;
+            const double d = -glm::dot(normal, glm::dvec3(p0));
+            const Quadric plane{ { normal.x * normal.x, normal.x * normal.y, normal.x * normal.z, normal.x * d,
+                                   normal.y * normal.y, normal.y * normal.z, normal.y * d,
+                                   normal.z * normal.z, normal.z * d,
+                                   d * d } };
+            for (int i = 0; i < 3; i++)
+                quadrics[indices[i_index + i]].add(plane);
+        }
+    }
+
+    // What collapseEdges may change: vertices of vertex_partition[v] == partition move and receive collapses, and the triangle counts of
+    // components of component_partition[c] == partition are kept up to date. partition -1 is the whole mesh after the partitions,
+    // where everything but the vertices on open edges may move and every component is counted.
+    struct MeshState
+    {
+        std::vector<Quadric> quadrics;
+        std::vector<int> vertex_partition;
+        std::vector<int> vertex_component;
+        std::vector<int> component_partition;
+        std::vector<int> component_triangles;
+    };
+
+    struct Collapse
+    {
+        float cost;
+        uint32_t from, to; // Local vertices, from is removed and its triangles go to to
+        uint32_t stamp_from, stamp_to;
+
+        bool operator>(const Collapse& other) const
+        {
+            if (cost != other.cost)
+                return cost > other.cost;
+            return from != other.from ? from > other.from : to > other.to;
+        }
+    };
+
+    // Greedy half edge collapses on triangles (global vertex indices, three per triangle, rewritten without the removed triangles),
+    // cheapest first by the summed quadrics at the kept vertex, until n_target triangles remain or the cost exceeds max_cost.
+    void collapseEdges(const std::vector<Vertex>& vertices,
+                       MeshState& state,
+                       const int partition,
+                       const size_t n_target,
+                       const double max_cost,
+                       std::vector<uint32_t>& triangles)
+    {
+        // Local numbering, sorted by global index so that the result does not depend on the triangle order
+        std::vector<uint32_t> local_vertices(triangles);
+        std::sort(local_vertices.begin(), local_vertices.end());
+        local_vertices.erase(std::unique(local_vertices.begin(), local_vertices.end()), local_vertices.end());
+        const int n_vertex = local_vertices.size();
+        const int n_triangle = triangles.size() / 3;
+
+        std::vector<uint32_t> triangle_vertices(triangles.size());
+        for (size_t i = 0; i < triangles.size(); i++)
+            triangle_vertices[i] = std::lower_bound(local_vertices.begin(), local_vertices.end(), triangles[i]) - local_vertices.begin();
+        std::vector<std::vector<uint32_t>> vertex_triangles(n_vertex);
+        for (int i_triangle = 0; i_triangle < n_triangle; i_triangle++)
+            for (int i = 0; i < 3; i++)
+                vertex_triangles[triangle_vertices[i_triangle * 3 + i]].push_back(i_triangle);
+
+        std::vector<Quadric> quadrics(n_vertex);
+        std::vector<uint8_t> movable(n_vertex), removed(n_vertex, 0), triangle_alive(n_triangle, 1);
+        std::vector<uint32_t> stamps(n_vertex, 0);
+        for (int i_vertex = 0; i_vertex < n_vertex; i_vertex++)
+        {
+            quadrics[i_vertex] = state.quadrics[local_vertices[i_vertex]];
+            const int vertex_partition = state.vertex_partition[local_vertices[i_vertex]];
+            movable[i_vertex] = partition >= 0 ? vertex_partition == partition : vertex_partition != vertex_on_open_edge;
+        }
+        auto counted = [&](const uint32_t i_vertex)
+        {
+            return partition < 0 || state.component_partition[state.vertex_component[local_vertices[i_vertex]]] == partition;
+        };
+        auto position = [&](const uint32_t i_vertex)
+        {
+            return vertices[local_vertices[i_vertex]].pos;
+        };
+
+        auto getNeighbors = [&](const uint32_t i_vertex, std::vector<uint32_t>& neighbors)
+        {
+            neighbors.clear();
+            for (uint32_t i_triangle : vertex_triangles[i_vertex])
+                if (triangle_alive[i_triangle])
+                    for (int i = 0; i < 3; i++)
+                        if (triangle_vertices[i_triangle * 3 + i] != i_vertex)
+                            neighbors.push_back(triangle_vertices[i_triangle * 3 + i]);
+            std::sort(neighbors.begin(), neighbors.end());
+            neighbors.erase(std::unique(neighbors.begin(), neighbors.end()), neighbors.end());
+        };
+
+        std::priority_queue<Collapse, std::vector<Collapse>, std::greater<Collapse>> candidates;
+        auto pushCandidate = [&](const uint32_t from, const uint32_t to)
+        {
+            // Receiving a collapse changes the quadric, so the receiving end must be movable too in a partition
+            if (!movable[from] || (partition >= 0 && !movable[to]))
+                return;
+            if (vertices[local_vertices[from]].color != vertices[local_vertices[to]].color)
+                return;
+            Quadric sum = quadrics[from];
+            sum.add(quadrics[to]);
+            candidates.push(Collapse{ (float)sum.evaluate(position(to)), from, to, stamps[from], stamps[to] });
+        };
+
+        std::vector<uint32_t> neighbors, other_neighbors;
+        for (int i_vertex = 0; i_vertex < n_vertex; i_vertex++)
+        {
+            getNeighbors(i_vertex, neighbors);
+            for (uint32_t neighbor : neighbors)
+                if (neighbor > (uint32_t)i_vertex)
+                {
+                    pushCandidate(i_vertex, neighbor);
+                    pushCandidate(neighbor, i_vertex);
+                }
+        }
+
+        // The edge must be in exactly two triangles and its ends may share no other neighbor, otherwise the collapse pinches the surface.
+        // No remaining triangle may turn over.
+        auto canCollapse = [&](const uint32_t from, const uint32_t to)
+        {
+            int n_shared = 0;
+            for (uint32_t i_triangle : vertex_triangles[from])
+            {
+                if (!triangle_alive[i_triangle])
+                    continue;
+                const uint32_t* corners = &triangle_vertices[i_triangle * 3];
+                if (corners[0] == to || corners[1] == to || corners[2] == to)
+                {
+                    n_shared++;
+                    continue;
+                }
+                glm::vec3 old_corners[3], new_corners[3];
+                for (int i = 0; i < 3; i++)
+                {
+                    old_corners[i] = position(corners[i]);
+                    new_corners[i] = corners[i] == from ? position(to) : old_corners[i];
+                }
+                const glm::vec3 old_normal = glm::cross(old_corners[1] - old_corners[0], old_corners[2] - old_corners[0]);
+                const glm::vec3 new_normal = glm::cross(new_corners[1] - new_corners[0], new_corners[2] - new_corners[0]);
+                const float old_length = glm::length(old_normal), new_length = glm::length(new_normal);
+                if (old_length > 0 && glm::dot(old_normal, new_normal) <= min_turn_cosine * old_length * new_length)
+                    return false;
+            }
+            if (n_shared != 2)
+                return false;
+
+            if (counted(from) && state.component_triangles[state.vertex_component[local_vertices[from]]] - 2 < min_component_triangles)
+                return false;
+
+            getNeighbors(from, neighbors);
+            getNeighbors(to, other_neighbors);
+            int n_common = 0;
+            for (size_t i = 0, j = 0; i < neighbors.size() && j < other_neighbors.size();)
+            {
+                if (neighbors[i] < other_neighbors[j])
+                    i++;
+                else if (neighbors[i] > other_neighbors[j])
+                    j++;
+                else
+                {
+                    n_common++;
+                    i++;
+                    j++;
+                }
+            }
+            return n_common == 2;
+        };
+
+        size_t n_alive = n_triangle;
+        while (n_alive > n_target && !candidates.empty())
+        {
+            const Collapse collapse = candidates.top();
+            candidates.pop();
+            if (removed[collapse.from] || removed[collapse.to] || stamps[collapse.from] != collapse.stamp_from || stamps[collapse.to] != collapse.stamp_to)
+                continue;
+            if (collapse.cost > max_cost)
+                break;
+            if (!canCollapse(collapse.from, collapse.to))
+                continue;
+
+            std::vector<uint32_t>& to_triangles = vertex_triangles[collapse.to];
+            for (uint32_t i_triangle : vertex_triangles[collapse.from])
+            {
+                if (!triangle_alive[i_triangle])
+                    continue;
+                uint32_t* corners = &triangle_vertices[i_triangle * 3];
+                if (corners[0] == collapse.to || corners[1] == collapse.to || corners[2] == collapse.to)
+                {
+                    triangle_alive[i_triangle] = 0;
+                    n_alive--;
+                    if (counted(collapse.from))
+                        state.component_triangles[state.vertex_component[local_vertices[collapse.from]]]--;
+                    continue;
+                }
+                for (int i = 0; i < 3; i++)
+                    if (corners[i] == collapse.from)
+                        corners[i] = collapse.to;
+                to_triangles.push_back(i_triangle);
+            }
+            to_triangles.erase(std::remove_if(to_triangles.begin(), to_triangles.end(), [&](const uint32_t i_triangle)
+            {
+                return !triangle_alive[i_triangle];
+            }), to_triangles.end());
+            removed[collapse.from] = 1;
+            vertex_triangles[collapse.from].clear();
+            quadrics[collapse.to].add(quadrics[collapse.from]);
+            stamps[collapse.to]++;
+
+            getNeighbors(collapse.to, other_neighbors);
+            for (uint32_t neighbor : other_neighbors)
+            {
+                pushCandidate(collapse.to, neighbor);
+                pushCandidate(neighbor, collapse.to);
+            }
+        }
+
+        // In a partition only its own vertices have new quadrics
+        for (int i_vertex = 0; i_vertex < n_vertex; i_vertex++)
+            if ((partition < 0 || movable[i_vertex]) && !removed[i_vertex])
+                state.quadrics[local_vertices[i_vertex]] = quadrics[i_vertex];
+
+        triangles.clear();
+        for (int i_triangle = 0; i_triangle < n_triangle; i_triangle++)
+            if (triangle_alive[i_triangle])
+                for (int i = 0; i < 3; i++)
+                    triangles.push_back(local_vertices[triangle_vertices[i_triangle * 3 + i]]);
+    }
+
+    int findRoot(std::vector<int>& parents, int i)
+    {
+        while (parents[i] != i)
+        {
+            parents[i] = parents[parents[i]];
+            i = parents[i];
+        }
+        return i;
+    }
+
+    void simplifyWithQuadrics(const std::vector<Vertex>& vertices,
+                              std::vector<uint32_t>& indices,
+                              const size_t i_first_index,
+                              const size_t target_triangles,
+                              const float max_error,
+                              std::vector<Quadric>& quadrics)
+    {
+        const size_t n_triangle = (indices.size() - i_first_index) / 3;
+        if (n_triangle == 0 || (target_triangles == 0 && max_error <= 0) || (target_triangles >= n_triangle && max_error <= 0))
+            return;
+        const double max_cost = max_error > 0 ? (double)max_error * max_error : INFINITY;
+        const uint32_t* const triangle_indices = indices.data() + i_first_index;
+
+        MeshState state;
+        state.quadrics.swap(quadrics);
+
+        // Partitions on a regular grid over the bounding box, by triangle centroid
+        glm::vec3 box_min{ INFINITY, INFINITY, INFINITY }, box_max{ -INFINITY, -INFINITY, -INFINITY };
+        for (size_t i = 0; i < n_triangle * 3; i++)
+        {
+            box_min = glm::min(box_min, vertices[triangle_indices[i]].pos);
+            box_max = glm::max(box_max, vertices[triangle_indices[i]].pos);
+        }
+        const int n_per_axis = std::max(1, std::min(max_partitions_per_axis, (int)round(cbrt((double)n_triangle / partition_triangles))));
+        const int n_partition = n_per_axis * n_per_axis * n_per_axis;
+        const glm::vec3 partition_size = glm::max(box_max - box_min, glm::vec3(1e-6f)) / (float)n_per_axis;
+        std::vector<int> triangle_partitions(n_triangle);
+        for (size_t i_triangle = 0; i_triangle < n_triangle; i_triangle++)
+        {
+            const glm::vec3 centroid = (vertices[triangle_indices[i_triangle * 3]].pos + vertices[triangle_indices[i_triangle * 3 + 1]].pos
+                                      + vertices[triangle_indices[i_triangle * 3 + 2]].pos) / 3.0f;
+            int partition = 0;
+            for (int i_xyz = 0; i_xyz < 3; i_xyz++)
+                partition = partition * n_per_axis + std::min(n_per_axis - 1, std::max(0, (int)((centroid[i_xyz] - box_min[i_xyz]) / partition_size[i_xyz])));
+            triangle_partitions[i_triangle] = partition;
+        }
+
+        // Vertex partitions and open edges
+        state.vertex_partition.assign(vertices.size(), vertex_unused);
+        for (size_t i = 0; i < n_triangle * 3; i++)
+        {
+            int& vertex_partition = state.vertex_partition[triangle_indices[i]];
+            if (vertex_partition == vertex_unused)
+                vertex_partition = triangle_partitions[i / 3];
+            else if (vertex_partition != triangle_partitions[i / 3])
+                vertex_partition = vertex_on_partition_border;
+        }
+        std::vector<uint64_t> edge_keys(n_triangle * 3);
+        for (size_t i_triangle = 0; i_triangle < n_triangle; i_triangle++)
+            for (int i = 0; i < 3; i++)
+            {
+                const uint64_t a = triangle_indices[i_triangle * 3 + i], b = triangle_indices[i_triangle * 3 + (i + 1) % 3];
+                edge_keys[i_triangle * 3 + i] = std::min(a, b) << 32 | std::max(a, b);
+            }
+        std::sort(edge_keys.begin(), edge_keys.end());
+        for (size_t i_begin = 0, i_end; i_begin < edge_keys.size(); i_begin = i_end)
+        {
+            for (i_end = i_begin + 1; i_end < edge_keys.size() && edge_keys[i_end] == edge_keys[i_begin]; i_end++);
+            if (i_end - i_begin != 2)
+            {
+                state.vertex_partition[edge_keys[i_begin] >> 32] = vertex_on_open_edge;
+                state.vertex_partition[edge_keys[i_begin] & UINT32_MAX] = vertex_on_open_edge;
+            }
+        }
+
+        // Connected components, the lobes
+        std::vector<int> parents(vertices.size());
+        for (size_t i_vertex = 0; i_vertex < vertices.size(); i_vertex++)
+            parents[i_vertex] = i_vertex;
+        for (size_t i_triangle = 0; i_triangle < n_triangle; i_triangle++)
+            for (int i = 1; i < 3; i++)
+                parents[findRoot(parents, triangle_indices[i_triangle * 3 + i])] = findRoot(parents, triangle_indices[i_triangle * 3]);
+        state.vertex_component.resize(vertices.size());
+        for (size_t i_vertex = 0; i_vertex < vertices.size(); i_vertex++)
+            state.vertex_component[i_vertex] = findRoot(parents, i_vertex);
+        state.component_partition.assign(vertices.size(), vertex_unused);
+        state.component_triangles.assign(vertices.size(), 0);
+        for (size_t i_triangle = 0; i_triangle < n_triangle; i_triangle++)
+        {
+            const int component = state.vertex_component[triangle_indices[i_triangle * 3]];
+            int& component_partition = state.component_partition[component];
+            if (component_partition == vertex_unused)
+                component_partition = triangle_partitions[i_triangle];
+            else if (component_partition != triangle_partitions[i_triangle])
+                component_partition = vertex_on_partition_border;
+            state.component_triangles[component]++;
+        }
+
+        std::vector<uint32_t> triangles;
+        if (n_partition > 1)
+        {
+            std::vector<std::vector<uint32_t>> partition_triangle_lists(n_partition);
+            for (size_t i_triangle = 0; i_triangle < n_triangle; i_triangle++)
+                partition_triangle_lists[triangle_partitions[i_triangle]].insert(partition_triangle_lists[triangle_partitions[i_triangle]].end(),
+                                                                                 triangle_indices + i_triangle * 3, triangle_indices + i_triangle * 3 + 3);
+
+            // Each partition gets its share of the budget, the borders are left for the pass over the whole mesh
+            ThreadPool::parallelFor(n_partition, [&](const int i_partition)
+            {
+                std::vector<uint32_t>& partition_list = partition_triangle_lists[i_partition];
+                const size_t n_partition_triangle = partition_list.size() / 3;
+                if (n_partition_triangle == 0)
+                    return;
+                const size_t partition_target = target_triangles > 0 ? (n_partition_triangle * target_triangles + n_triangle - 1) / n_triangle : 0;
+                collapseEdges(vertices, state, i_partition, partition_target, max_cost, partition_list);
+            });
+
+            for (const std::vector<uint32_t>& partition_list : partition_triangle_lists)
+                triangles.insert(triangles.end(), partition_list.begin(), partition_list.end());
+            std::fill(state.component_triangles.begin(), state.component_triangles.end(), 0);
+            for (size_t i = 0; i < triangles.size(); i += 3)
+                state.component_triangles[state.vertex_component[triangles[i]]]++;
+        }
+        else
+            triangles.assign(triangle_indices, triangle_indices + n_triangle * 3);
+
+        collapseEdges(vertices, state, -1, target_triangles, max_cost, triangles);
+
+        indices.resize(i_first_index);
+        indices.insert(indices.end(), triangles.begin(), triangles.end());
+        quadrics.swap(state.quadrics);
+    }
+
+    void simplifyMesh(const std::vector<Vertex>& vertices,
+                      std::vector<uint32_t>& indices,
+                      const size_t i_first_index,
+                      const size_t target_triangles,
+                      const float max_error)
+    {
+        std::vector<Quadric> quadrics;
+        computeQuadrics(vertices, indices, i_first_index, quadrics);
+        simplifyWithQuadrics(vertices, indices, i_first_index, target_triangles, max_error, quadrics);
+    }
+
+    void buildLodChain(const std::vector<Vertex>& vertices,
+                       const std::vector<uint32_t>& indices,
+                       const size_t i_first_index,
+                       const int n_level,
+                       const float triangle_ratio,
+                       const float max_error,
+                       std::vector<std::vector<uint32_t>>& out_levels)
+    {
+        out_levels.clear();
+        out_levels.push_back(indices);
+
+        // The quadrics carry over from level to level, so the error of each level is measured against the full mesh
+        std::vector<Quadric> quadrics;
+        computeQuadrics(vertices, indices, i_first_index, quadrics);
+        float level_error = max_error;
+        for (int i_level = 1; i_level < n_level; i_level++)
+        {
+            std::vector<uint32_t> level_indices = out_levels.back();
+            const size_t n_triangle = (level_indices.size() - i_first_index) / 3;
+            simplifyWithQuadrics(vertices, level_indices, i_first_index, std::max<size_t>(1, (size_t)(n_triangle * triangle_ratio)), level_error, quadrics);
+            if (level_indices.size() == out_levels.back().size())
+                break;
+            out_levels.push_back(std::move(level_indices));
+            level_error *= 2;
+        }
+    }
+
+    void removeUnusedVertices(std::vector<Vertex>& vertices,
+                              std::vector<uint32_t>& indices,
+                              const size_t i_first_vertex,
+                              const size_t i_first_index)
+    {
+        std::vector<uint32_t> new_indices(vertices.size() - i_first_vertex, UINT32_MAX);
+        for (size_t i_index = i_first_index; i_index < indices.size(); i_index++)
+            if (indices[i_index] >= i_first_vertex)
+                new_indices[indices[i_index] - i_first_vertex] = 0;
+
+        size_t n_vertex = i_first_vertex;
+        for (size_t i_vertex = i_first_vertex; i_vertex < vertices.size(); i_vertex++)
+            if (new_indices[i_vertex - i_first_vertex] != UINT32_MAX)
+            {
+                new_indices[i_vertex - i_first_vertex] = n_vertex;
+                vertices[n_vertex++] = vertices[i_vertex];
+            }
+        vertices.resize(n_vertex);
+
+        for (size_t i_index = i_first_index; i_index < indices.size(); i_index++)
+            if (indices[i_index] >= i_first_vertex)
+                indices[i_index] = new_indices[indices[i_index] - i_first_vertex];
+    }
+}
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <stdint.h>
+#include <vector>
+
+#include "renderer.h"
+
+namespace MeshSimplifier
+{
+    // Quadric error metric edge collapses on the triangles of indices from i_first_index on, in place.
+    // Collapses move a vertex onto a neighbor, so the vertices themselves are never modified and the result still indexes them.
+    // Stops at target_triangles, 0 for no budget, or when the next collapse would move the surface more than max_error Angstrom,
+    // 0 for no limit. Vertices of different colors are never merged, and every closed lobe stays a closed surface of the same topology.
+    // The mesh is split in spatial partitions simplified in parallel with their borders fixed, the borders are simplified last.
+    void simplifyMesh(const std::vector<Vertex>& vertices,
+                      std::vector<uint32_t>& indices,
+                      const size_t i_first_index,
+                      const size_t target_triangles,
+                      const float max_error);
+
+    // Discrete levels of detail sharing the vertices: out_levels[0] is indices, every next level keeps triangle_ratio of the
+    // triangles of the previous one, with max_error doubled at each level. Stops early once a level cannot be reduced further.
+    void buildLodChain(const std::vector<Vertex>& vertices,
+                       const std::vector<uint32_t>& indices,
+                       const size_t i_first_index,
+                       const int n_level,
+                       const float triangle_ratio,
+                       const float max_error,
+                       std::vector<std::vector<uint32_t>>& out_levels);
+
+    // Removes the vertices from i_first_vertex on that no index refers to any more, and renumbers the indices from i_first_index on
+    void removeUnusedVertices(std::vector<Vertex>& vertices,
+                              std::vector<uint32_t>& indices,
+                              const size_t i_first_vertex,
+                              const size_t i_first_index);
+}
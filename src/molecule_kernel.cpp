@@ -1,10 +1,14 @@
 #include <math.h>
+#include <cmath>
+#include <algorithm>
 
 #include "molecule_kernel.h"
+#include "fast_exp.h"
 
-#define ONE_OVER_PI_TO_3_OVER_4 0.4237772081f // 1 / PI ^ (3/4)
-#define ANGSTROM2BOHR 1.889725989f
-#define ANGSTROM2BOHR_SQUARE 3.5710643135f
+// Double literals, cast to the working precision where they are used
+#define ONE_OVER_PI_TO_3_OVER_4 0.42377720812375763 // 1 / PI ^ (3/4)
+#define ANGSTROM2BOHR 1.8897259885789233
+#define ANGSTROM2BOHR_SQUARE 3.5710643099606859
 #define SQUARE(x) ((x)*(x))
 
 namespace MoleculeKernel
@@ -51,6 +55,141 @@ namespace MoleculeKernel
         return evaluateOrbital(xyz, frame->n_AO, frame->aos, frame->primitives, frame->mo_coefficients);
     }
 
+    // Normalization of one primitive of the AO, everything except the contraction, the angular part and the exponential
+    template <typename real>
+    inline real primitiveNormalization(const int quantum_number, const real exponent)
+    {
+        switch (quantum_number)
+        {
+        case ((1 << (0 * 2)) + 0): //s
+            return std::pow(2 * exponent, real(0.75)) * real(ONE_OVER_PI_TO_3_OVER_4); // (2 * exponent / PI) ^ (3/4)
+        case ((1 << (1 * 2)) + 0): //p-x
+        case ((1 << (1 * 2)) + 1): //p-y
+        case ((1 << (1 * 2)) + 2): //p-z
+            return std::pow(exponent, real(1.25)) * real(3.3635856610148585) * real(ONE_OVER_PI_TO_3_OVER_4); // ( 128 * exponent^5 / PI^3) ^ (1/4)
+        case ((1 << (2 * 2)) + 0): //d-xy
+        case ((1 << (2 * 2)) + 1): //d-xz
+        case ((1 << (2 * 2)) + 2): //d-yz
+            return std::pow(exponent, real(1.75)) * real(6.7271713220297170) * real(ONE_OVER_PI_TO_3_OVER_4); // (2048 * exponent^7 / PI^3) ^ (1/4)
+        case ((1 << (2 * 2)) + 3): //d-xx
+        case ((1 << (2 * 2)) + 4): //d-yy
+        case ((1 << (2 * 2)) + 5): //d-zz
+            return std::pow(exponent, real(1.75)) * real(6.7271713220297170) / 9 * real(ONE_OVER_PI_TO_3_OVER_4); // (2048 * exponent^7 / PI^3) ^ (1/4) / 9
+        case ((1 << (3 * 2)) + 0): //f
+            //Not supported for f orbitals.
+        default:
+            return NAN;
+        }
+    }
+
+    // Angular polynomial of the AO in bohr, dx, dy, dz are the displacements from the AO center in angstrom.
+    // Its gradient with respect to the angstrom displacement is written into gradient.
+    template <typename real>
+    inline real angularPart(const int quantum_number, const real dx, const real dy, const real dz, real gradient[3])
+    {
+        gradient[0] = 0, gradient[1] = 0, gradient[2] = 0;
+        switch (quantum_number)
+        {
+        case ((1 << (0 * 2)) + 0): //s
+            return 1;
+        case ((1 << (1 * 2)) + 0): //p-x
+            gradient[0] = real(ANGSTROM2BOHR);
+            return dx * real(ANGSTROM2BOHR);
+        case ((1 << (1 * 2)) + 1): //p-y
+            gradient[1] = real(ANGSTROM2BOHR);
+            return dy * real(ANGSTROM2BOHR);
+        case ((1 << (1 * 2)) + 2): //p-z
+            gradient[2] = real(ANGSTROM2BOHR);
+            return dz * real(ANGSTROM2BOHR);
+        case ((1 << (2 * 2)) + 0): //d-xy
+            gradient[0] = dy * real(ANGSTROM2BOHR_SQUARE), gradient[1] = dx * real(ANGSTROM2BOHR_SQUARE);
+            return dx * dy * real(ANGSTROM2BOHR_SQUARE);
+        case ((1 << (2 * 2)) + 1): //d-xz
+            gradient[0] = dz * real(ANGSTROM2BOHR_SQUARE), gradient[2] = dx * real(ANGSTROM2BOHR_SQUARE);
+            return dx * dz * real(ANGSTROM2BOHR_SQUARE);
+        case ((1 << (2 * 2)) + 2): //d-yz
+            gradient[1] = dz * real(ANGSTROM2BOHR_SQUARE), gradient[2] = dy * real(ANGSTROM2BOHR_SQUARE);
+            return dy * dz * real(ANGSTROM2BOHR_SQUARE);
+        case ((1 << (2 * 2)) + 3): //d-xx
+            gradient[0] = 2 * dx * real(ANGSTROM2BOHR_SQUARE);
+            return SQUARE(dx) * real(ANGSTROM2BOHR_SQUARE);
+        case ((1 << (2 * 2)) + 4): //d-yy
+            gradient[1] = 2 * dy * real(ANGSTROM2BOHR_SQUARE);
+            return SQUARE(dy) * real(ANGSTROM2BOHR_SQUARE);
+        case ((1 << (2 * 2)) + 5): //d-zz
+            gradient[2] = 2 * dz * real(ANGSTROM2BOHR_SQUARE);
+            return SQUARE(dz) * real(ANGSTROM2BOHR_SQUARE);
+        case ((1 << (3 * 2)) + 0): //f
+            //Not supported for f orbitals.
+        default:
+            return NAN;
+        }
+    }
+
+    // Bound of |AO| at distance r_bohr from its center: sum over primitives of |c N| r^l exp(-a r^2), since every angular part is at most r^l
+    double aoRadialBound(const MoleculeStruct::AtomicOrbital& ao, const MoleculeStruct::GaussianPrimitive* const ao_prims, const int l, const double r_bohr)
+    {
+        double bound = 0;
+        for (int i_prim = 0; i_prim < ao.number_of_primitives; i_prim++)
+            bound += std::fabs(ao_prims[i_prim].contraction * primitiveNormalization<double>(ao.quantum_number, ao_prims[i_prim].exponent))
+                * std::pow(r_bohr, l) * std::exp(-ao_prims[i_prim].exponent * SQUARE(r_bohr));
+        return bound;
+    }
+
+    void getAOExtents(const MoleculeStruct::MolecularDataOneFrame* const frame, const float threshold, float* const extents)
+    {
+        for (int i_ao = 0, i_first_prim = 0; i_ao < frame->n_AO; i_first_prim += frame->aos[i_ao].number_of_primitives, i_ao++)
+        {
+            const MoleculeStruct::AtomicOrbital& ao = frame->aos[i_ao];
+            const MoleculeStruct::GaussianPrimitive* const ao_prims = frame->primitives + i_first_prim;
+
+            int l = 0;
+            while (ao.quantum_number >= (1 << ((l + 1) * 2)))
+                l++;
+            double exponent_min = INFINITY;
+            for (int i_prim = 0; i_prim < ao.number_of_primitives; i_prim++)
+                exponent_min = fmin(exponent_min, ao_prims[i_prim].exponent);
+
+            // Beyond the peak of the most diffuse primitive every term decreases, so the bound can be bisected there
+            double r_low = sqrt(l / (2 * exponent_min)), r_high = fmax(r_low, 1.0);
+            if (std::isnan(aoRadialBound(ao, ao_prims, l, r_high)))
+            {
+                extents[i_ao] = INFINITY; // Unsupported angular momentum, never screened
+                continue;
+            }
+            while (aoRadialBound(ao, ao_prims, l, r_high) >= threshold)
+                r_low = r_high, r_high *= 2;
+            for (int i_bisection = 0; i_bisection < 32; i_bisection++)
+            {
+                double r_middle = 0.5 * (r_low + r_high);
+                if (aoRadialBound(ao, ao_prims, l, r_middle) >= threshold)
+                    r_low = r_middle;
+                else
+                    r_high = r_middle;
+            }
+
+            extents[i_ao] = r_high / ANGSTROM2BOHR;
+        }
+    }
+
+    // Fills exponentials[i_total_prim] with exp(-exponent * r^2) of every primitive at the point, through the selected exp backend
+    inline void evaluatePrimitiveExponentials(const float xyz[3],
+                                              const int n_ao,
+                                              const MoleculeStruct::AtomicOrbital* const aos,
+                                              const MoleculeStruct::GaussianPrimitive* const prims,
+                                              std::vector<float>& exponentials)
+    {
+        exponentials.clear();
+        for (int i_ao = 0, i_total_prim = 0; i_ao < n_ao; i_ao++)
+        {
+            float dx = xyz[0] - aos[i_ao].xyz[0], dy = xyz[1] - aos[i_ao].xyz[1], dz = xyz[2] - aos[i_ao].xyz[2];
+            float r_square_bohr = float(ANGSTROM2BOHR_SQUARE) * (SQUARE(dx) + SQUARE(dy) + SQUARE(dz));
+            for (int i_prim = 0; i_prim < aos[i_ao].number_of_primitives; i_prim++, i_total_prim++)
+                exponentials.push_back(-prims[i_total_prim].exponent * r_square_bohr);
+        }
+        FastExp::expInPlace(exponentials.data(), exponentials.size());
+    }
+
     float evaluateOrbital(const float xyz[3],
                           const int n_ao,
                           const MoleculeStruct::AtomicOrbital* const aos,
@@ -60,71 +199,585 @@ namespace MoleculeKernel
         const int i_occ = 0;
         float x = xyz[0], y = xyz[1], z = xyz[2];
 
+        static thread_local std::vector<float> exponentials;
+        evaluatePrimitiveExponentials(xyz, n_ao, aos, prims, exponentials);
+
         float psi = 0;
         for (int i_ao = 0, i_total_prim = 0; i_ao < n_ao; i_ao++)
+        {
+            float dx = x - aos[i_ao].xyz[0], dy = y - aos[i_ao].xyz[1], dz = z - aos[i_ao].xyz[2];
+            float angular_gradient[3];
+            float angular = angularPart(aos[i_ao].quantum_number, dx, dy, dz, angular_gradient);
+
+            float radial = 0;
             for (int i_prim = 0; i_prim < aos[i_ao].number_of_primitives; i_prim++, i_total_prim++)
             {
-                float A_x = aos[i_ao].xyz[0], A_y = aos[i_ao].xyz[1], A_z = aos[i_ao].xyz[2],
-                    exponent = prims[i_total_prim].exponent, contraction = prims[i_total_prim].contraction;
+                float exponent = prims[i_total_prim].exponent, contraction = prims[i_total_prim].contraction;
+                radial += contraction * primitiveNormalization(aos[i_ao].quantum_number, exponent) * exponentials[i_total_prim];
+            }
+
+            psi += C[i_ao + i_occ * n_ao] * angular * radial;
+        }
 
-                switch (aos[i_ao].quantum_number)
+        return psi;
+    }
+
+    float evaluateOrbitalWithGradient(const float xyz[3], const MoleculeStruct::MolecularDataOneFrame* const frame, float gradient[3])
+    {
+        return evaluateOrbitalWithGradient(xyz, frame->n_AO, frame->aos, frame->primitives, frame->mo_coefficients, gradient);
+    }
+
+    float evaluateOrbitalWithGradient(const float xyz[3],
+                                      const int n_ao,
+                                      const MoleculeStruct::AtomicOrbital* const aos,
+                                      const MoleculeStruct::GaussianPrimitive* const prims,
+                                      const float* const C,
+                                      float gradient[3])
+    {
+        const int i_occ = 0;
+        float x = xyz[0], y = xyz[1], z = xyz[2];
+
+        static thread_local std::vector<float> exponentials;
+        evaluatePrimitiveExponentials(xyz, n_ao, aos, prims, exponentials);
+
+        float psi = 0;
+        gradient[0] = 0, gradient[1] = 0, gradient[2] = 0;
+        for (int i_ao = 0, i_total_prim = 0; i_ao < n_ao; i_ao++)
+        {
+            float dx = x - aos[i_ao].xyz[0], dy = y - aos[i_ao].xyz[1], dz = z - aos[i_ao].xyz[2];
+            float angular_gradient[3];
+            float angular = angularPart(aos[i_ao].quantum_number, dx, dy, dz, angular_gradient);
+
+            // radial = sum c N exp(-a r^2), radial_derivative = sum c N (-2 a) exp(-a r^2), the exponential is shared
+            float radial = 0, radial_derivative = 0;
+            for (int i_prim = 0; i_prim < aos[i_ao].number_of_primitives; i_prim++, i_total_prim++)
+            {
+                float exponent = prims[i_total_prim].exponent, contraction = prims[i_total_prim].contraction;
+                float primitive = contraction * primitiveNormalization(aos[i_ao].quantum_number, exponent) * exponentials[i_total_prim];
+                radial += primitive;
+                radial_derivative += -2 * exponent * float(ANGSTROM2BOHR_SQUARE) * primitive;
+            }
+
+            float c = C[i_ao + i_occ * n_ao];
+            psi += c * angular * radial;
+            gradient[0] += c * (angular_gradient[0] * radial + angular * radial_derivative * dx);
+            gradient[1] += c * (angular_gradient[1] * radial + angular * radial_derivative * dy);
+            gradient[2] += c * (angular_gradient[2] * radial + angular * radial_derivative * dz);
+        }
+
+        return psi;
+    }
+
+    const int ao_point_chunk_size = 64; // Points sharing one exp call in evaluateAOs
+
+    // Single precision exponentials go through the selected exp backend, double precision ones through libm
+    inline void exponentialInPlace(float* const values, const int n)
+    {
+        FastExp::expInPlace(values, n);
+    }
+
+    inline void exponentialInPlace(double* const values, const int n)
+    {
+        for (int i = 0; i < n; i++)
+            values[i] = std::exp(values[i]);
+    }
+
+    // A run of consecutive AOs sharing quantum_number and primitive count, both known at compile time, so the angular
+    // switch folds away and the primitive loops unroll. ao_values and ao_gradients point at the first AO of the run,
+    // rows are n_ao apart like in evaluateAOs.
+    template <typename Precision, int quantum_number, int n_prim>
+    void evaluateAORun(const int n_point,
+                       const float* const xyz,
+                       const int n_run,
+                       const MoleculeStruct::AtomicOrbital* const aos,
+                       const MoleculeStruct::GaussianPrimitive* const prims,
+                       const int n_ao,
+                       typename Precision::accumulate_type* const ao_values,
+                       typename Precision::accumulate_type* const ao_gradients)
+    {
+        typedef typename Precision::accumulate_type real;
+        typedef typename Precision::exponential_type real_exponential;
+
+        real r_square_bohr[ao_point_chunk_size], radial[ao_point_chunk_size], radial_derivative[ao_point_chunk_size];
+        real_exponential exponentials[n_prim * ao_point_chunk_size];
+
+        for (int i_run = 0; i_run < n_run; i_run++)
+        {
+            const MoleculeStruct::AtomicOrbital& ao = aos[i_run];
+            const MoleculeStruct::GaussianPrimitive* const ao_prims = prims + i_run * n_prim;
+            real exponent[n_prim], prefactor[n_prim];
+            for (int i_prim = 0; i_prim < n_prim; i_prim++)
+            {
+                exponent[i_prim] = ao_prims[i_prim].exponent;
+                prefactor[i_prim] = ao_prims[i_prim].contraction * primitiveNormalization(quantum_number, exponent[i_prim]);
+            }
+
+            for (int i_chunk_begin = 0; i_chunk_begin < n_point; i_chunk_begin += ao_point_chunk_size)
+            {
+                const int n_chunk = std::min(ao_point_chunk_size, n_point - i_chunk_begin);
+                const float* const xyz_chunk = xyz + i_chunk_begin * 3;
+
+                for (int i = 0; i < n_chunk; i++)
                 {
-                case ((1 << (0 * 2)) + 0): //s
-                    psi += C[i_ao + i_occ * n_ao] * contraction * powf(2 * exponent, 0.75f) * ONE_OVER_PI_TO_3_OVER_4 // (2 * exponent / PI) ^ (3/4)
-                        * expf(-exponent * ANGSTROM2BOHR_SQUARE * (SQUARE(x - A_x) + SQUARE(y - A_y) + SQUARE(z - A_z)));
-                    break;
-                case ((1 << (1 * 2)) + 0): //p-x
-                    psi += C[i_ao + i_occ * n_ao] * contraction * powf(exponent, 1.25f) * 3.363585661f * ONE_OVER_PI_TO_3_OVER_4 // ( 128 * exponent^5 / PI^3) ^ (1/4)
-                        * (x - A_x) * ANGSTROM2BOHR
-                        * expf(-exponent * ANGSTROM2BOHR_SQUARE * (SQUARE(x - A_x) + SQUARE(y - A_y) + SQUARE(z - A_z)));
-                    break;
-                case ((1 << (1 * 2)) + 1): //p-y
-                    psi += C[i_ao + i_occ * n_ao] * contraction * powf(exponent, 1.25f) * 3.363585661f * ONE_OVER_PI_TO_3_OVER_4 // ( 128 * exponent^5 / PI^3) ^ (1/4)
-                        * (y - A_y) * ANGSTROM2BOHR
-                        * expf(-exponent * ANGSTROM2BOHR_SQUARE * (SQUARE(x - A_x) + SQUARE(y - A_y) + SQUARE(z - A_z)));
-                    break;
-                case ((1 << (1 * 2)) + 2): //p-z
-                    psi += C[i_ao + i_occ * n_ao] * contraction * powf(exponent, 1.25f) * 3.363585661f * ONE_OVER_PI_TO_3_OVER_4 // ( 128 * exponent^5 / PI^3) ^ (1/4)
-                        * (z - A_z) * ANGSTROM2BOHR
-                        * expf(-exponent * ANGSTROM2BOHR_SQUARE * (SQUARE(x - A_x) + SQUARE(y - A_y) + SQUARE(z - A_z)));
-                    break;
-                case ((1 << (2 * 2)) + 0): //d-xy
-                    psi += C[i_ao + i_occ * n_ao] * contraction * powf(exponent, 1.75f) * 6.727171322f * ONE_OVER_PI_TO_3_OVER_4 // (2048 * exponent^7 / PI^3) ^ (1/4)
-                        * (x - A_x) * (y - A_y) * ANGSTROM2BOHR_SQUARE
-                        * expf(-exponent * ANGSTROM2BOHR_SQUARE * (SQUARE(x - A_x) + SQUARE(y - A_y) + SQUARE(z - A_z)));
-                    break;
-                case ((1 << (2 * 2)) + 1): //d-xz
-                    psi += C[i_ao + i_occ * n_ao] * contraction * powf(exponent, 1.75f) * 6.727171322f * ONE_OVER_PI_TO_3_OVER_4 // (2048 * exponent^7 / PI^3) ^ (1/4)
-                        * (x - A_x) * (z - A_z) * ANGSTROM2BOHR_SQUARE
-                        * expf(-exponent * ANGSTROM2BOHR_SQUARE * (SQUARE(x - A_x) + SQUARE(y - A_y) + SQUARE(z - A_z)));
-                    break;
-                case ((1 << (2 * 2)) + 2): //d-yz
-                    psi += C[i_ao + i_occ * n_ao] * contraction * powf(exponent, 1.75f) * 6.727171322f * ONE_OVER_PI_TO_3_OVER_4 // (2048 * exponent^7 / PI^3) ^ (1/4)
-                        * (y - A_y) * (z - A_z) * ANGSTROM2BOHR_SQUARE
-                        * expf(-exponent * ANGSTROM2BOHR_SQUARE * (SQUARE(x - A_x) + SQUARE(y - A_y) + SQUARE(z - A_z)));
-                    break;
-                case ((1 << (2 * 2)) + 3): //d-xx
-                    psi += C[i_ao + i_occ * n_ao] * contraction * powf(exponent, 1.75f) * 6.727171322f / 9 * ONE_OVER_PI_TO_3_OVER_4 // (2048 * exponent^7 / PI^3) ^ (1/4) / 9
-                        * SQUARE(x - A_x) * ANGSTROM2BOHR_SQUARE
-                        * expf(-exponent * ANGSTROM2BOHR_SQUARE * (SQUARE(x - A_x) + SQUARE(y - A_y) + SQUARE(z - A_z)));
-                    break;
-                case ((1 << (2 * 2)) + 4): //d-yy
-                    psi += C[i_ao + i_occ * n_ao] * contraction * powf(exponent, 1.75f) * 6.727171322f / 9 * ONE_OVER_PI_TO_3_OVER_4 // (2048 * exponent^7 / PI^3) ^ (1/4) / 9
-                        * SQUARE(y - A_y) * ANGSTROM2BOHR_SQUARE
-                        * expf(-exponent * ANGSTROM2BOHR_SQUARE * (SQUARE(x - A_x) + SQUARE(y - A_y) + SQUARE(z - A_z)));
-                    break;
-                case ((1 << (2 * 2)) + 5): //d-zz
-                    psi += C[i_ao + i_occ * n_ao] * contraction * powf(exponent, 1.75f) * 6.727171322f / 9 * ONE_OVER_PI_TO_3_OVER_4 // (2048 * exponent^7 / PI^3) ^ (1/4) / 9
-                        * SQUARE(z - A_z) * ANGSTROM2BOHR_SQUARE
-                        * expf(-exponent * ANGSTROM2BOHR_SQUARE * (SQUARE(x - A_x) + SQUARE(y - A_y) + SQUARE(z - A_z)));
-                    break;
-                case ((1 << (3 * 2)) + 0): //f
-                    //Not supported for f orbitals.
-                default:
-                    psi = NAN;
+                    real dx = real(xyz_chunk[i * 3 + 0]) - ao.xyz[0], dy = real(xyz_chunk[i * 3 + 1]) - ao.xyz[1], dz = real(xyz_chunk[i * 3 + 2]) - ao.xyz[2];
+                    r_square_bohr[i] = real(ANGSTROM2BOHR_SQUARE) * (SQUARE(dx) + SQUARE(dy) + SQUARE(dz));
+                }
+
+                // All primitives of the chunk in one exp call
+                for (int i_prim = 0; i_prim < n_prim; i_prim++)
+                    for (int i = 0; i < n_chunk; i++)
+                        exponentials[i_prim * n_chunk + i] = real_exponential(-exponent[i_prim] * r_square_bohr[i]);
+                exponentialInPlace(exponentials, n_prim * n_chunk);
+
+                for (int i = 0; i < n_chunk; i++)
+                    radial[i] = 0, radial_derivative[i] = 0;
+                for (int i_prim = 0; i_prim < n_prim; i_prim++)
+                {
+                    const real derivative_factor = -2 * exponent[i_prim] * real(ANGSTROM2BOHR_SQUARE) * prefactor[i_prim];
+                    for (int i = 0; i < n_chunk; i++)
+                    {
+                        radial[i] += prefactor[i_prim] * exponentials[i_prim * n_chunk + i];
+                        radial_derivative[i] += derivative_factor * exponentials[i_prim * n_chunk + i];
+                    }
+                }
+
+                for (int i = 0; i < n_chunk; i++)
+                {
+                    const int i_point = i_chunk_begin + i;
+                    real dx = real(xyz_chunk[i * 3 + 0]) - ao.xyz[0], dy = real(xyz_chunk[i * 3 + 1]) - ao.xyz[1], dz = real(xyz_chunk[i * 3 + 2]) - ao.xyz[2];
+                    real angular_gradient[3];
+                    real angular = angularPart(quantum_number, dx, dy, dz, angular_gradient);
+
+                    ao_values[i_point * n_ao + i_run] = angular * radial[i];
+                    if (ao_gradients != nullptr)
+                    {
+                        ao_gradients[(0 * n_point + i_point) * n_ao + i_run] = angular_gradient[0] * radial[i] + angular * radial_derivative[i] * dx;
+                        ao_gradients[(1 * n_point + i_point) * n_ao + i_run] = angular_gradient[1] * radial[i] + angular * radial_derivative[i] * dy;
+                        ao_gradients[(2 * n_point + i_point) * n_ao + i_run] = angular_gradient[2] * radial[i] + angular * radial_derivative[i] * dz;
+                    }
                 }
             }
+        }
+    }
 
-        return psi;
+    // Fallback for runs without a specialization, quantum number and primitive count read from each AO
+    template <typename Precision>
+    void evaluateAORunGeneric(const int n_point,
+                              const float* const xyz,
+                              const int n_run,
+                              const MoleculeStruct::AtomicOrbital* const aos,
+                              const MoleculeStruct::GaussianPrimitive* const prims,
+                              const int n_ao,
+                              typename Precision::accumulate_type* const ao_values,
+                              typename Precision::accumulate_type* const ao_gradients)
+    {
+        typedef typename Precision::accumulate_type real;
+        typedef typename Precision::exponential_type real_exponential;
+
+        real r_square_bohr[ao_point_chunk_size], radial[ao_point_chunk_size], radial_derivative[ao_point_chunk_size];
+        real_exponential exponentials[ao_point_chunk_size];
+
+        for (int i_run = 0, i_first_prim = 0; i_run < n_run; i_first_prim += aos[i_run].number_of_primitives, i_run++)
+            for (int i_chunk_begin = 0; i_chunk_begin < n_point; i_chunk_begin += ao_point_chunk_size)
+            {
+                const int n_chunk = std::min(ao_point_chunk_size, n_point - i_chunk_begin);
+                const float* const xyz_chunk = xyz + i_chunk_begin * 3;
+
+                for (int i = 0; i < n_chunk; i++)
+                {
+                    real dx = real(xyz_chunk[i * 3 + 0]) - aos[i_run].xyz[0], dy = real(xyz_chunk[i * 3 + 1]) - aos[i_run].xyz[1], dz = real(xyz_chunk[i * 3 + 2]) - aos[i_run].xyz[2];
+                    r_square_bohr[i] = real(ANGSTROM2BOHR_SQUARE) * (SQUARE(dx) + SQUARE(dy) + SQUARE(dz));
+                    radial[i] = 0, radial_derivative[i] = 0;
+                }
+
+                // One primitive over the whole chunk at a time, so the exp backend sees contiguous arguments
+                for (int i_prim = i_first_prim; i_prim < i_first_prim + aos[i_run].number_of_primitives; i_prim++)
+                {
+                    real exponent = prims[i_prim].exponent;
+                    real prefactor = prims[i_prim].contraction * primitiveNormalization(aos[i_run].quantum_number, exponent);
+                    for (int i = 0; i < n_chunk; i++)
+                        exponentials[i] = real_exponential(-exponent * r_square_bohr[i]);
+                    exponentialInPlace(exponentials, n_chunk);
+                    for (int i = 0; i < n_chunk; i++)
+                    {
+                        radial[i] += prefactor * exponentials[i];
+                        radial_derivative[i] += -2 * exponent * real(ANGSTROM2BOHR_SQUARE) * prefactor * exponentials[i];
+                    }
+                }
+
+                for (int i = 0; i < n_chunk; i++)
+                {
+                    const int i_point = i_chunk_begin + i;
+                    real dx = real(xyz_chunk[i * 3 + 0]) - aos[i_run].xyz[0], dy = real(xyz_chunk[i * 3 + 1]) - aos[i_run].xyz[1], dz = real(xyz_chunk[i * 3 + 2]) - aos[i_run].xyz[2];
+                    real angular_gradient[3];
+                    real angular = angularPart(aos[i_run].quantum_number, dx, dy, dz, angular_gradient);
+
+                    ao_values[i_point * n_ao + i_run] = angular * radial[i];
+                    if (ao_gradients != nullptr)
+                    {
+                        ao_gradients[(0 * n_point + i_point) * n_ao + i_run] = angular_gradient[0] * radial[i] + angular * radial_derivative[i] * dx;
+                        ao_gradients[(1 * n_point + i_point) * n_ao + i_run] = angular_gradient[1] * radial[i] + angular * radial_derivative[i] * dy;
+                        ao_gradients[(2 * n_point + i_point) * n_ao + i_run] = angular_gradient[2] * radial[i] + angular * radial_derivative[i] * dz;
+                    }
+                }
+            }
+    }
+
+    // Picks the instantiation for the primitive count of a run with known quantum number
+    template <typename Precision, int quantum_number>
+    void dispatchAORunPrimitives(const int n_prim, const int n_point, const float* const xyz, const int n_run,
+                                 const MoleculeStruct::AtomicOrbital* const aos, const MoleculeStruct::GaussianPrimitive* const prims, const int n_ao,
+                                 typename Precision::accumulate_type* const ao_values, typename Precision::accumulate_type* const ao_gradients)
+    {
+        switch (n_prim)
+        {
+        case 1: evaluateAORun<Precision, quantum_number, 1>(n_point, xyz, n_run, aos, prims, n_ao, ao_values, ao_gradients); break;
+        case 2: evaluateAORun<Precision, quantum_number, 2>(n_point, xyz, n_run, aos, prims, n_ao, ao_values, ao_gradients); break;
+        case 3: evaluateAORun<Precision, quantum_number, 3>(n_point, xyz, n_run, aos, prims, n_ao, ao_values, ao_gradients); break;
+        case 4: evaluateAORun<Precision, quantum_number, 4>(n_point, xyz, n_run, aos, prims, n_ao, ao_values, ao_gradients); break;
+        case 5: evaluateAORun<Precision, quantum_number, 5>(n_point, xyz, n_run, aos, prims, n_ao, ao_values, ao_gradients); break;
+        case 6: evaluateAORun<Precision, quantum_number, 6>(n_point, xyz, n_run, aos, prims, n_ao, ao_values, ao_gradients); break;
+        default: evaluateAORunGeneric<Precision>(n_point, xyz, n_run, aos, prims, n_ao, ao_values, ao_gradients); break;
+        }
     }
+
+    // Picks the instantiation for the quantum number of a run, once per run and not per point or primitive
+    template <typename Precision>
+    void dispatchAORun(const int quantum_number, const int n_prim, const int n_point, const float* const xyz, const int n_run,
+                       const MoleculeStruct::AtomicOrbital* const aos, const MoleculeStruct::GaussianPrimitive* const prims, const int n_ao,
+                       typename Precision::accumulate_type* const ao_values, typename Precision::accumulate_type* const ao_gradients)
+    {
+#define DISPATCH_QUANTUM_NUMBER(l, m) \
+        case ((1 << (l * 2)) + m): \
+            dispatchAORunPrimitives<Precision, ((1 << (l * 2)) + m)>(n_prim, n_point, xyz, n_run, aos, prims, n_ao, ao_values, ao_gradients); \
+            break;
+
+        switch (quantum_number)
+        {
+        DISPATCH_QUANTUM_NUMBER(0, 0) //s
+        DISPATCH_QUANTUM_NUMBER(1, 0) //p-x
+        DISPATCH_QUANTUM_NUMBER(1, 1) //p-y
+        DISPATCH_QUANTUM_NUMBER(1, 2) //p-z
+        DISPATCH_QUANTUM_NUMBER(2, 0) //d-xy
+        DISPATCH_QUANTUM_NUMBER(2, 1) //d-xz
+        DISPATCH_QUANTUM_NUMBER(2, 2) //d-yz
+        DISPATCH_QUANTUM_NUMBER(2, 3) //d-xx
+        DISPATCH_QUANTUM_NUMBER(2, 4) //d-yy
+        DISPATCH_QUANTUM_NUMBER(2, 5) //d-zz
+        default:
+            evaluateAORunGeneric<Precision>(n_point, xyz, n_run, aos, prims, n_ao, ao_values, ao_gradients);
+            break;
+        }
+#undef DISPATCH_QUANTUM_NUMBER
+    }
+
+    template <typename Precision>
+    void evaluateAOs(const int n_point,
+                     const float* const xyz,
+                     const int n_ao,
+                     const MoleculeStruct::AtomicOrbital* const aos,
+                     const MoleculeStruct::GaussianPrimitive* const prims,
+                     typename Precision::accumulate_type* const ao_values,
+                     typename Precision::accumulate_type* const ao_gradients)
+    {
+        // Consecutive AOs with the same quantum number and primitive count go to the specialized code together,
+        // sortBasis makes these runs as long as possible
+        for (int i_run_begin = 0, i_first_prim = 0; i_run_begin < n_ao; )
+        {
+            const int quantum_number = aos[i_run_begin].quantum_number, n_prim = aos[i_run_begin].number_of_primitives;
+            int i_run_end = i_run_begin + 1;
+            while (i_run_end < n_ao && aos[i_run_end].quantum_number == quantum_number && aos[i_run_end].number_of_primitives == n_prim)
+                i_run_end++;
+
+            dispatchAORun<Precision>(quantum_number, n_prim, n_point, xyz, i_run_end - i_run_begin, aos + i_run_begin, prims + i_first_prim, n_ao,
+                                     ao_values + i_run_begin, ao_gradients != nullptr ? ao_gradients + i_run_begin : nullptr);
+
+            i_first_prim += (i_run_end - i_run_begin) * n_prim;
+            i_run_begin = i_run_end;
+        }
+    }
+
+    void sortBasis(const MoleculeStruct::MolecularDataOneFrame* const frame, SortedBasis& sorted)
+    {
+        const int n_ao = frame->n_AO, n_mo = frame->n_occupied_MO;
+
+        std::vector<int> first_prims(n_ao);
+        for (int i_ao = 0, i_first_prim = 0; i_ao < n_ao; i_first_prim += frame->aos[i_ao].number_of_primitives, i_ao++)
+            first_prims[i_ao] = i_first_prim;
+
+        // Stable, so AOs within a run keep the order of the frame
+        sorted.sorted_to_original.resize(n_ao);
+        for (int i_ao = 0; i_ao < n_ao; i_ao++)
+            sorted.sorted_to_original[i_ao] = i_ao;
+        std::stable_sort(sorted.sorted_to_original.begin(), sorted.sorted_to_original.end(), [frame](const int a, const int b) {
+            if (frame->aos[a].quantum_number != frame->aos[b].quantum_number)
+                return frame->aos[a].quantum_number < frame->aos[b].quantum_number;
+            return frame->aos[a].number_of_primitives < frame->aos[b].number_of_primitives;
+        });
+
+        sorted.aos.resize(n_ao);
+        sorted.first_primitives.resize(n_ao);
+        sorted.primitives.clear();
+        sorted.mo_coefficients.resize(n_ao);
+        sorted.occupied_mo_coefficients.resize(n_ao * n_mo);
+        for (int i_sorted = 0; i_sorted < n_ao; i_sorted++)
+        {
+            const int i_ao = sorted.sorted_to_original[i_sorted];
+            sorted.aos[i_sorted] = frame->aos[i_ao];
+            sorted.first_primitives[i_sorted] = sorted.primitives.size();
+            sorted.primitives.insert(sorted.primitives.end(), frame->primitives + first_prims[i_ao],
+                                     frame->primitives + first_prims[i_ao] + frame->aos[i_ao].number_of_primitives);
+            sorted.mo_coefficients[i_sorted] = frame->mo_coefficients[i_ao];
+            for (int i_mo = 0; i_mo < n_mo; i_mo++)
+                sorted.occupied_mo_coefficients[i_sorted + i_mo * n_ao] = frame->occupied_mo_coefficients[i_ao + i_mo * n_ao];
+        }
+    }
+
+    template <typename real>
+    void matrixMultiplyTransposed(const int m, const int n, const int k,
+                                  const real* const A, const int lda,
+                                  const real* const B, const int ldb,
+                                  real* const out, const int ldo)
+    {
+        // 4 x 4 register tiles, the inner loop runs along the contiguous k of both operands
+        const int tile = 4;
+        int i = 0;
+        for (; i + tile <= m; i += tile)
+        {
+            int j = 0;
+            for (; j + tile <= n; j += tile)
+            {
+                real sum[tile][tile] = {};
+                for (int l = 0; l < k; l++)
+                    for (int ii = 0; ii < tile; ii++)
+                        for (int jj = 0; jj < tile; jj++)
+                            sum[ii][jj] += A[(i + ii) * lda + l] * B[(j + jj) * ldb + l];
+                for (int ii = 0; ii < tile; ii++)
+                    for (int jj = 0; jj < tile; jj++)
+                        out[(i + ii) * ldo + j + jj] = sum[ii][jj];
+            }
+            for (; j < n; j++)
+                for (int ii = 0; ii < tile; ii++)
+                {
+                    real sum = 0;
+                    for (int l = 0; l < k; l++)
+                        sum += A[(i + ii) * lda + l] * B[j * ldb + l];
+                    out[(i + ii) * ldo + j] = sum;
+                }
+        }
+        for (; i < m; i++)
+            for (int j = 0; j < n; j++)
+            {
+                real sum = 0;
+                for (int l = 0; l < k; l++)
+                    sum += A[i * lda + l] * B[j * ldb + l];
+                out[i * ldo + j] = sum;
+            }
+    }
+
+    const int density_batch_size = 128;
+    const float density_screening_threshold = 1e-7f; // AOs below this on every point of a batch are dropped before the contraction
+
+    template <typename Precision>
+    void evaluateOrbitalBatch(const int n_point,
+                              const float* const xyz,
+                              const MoleculeStruct::MolecularDataOneFrame* const frame,
+                              float* const values,
+                              float* const gradients)
+    {
+        evaluateOrbitalBatch<Precision>(n_point, xyz, frame->n_AO, frame->aos, frame->primitives, frame->mo_coefficients, values, gradients);
+    }
+
+    template <typename Precision>
+    void evaluateOrbitalBatch(const int n_point,
+                              const float* const xyz,
+                              const int n_ao,
+                              const MoleculeStruct::AtomicOrbital* const aos,
+                              const MoleculeStruct::GaussianPrimitive* const prims,
+                              const float* const C,
+                              float* const values,
+                              float* const gradients)
+    {
+        typedef typename Precision::accumulate_type real;
+
+        const int n_block = gradients != nullptr ? 4 : 1; // value, then d/dx, d/dy, d/dz
+        std::vector<real> ao_values(n_block * density_batch_size * n_ao);
+
+        for (int i_batch_begin = 0; i_batch_begin < n_point; i_batch_begin += density_batch_size)
+        {
+            const int n_batch = std::min(density_batch_size, n_point - i_batch_begin);
+            evaluateAOs<Precision>(n_batch, xyz + i_batch_begin * 3, n_ao, aos, prims,
+                                   ao_values.data(), gradients != nullptr ? ao_values.data() + n_batch * n_ao : nullptr);
+
+            for (int i_point = 0; i_point < n_batch; i_point++)
+            {
+                real psi = 0;
+                for (int i_ao = 0; i_ao < n_ao; i_ao++)
+                    psi += C[i_ao] * ao_values[i_point * n_ao + i_ao];
+                values[i_batch_begin + i_point] = psi;
+
+                if (gradients != nullptr)
+                    for (int i_xyz = 0; i_xyz < 3; i_xyz++)
+                    {
+                        real psi_derivative = 0;
+                        for (int i_ao = 0; i_ao < n_ao; i_ao++)
+                            psi_derivative += C[i_ao] * ao_values[((i_xyz + 1) * n_batch + i_point) * n_ao + i_ao];
+                        gradients[(i_batch_begin + i_point) * 3 + i_xyz] = psi_derivative;
+                    }
+            }
+        }
+    }
+
+    // Shared by evaluateDensity and evaluateDensityWithGradient, the gradient outputs are skipped when both are nullptr
+    template <typename Precision>
+    void evaluateDensityImplementation(const int n_point,
+                                       const float* const xyz,
+                                       const int n_ao,
+                                       const MoleculeStruct::AtomicOrbital* const aos,
+                                       const MoleculeStruct::GaussianPrimitive* const prims,
+                                       const int n_mo,
+                                       const float* const occupied_C,
+                                       const float* const occupation_numbers,
+                                       const float* const spin_occupation_numbers,
+                                       float* const density,
+                                       float* const spin_density,
+                                       float* const density_gradient,
+                                       float* const spin_density_gradient)
+    {
+        typedef typename Precision::accumulate_type real;
+
+        const bool need_gradient = density_gradient != nullptr || spin_density_gradient != nullptr;
+        const int n_block = need_gradient ? 4 : 1; // value, then d/dx, d/dy, d/dz
+
+        std::vector<real> ao_values(n_block * density_batch_size * n_ao);
+        std::vector<real> ao_values_screened(n_block * density_batch_size * n_ao);
+        std::vector<real> C_screened(n_mo * n_ao);
+        std::vector<real> psi(n_block * density_batch_size * n_mo);
+        std::vector<int> significant_aos(n_ao);
+
+        for (int i_batch_begin = 0; i_batch_begin < n_point; i_batch_begin += density_batch_size)
+        {
+            const int n_batch = std::min(density_batch_size, n_point - i_batch_begin);
+            evaluateAOs<Precision>(n_batch, xyz + i_batch_begin * 3, n_ao, aos, prims,
+                                   ao_values.data(), need_gradient ? ao_values.data() + n_batch * n_ao : nullptr);
+
+            // Screening: only AOs significant somewhere in the batch take part in the GEMM.
+            // The gradient rows are checked as well, a p AO vanishes on its nodal plane while its gradient does not.
+            int n_significant = 0;
+            for (int i_ao = 0; i_ao < n_ao; i_ao++)
+                for (int i_row = 0; i_row < n_block * n_batch; i_row++)
+                    if (std::fabs(ao_values[i_row * n_ao + i_ao]) > density_screening_threshold)
+                    {
+                        significant_aos[n_significant++] = i_ao;
+                        break;
+                    }
+
+            for (int i_row = 0; i_row < n_block * n_batch; i_row++)
+                for (int i = 0; i < n_significant; i++)
+                    ao_values_screened[i_row * n_significant + i] = ao_values[i_row * n_ao + significant_aos[i]];
+            for (int i_mo = 0; i_mo < n_mo; i_mo++)
+                for (int i = 0; i < n_significant; i++)
+                    C_screened[i_mo * n_significant + i] = occupied_C[significant_aos[i] + i_mo * n_ao];
+
+            // psi[i_point][i_mo] = sum_ao chi[i_point][i_ao] * C[i_ao][i_mo], the gradient blocks are stacked below the values
+            matrixMultiplyTransposed(n_block * n_batch, n_mo, n_significant,
+                                     ao_values_screened.data(), n_significant,
+                                     C_screened.data(), n_significant,
+                                     psi.data(), n_mo);
+
+            for (int i_point = 0; i_point < n_batch; i_point++)
+            {
+                real rho = 0, rho_spin = 0;
+                real rho_gradient[3]{ 0, 0, 0 }, rho_spin_gradient[3]{ 0, 0, 0 };
+                for (int i_mo = 0; i_mo < n_mo; i_mo++)
+                {
+                    real psi_value = psi[i_point * n_mo + i_mo];
+                    rho += occupation_numbers[i_mo] * SQUARE(psi_value);
+                    rho_spin += spin_occupation_numbers[i_mo] * SQUARE(psi_value);
+                    if (need_gradient)
+                        for (int i_xyz = 0; i_xyz < 3; i_xyz++)
+                        {
+                            real psi_square_derivative = 2 * psi_value * psi[((i_xyz + 1) * n_batch + i_point) * n_mo + i_mo];
+                            rho_gradient[i_xyz] += occupation_numbers[i_mo] * psi_square_derivative;
+                            rho_spin_gradient[i_xyz] += spin_occupation_numbers[i_mo] * psi_square_derivative;
+                        }
+                }
+                if (density != nullptr)
+                    density[i_batch_begin + i_point] = rho;
+                if (spin_density != nullptr)
+                    spin_density[i_batch_begin + i_point] = rho_spin;
+                for (int i_xyz = 0; i_xyz < 3; i_xyz++)
+                {
+                    if (density_gradient != nullptr)
+                        density_gradient[(i_batch_begin + i_point) * 3 + i_xyz] = rho_gradient[i_xyz];
+                    if (spin_density_gradient != nullptr)
+                        spin_density_gradient[(i_batch_begin + i_point) * 3 + i_xyz] = rho_spin_gradient[i_xyz];
+                }
+            }
+        }
+    }
+
+    template <typename Precision>
+    void evaluateDensity(const int n_point,
+                         const float* const xyz,
+                         const MoleculeStruct::MolecularDataOneFrame* const frame,
+                         float* const density,
+                         float* const spin_density)
+    {
+        evaluateDensityImplementation<Precision>(n_point, xyz, frame->n_AO, frame->aos, frame->primitives,
+                                                 frame->n_occupied_MO, frame->occupied_mo_coefficients, frame->occupation_numbers, frame->spin_occupation_numbers,
+                                                 density, spin_density, nullptr, nullptr);
+    }
+
+    template <typename Precision>
+    void evaluateDensity(const int n_point,
+                         const float* const xyz,
+                         const int n_ao,
+                         const MoleculeStruct::AtomicOrbital* const aos,
+                         const MoleculeStruct::GaussianPrimitive* const prims,
+                         const int n_mo,
+                         const float* const occupied_C,
+                         const float* const occupation_numbers,
+                         const float* const spin_occupation_numbers,
+                         float* const density,
+                         float* const spin_density)
+    {
+        evaluateDensityImplementation<Precision>(n_point, xyz, n_ao, aos, prims, n_mo, occupied_C, occupation_numbers, spin_occupation_numbers,
+                                                 density, spin_density, nullptr, nullptr);
+    }
+
+    template <typename Precision>
+    void evaluateDensityWithGradient(const int n_point,
+                                     const float* const xyz,
+                                     const MoleculeStruct::MolecularDataOneFrame* const frame,
+                                     float* const density,
+                                     float* const spin_density,
+                                     float* const density_gradient,
+                                     float* const spin_density_gradient)
+    {
+        evaluateDensityImplementation<Precision>(n_point, xyz, frame->n_AO, frame->aos, frame->primitives,
+                                                 frame->n_occupied_MO, frame->occupied_mo_coefficients, frame->occupation_numbers, frame->spin_occupation_numbers,
+                                                 density, spin_density, density_gradient, spin_density_gradient);
+    }
+
+    // The precision policies available to the rest of the program
+#define INSTANTIATE_PRECISION(Precision) \
+    template void evaluateAOs<Precision>(const int, const float* const, const int, const MoleculeStruct::AtomicOrbital* const, const MoleculeStruct::GaussianPrimitive* const, \
+                                         Precision::accumulate_type* const, Precision::accumulate_type* const); \
+    template void evaluateOrbitalBatch<Precision>(const int, const float* const, const MoleculeStruct::MolecularDataOneFrame* const, float* const, float* const); \
+    template void evaluateOrbitalBatch<Precision>(const int, const float* const, const int, const MoleculeStruct::AtomicOrbital* const, const MoleculeStruct::GaussianPrimitive* const, \
+                                                  const float* const, float* const, float* const); \
+    template void evaluateDensity<Precision>(const int, const float* const, const MoleculeStruct::MolecularDataOneFrame* const, float* const, float* const); \
+    template void evaluateDensity<Precision>(const int, const float* const, const int, const MoleculeStruct::AtomicOrbital* const, const MoleculeStruct::GaussianPrimitive* const, \
+                                             const int, const float* const, const float* const, const float* const, float* const, float* const); \
+    template void evaluateDensityWithGradient<Precision>(const int, const float* const, const MoleculeStruct::MolecularDataOneFrame* const, \
+                                                         float* const, float* const, float* const, float* const);
+
+    INSTANTIATE_PRECISION(FloatPrecision)
+    INSTANTIATE_PRECISION(DoublePrecision)
+    INSTANTIATE_PRECISION(MixedPrecision)
+#undef INSTANTIATE_PRECISION
+
+    template void matrixMultiplyTransposed<float>(const int, const int, const int, const float* const, const int, const float* const, const int, float* const, const int);
+    template void matrixMultiplyTransposed<double>(const int, const int, const int, const double* const, const int, const double* const, const int, double* const, const int);
 }
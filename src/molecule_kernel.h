@@ -9,10 +9,120 @@ namespace MoleculeKernel
     std::vector<MoleculeStruct::ChemicalBond> getBonds(const MoleculeStruct::MolecularDataOneFrame* const frame);
     std::vector<MoleculeStruct::ChemicalBond> getBonds(const int n_atom, const MoleculeStruct::ChemistryAtom* const atoms);
 
+    // Precision policies of the batched kernels: the type AO values and sums are accumulated in,
+    // and the type the primitive exponentials are computed in. Float exponentials use the FastExp backend.
+    struct FloatPrecision
+    {
+        typedef float accumulate_type;
+        typedef float exponential_type;
+    };
+    struct DoublePrecision
+    {
+        typedef double accumulate_type;
+        typedef double exponential_type;
+    };
+    struct MixedPrecision
+    {
+        typedef double accumulate_type;
+        typedef float exponential_type;
+    };
+
     float evaluateOrbital(const float xyz[3], const MoleculeStruct::MolecularDataOneFrame* const frame);
     float evaluateOrbital(const float xyz[3],
                           const int n_ao,
                           const MoleculeStruct::AtomicOrbital* const aos,
                           const MoleculeStruct::GaussianPrimitive* const prims,
                           const float* const C);
+
+    // psi and its gradient together, the exponentials are shared between them
+    float evaluateOrbitalWithGradient(const float xyz[3], const MoleculeStruct::MolecularDataOneFrame* const frame, float gradient[3]);
+    float evaluateOrbitalWithGradient(const float xyz[3],
+                                      const int n_ao,
+                                      const MoleculeStruct::AtomicOrbital* const aos,
+                                      const MoleculeStruct::GaussianPrimitive* const prims,
+                                      const float* const C,
+                                      float gradient[3]);
+
+    // The AOs of a frame reordered into runs of equal quantum number and primitive count, which evaluateAOs hands to
+    // code specialized on both. Coefficients are reordered with the AOs, sorted_to_original maps back to the frame order.
+    struct SortedBasis
+    {
+        std::vector<MoleculeStruct::AtomicOrbital> aos;
+        std::vector<MoleculeStruct::GaussianPrimitive> primitives;
+        std::vector<int> first_primitives; // Offset of each sorted AO into primitives
+        std::vector<int> sorted_to_original;
+        std::vector<float> mo_coefficients; // C[i_sorted_ao]
+        std::vector<float> occupied_mo_coefficients; // C[i_sorted_ao + i_mo * n_ao]
+    };
+    void sortBasis(const MoleculeStruct::MolecularDataOneFrame* const frame, SortedBasis& sorted);
+
+    // Radius in angstrom around each AO center outside of which |AO| < threshold
+    void getAOExtents(const MoleculeStruct::MolecularDataOneFrame* const frame, const float threshold, float* const extents);
+
+    // Values of every AO on a batch of points, stored as ao_values[i_point * n_ao + i_ao].
+    // Runs of consecutive AOs with equal quantum number and primitive count are evaluated by specialized code.
+    // If ao_gradients is not nullptr, it gets d/dx, d/dy, d/dz as ao_gradients[(i_xyz * n_point + i_point) * n_ao + i_ao]
+    template <typename Precision = FloatPrecision>
+    void evaluateAOs(const int n_point,
+                     const float* const xyz,
+                     const int n_ao,
+                     const MoleculeStruct::AtomicOrbital* const aos,
+                     const MoleculeStruct::GaussianPrimitive* const prims,
+                     typename Precision::accumulate_type* const ao_values,
+                     typename Precision::accumulate_type* const ao_gradients);
+
+    // out[i * ldo + j] = sum_l A[i * lda + l] * B[j * ldb + l], A is m x k and B is n x k
+    template <typename real>
+    void matrixMultiplyTransposed(const int m, const int n, const int k,
+                                  const real* const A, const int lda,
+                                  const real* const B, const int ldb,
+                                  real* const out, const int ldo);
+
+    // Same as evaluateOrbital on n_point positions stored as xyz[i_point * 3 + i_xyz], through evaluateAOs so the exponentials are batched.
+    // If gradients is not nullptr, it gets the gradient as gradients[i_point * 3 + i_xyz]
+    template <typename Precision = FloatPrecision>
+    void evaluateOrbitalBatch(const int n_point,
+                              const float* const xyz,
+                              const MoleculeStruct::MolecularDataOneFrame* const frame,
+                              float* const values,
+                              float* const gradients = nullptr);
+    template <typename Precision = FloatPrecision>
+    void evaluateOrbitalBatch(const int n_point,
+                              const float* const xyz,
+                              const int n_ao,
+                              const MoleculeStruct::AtomicOrbital* const aos,
+                              const MoleculeStruct::GaussianPrimitive* const prims,
+                              const float* const C,
+                              float* const values,
+                              float* const gradients = nullptr);
+
+    // Total and spin density from the occupied orbitals of the frame, either output can be nullptr
+    template <typename Precision = FloatPrecision>
+    void evaluateDensity(const int n_point,
+                         const float* const xyz,
+                         const MoleculeStruct::MolecularDataOneFrame* const frame,
+                         float* const density,
+                         float* const spin_density);
+    // occupied_C has the layout of MolecularDataOneFrame::occupied_mo_coefficients, C[i_ao + i_mo * n_ao]
+    template <typename Precision = FloatPrecision>
+    void evaluateDensity(const int n_point,
+                         const float* const xyz,
+                         const int n_ao,
+                         const MoleculeStruct::AtomicOrbital* const aos,
+                         const MoleculeStruct::GaussianPrimitive* const prims,
+                         const int n_mo,
+                         const float* const occupied_C,
+                         const float* const occupation_numbers,
+                         const float* const spin_occupation_numbers,
+                         float* const density,
+                         float* const spin_density);
+    // Gradients are stored as gradient[i_point * 3 + i_xyz], any output can be nullptr
+    template <typename Precision = FloatPrecision>
+    void evaluateDensityWithGradient(const int n_point,
+                                     const float* const xyz,
+                                     const MoleculeStruct::MolecularDataOneFrame* const frame,
+                                     float* const density,
+                                     float* const spin_density,
+                                     float* const density_gradient,
+                                     float* const spin_density_gradient);
 }
\ No newline at end of file
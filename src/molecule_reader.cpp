@@ -43,6 +43,7 @@ namespace MoleculeReader
     const char* ao_extension = ".ao.txt";
     const char* prim_extension = ".prim.txt";
     const char* C_extension = ".C.txt";
+    const char* occ_extension = ".occ.txt"; // Optional, occupied orbitals for density plots, see molecule_demo/h2_occ/h2
 
     // http://www.cplusplus.com/articles/1UqpX9L8/
     class splitstring : public std::string
@@ -86,6 +87,7 @@ namespace MoleculeReader
         std::ifstream ao_file(filename_string + ao_extension);
         std::ifstream prim_file(filename_string + prim_extension);
         std::ifstream C_file(filename_string + C_extension);
+        std::ifstream occ_file(filename_string + occ_extension);
 
         if (!xyz_file.is_open())
         {
@@ -107,6 +109,8 @@ namespace MoleculeReader
             std::cout << "Cannot open " + filename_string + C_extension << std::endl;
             return video_data;
         }
+        if (!occ_file.is_open())
+            std::cout << "No " + filename_string + occ_extension + ", density is evaluated from the single MO as a singly occupied alpha orbital" << std::endl;
 
         while (!xyz_file.eof() && !ao_file.eof() && !prim_file.eof() && !C_file.eof())
         {
@@ -200,6 +204,45 @@ namespace MoleculeReader
                 frame->primitives[i_prim].contraction = std::stof(splitted[1]);
             }
 
+            if (occ_file.is_open())
+            {
+                // Each line is one occupied orbital: occupation, spin occupation, then n_ao coefficients
+                std::getline(occ_file, temp);
+                if (temp.empty())
+                {
+                    std::cout << "Occupied orbital file has fewer frames than the xyz file!" << std::endl;
+                    delete frame;
+                    return video_data;
+                }
+                int n_occupied = std::stoi(temp);
+                std::getline(occ_file, temp); // Skip comment line
+
+                frame->allocateOccupiedMO(n_occupied);
+                for (int i_mo = 0; i_mo < n_occupied; i_mo++)
+                {
+                    std::getline(occ_file, temp);
+                    std::vector<std::string> splitted = splitstring(temp).split(' ');
+                    if ((int)splitted.size() != n_ao + 2)
+                    {
+                        std::cout << "Inconsistent AO number from ao file and occ file" << std::endl;
+                        delete frame;
+                        return video_data;
+                    }
+                    frame->occupation_numbers[i_mo] = std::stof(splitted[0]);
+                    frame->spin_occupation_numbers[i_mo] = std::stof(splitted[1]);
+                    for (int i_ao = 0; i_ao < n_ao; i_ao++)
+                        frame->occupied_mo_coefficients[i_ao + i_mo * n_ao] = std::stof(splitted[i_ao + 2]);
+                }
+            }
+            else
+            {
+                frame->allocateOccupiedMO(1);
+                frame->occupation_numbers[0] = 1;
+                frame->spin_occupation_numbers[0] = 1;
+                for (int i_ao = 0; i_ao < n_ao; i_ao++)
+                    frame->occupied_mo_coefficients[i_ao] = frame->mo_coefficients[i_ao];
+            }
+
             video_data.push_back(frame);
         }
 
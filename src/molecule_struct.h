@@ -40,6 +40,12 @@ namespace MoleculeStruct
         GaussianPrimitive* primitives;
         float* mo_coefficients;
 
+        // Occupied orbitals for density evaluation, same layout as mo_coefficients: C[i_ao + i_mo * n_AO]
+        int n_occupied_MO;
+        float* occupied_mo_coefficients;
+        float* occupation_numbers; // n_alpha + n_beta of each orbital
+        float* spin_occupation_numbers; // n_alpha - n_beta of each orbital
+
         MolecularDataOneFrame(const int set_n_atom, const int set_n_AO, const int set_n_primitive)
         {
             this->n_atom = set_n_atom;
@@ -50,6 +56,23 @@ namespace MoleculeStruct
             this->aos = new AtomicOrbital[set_n_AO];
             this->primitives = new GaussianPrimitive[set_n_primitive];
             this->mo_coefficients = new float[set_n_AO];
+
+            this->n_occupied_MO = 0;
+            this->occupied_mo_coefficients = nullptr;
+            this->occupation_numbers = nullptr;
+            this->spin_occupation_numbers = nullptr;
+        }
+
+        void allocateOccupiedMO(const int set_n_occupied_MO)
+        {
+            delete[] this->occupied_mo_coefficients;
+            delete[] this->occupation_numbers;
+            delete[] this->spin_occupation_numbers;
+
+            this->n_occupied_MO = set_n_occupied_MO;
+            this->occupied_mo_coefficients = new float[set_n_occupied_MO * this->n_AO];
+            this->occupation_numbers = new float[set_n_occupied_MO];
+            this->spin_occupation_numbers = new float[set_n_occupied_MO];
         }
 
         ~MolecularDataOneFrame()
@@ -58,6 +81,9 @@ namespace MoleculeStruct
             delete[] this->aos;
             delete[] this->primitives;
             delete[] this->mo_coefficients;
+            delete[] this->occupied_mo_coefficients;
+            delete[] this->occupation_numbers;
+            delete[] this->spin_occupation_numbers;
         }
 
     private:
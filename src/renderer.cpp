@@ -14,12 +14,39 @@
 // NOTE: can use libshaderc to compile shaders from within code instead of externally
 
 
+#include <filesystem>
+#ifdef _WIN32
+#include <process.h> // _getpid
+#else
+#include <unistd.h> // getpid
+#endif
+
 #include "renderer.h"
 #include "mesh_renderer.h"
+#include "mesh_simplifier.h"
+#include "thread_pool.h"
 
 const uint32_t WIDTH = 800;
 const uint32_t HEIGHT = 600;
 const int MAX_FRAMES_IN_FLIGHT = 2;
+const GridEvaluator::FieldType RENDERED_FIELD = GridEvaluator::FieldType::Orbital; // MO, total density or spin density
+typedef MoleculeKernel::FloatPrecision RENDERED_PRECISION; // FloatPrecision, MixedPrecision or DoublePrecision
+const MeshRenderer::IsosurfaceMesher RENDERED_MESHER = MeshRenderer::IsosurfaceMesher::MarchingCubes; // MarchingCubes or SurfaceNets
+const size_t ORBITAL_TRIANGLE_BUDGET = 0; // Isosurfaces are simplified down to this many triangles, 0 keeps them all
+const float ORBITAL_SIMPLIFICATION_ERROR = 0.0f; // Angstrom, isosurfaces are simplified as long as they move less than this, 0 for no limit
+const int ORBITAL_LOD_LEVELS = 1; // Levels of detail of the isosurfaces, each with half the triangles of the previous one, 1 for the full mesh only
+const float ORBITAL_LOD_PIXELS_PER_TRIANGLE = 16.0f; // Coarser levels are drawn as long as a triangle covers no more pixels than this
+const glm::vec3 CAMERA_POSITION(0., 1., 7.); // Looks at the origin, cannot be the same as the up vector in lookAt()
+const float CAMERA_FIELD_OF_VIEW = glm::radians(45.f); // vertical
+const bool INSTANCED_MOLECULE = true; // Atoms and bonds as instances of meshes uploaded once, false expands them into the vertex buffer every frame
+const bool IMPOSTOR_MOLECULE = true; // Instances ray cast on a quad per atom and a box per half bond instead of drawn as sphere and cylinder meshes
+const bool COMPACT_VERTICES = true; // Vertices uploaded as 16 byte CompactVertex instead of 64 byte Vertex, with the shader compiled with COMPACT_VERTEX
+
+const VkDeviceSize MEMORY_BLOCK_SIZE = 64 << 20; // bytes, device memory is allocated in blocks of this size per memory type
+const VkDeviceSize STAGING_RING_SIZE = 8 << 20; // bytes, initial size of the staging ring, which grows for larger updates
+const int UPLOADS_IN_FLIGHT = 2; // upload command buffers used in turn
+const int OFFSCREEN_FRAMES_IN_FLIGHT = 3; // at least 2, offscreen images and read back buffers: one rendering, one read back, one encoding
+const char* const PIPELINE_CACHE_FILE = "../obj/pipeline_cache.bin"; // saved on exit, loaded on start when the same device and driver wrote it
 
 // Specifies what optional validation layers are used to check the code
 // for development. Is turned off when compiled not in debug mode
@@ -69,6 +96,47 @@ void TriangleRenderer::run() {
     cleanup();
 }
 
+void TriangleRenderer::renderOffscreen(const OffscreenSettings& settings, FrameSink& sink) {
+    offscreen = true;
+    offscreenExtent = { settings.width, settings.height };
+    initVulkan();
+
+    // A pipeline over the images in turn: while frame k renders, frame k - 1 is waited for and handed to the sink, and
+    // earlier frames are being written. An image is reused once the sink is done with its read back buffer, which it reads
+    // in place.
+    std::vector<std::future<void>> encoded(swapChainImages.size());
+    const size_t rowPitch = 4 * (size_t)swapChainExtent.width;
+    auto encodeFrame = [&](int i_frame, size_t i) {
+        vkWaitForFences(device, 1, &readbackFences[i], VK_TRUE, UINT64_MAX);
+        encoded[i] = sink.write(i_frame, static_cast<const uint8_t*>(readbackBufferMemory[i].mapped),
+                                swapChainExtent.width, swapChainExtent.height, rowPitch);
+    };
+
+    auto startTime = std::chrono::high_resolution_clock::now();
+    const int first_frame = std::max(settings.first_frame, 0);
+    const int last_frame = settings.last_frame < 0 ? (int)trajectory.size() - 1 : std::min(settings.last_frame, (int)trajectory.size() - 1);
+    for (int i_frame = first_frame; i_frame <= last_frame; i_frame++) {
+        const size_t i = (i_frame - first_frame) % swapChainImages.size();
+        if (encoded[i].valid())
+            encoded[i].get(); // rethrows a failed write
+        drawOffscreenFrame(i_frame, i);
+        if (i_frame > first_frame)
+            encodeFrame(i_frame - 1, (i_frame - 1 - first_frame) % swapChainImages.size());
+    }
+    if (last_frame >= first_frame)
+        encodeFrame(last_frame, (last_frame - first_frame) % swapChainImages.size());
+    for (std::future<void>& image : encoded)
+        if (image.valid())
+            image.get();
+
+    const int frame_count = std::max(last_frame - first_frame + 1, 0);
+    const float seconds = std::chrono::duration<float, std::chrono::seconds::period>(std::chrono::high_resolution_clock::now() - startTime).count();
+    std::cout << "Wrote " << frame_count << " frames in " << seconds << " s, " << frame_count / seconds << " frames/s\n";
+
+    vkDeviceWaitIdle(device);
+    cleanup();
+}
+
 
   // High level of customizability in this function, requires going through the Vulkan SDK
 void TriangleRenderer::populateDebugMessengerCreateInfo(VkDebugUtilsMessengerCreateInfoEXT& createInfo) {
@@ -126,9 +194,6 @@ void TriangleRenderer::createInstance() {
         std::cout << "\t" << extension << "\n";
     }
 
-    const char ** glfwExtensions;
-    glfwExtensions = glfwGetRequiredInstanceExtensions(&extensionCount);
-
     // Need to set up different debug create info for operatiosn that come before the instantiation of the main debug messenger
     // This debug messenger will report on the instance creation AND deletion as an extension in the pNext attribute
     VkDebugUtilsMessengerCreateInfoEXT debugCreateInfo;
@@ -169,10 +234,15 @@ void TriangleRenderer::initWindow() {
 void TriangleRenderer::initVulkan() {
     createInstance(); // initializes the Vulkan library:
     setupDebugMessenger(); // initializes the debugger
-    createSurface(); // The actual rendering surface
+    if (!offscreen)
+        createSurface(); // The actual rendering surface
     pickPhysicalDevice(); // picks the right graphics card
     createLogicalDevice(); // creates a logical device
-    createSwapChain(); // actually puts the images on the screen
+    createPipelineCache(); // compiled pipelines of earlier runs
+    if (offscreen)
+        createOffscreenImages();
+    else
+        createSwapChain(); // actually puts the images on the screen
     createImageViews(); // Does images
     createRenderPass(); // Tells Vulkan about what framebuffers there are to write to
     createDescriptorSetLayout(); // Descriptor sets are what become the uniform buffers eventually I think
@@ -180,8 +250,13 @@ void TriangleRenderer::initVulkan() {
     createCommandPool(); // Organizes and allocates command buffers
     createDepthResources();
     createFramebuffers();
-    createVertexBuffer(); // Need to have the vertices before we know how many commands there are? Not sure
-    createIndexBuffer(); // Need to have the vertices before we know how many commands there are? Not sure
+    createStagingRing(STAGING_RING_SIZE);
+    createUploadCommandBuffers();
+    uploadVertexBuffer(geometryBuffers[0]); // Need to have the vertices before we know how many commands there are? Not sure
+    uploadIndexBuffer(geometryBuffers[0]); // Need to have the vertices before we know how many commands there are? Not sure
+    uploadInstanceBuffer(geometryBuffers[0]);
+    createMoleculeMeshBuffers();
+    submitBufferUpdates();
     createUniformBuffers(); // Store the uniforms
     createDescriptorPool(); // Descriptor sets must be allocated from descriptor pools
     createDescriptorSets();
@@ -206,17 +281,28 @@ TriangleRenderer::QueueFamilyIndices TriangleRenderer::findQueueFamilies(VkPhysi
     for (const auto& queueFamily : queueFamilies) {
         // Checks if the queue family has support for presenting to the screen
         VkBool32 presentSupport = false;
-        vkGetPhysicalDeviceSurfaceSupportKHR(device, i, surface, &presentSupport);
+        if (!offscreen)
+            vkGetPhysicalDeviceSurfaceSupportKHR(device, i, surface, &presentSupport);
         if (presentSupport)
             indices.presentFamily = i;
 
-        if (queueFamily.queueFlags & VK_QUEUE_GRAPHICS_BIT)
+        if (queueFamily.queueFlags & VK_QUEUE_GRAPHICS_BIT) {
             indices.graphicsFamily = i;
+            if (offscreen) // nothing is presented, the graphics queue stands in
+                indices.presentFamily = i;
+        }
         if (indices.isComplete())
             break;
         i++;
     }
 
+    // Any family can copy, a family that can do nothing else is a separate DMA engine that runs next to rendering
+    for (uint32_t i_family = 0; i_family < queueFamilyCount; i_family++)
+        if ((queueFamilies[i_family].queueFlags & VK_QUEUE_TRANSFER_BIT) && !(queueFamilies[i_family].queueFlags & (VK_QUEUE_GRAPHICS_BIT | VK_QUEUE_COMPUTE_BIT))) {
+            indices.transferFamily = i_family;
+            break;
+        }
+
     return indices;
 }
 
@@ -247,6 +333,9 @@ bool TriangleRenderer::isDeviceSuitable(VkPhysicalDevice device) {
     std::cout << "DeviceName: " << deviceProperties.deviceName << std::endl;
 
     // Checks if there are device extensions supported (probably can't be false if swapChainAdequate but whatever)
+    // Offscreen rendering needs neither the swap chain extension nor a surface
+    if (offscreen)
+        return findQueueFamilies(device).isComplete();
     bool extensionsSupported = checkDeviceExtensionSupport(device);
 
 
@@ -297,13 +386,15 @@ void TriangleRenderer::createLogicalDevice() {
 
     // Ensures that the cases where the queues are the same and different are both handled
     std::vector<VkDeviceQueueCreateInfo> queueCreateInfos;
-    std::set<uint32_t> uniqueQueueFamilies = {indices.graphicsFamily.value(), indices.presentFamily.value()};
+    graphicsQueueFamily = indices.graphicsFamily.value();
+    transferQueueFamily = indices.transferFamily.value_or(graphicsQueueFamily);
+    std::set<uint32_t> uniqueQueueFamilies = {indices.graphicsFamily.value(), indices.presentFamily.value(), transferQueueFamily};
 
     float queuePriority = 1.; // different queues have different priority, but that doesn't matter when there is only one
     for (uint32_t queueFamily : uniqueQueueFamilies) {
         VkDeviceQueueCreateInfo queueCreateInfo{};
         queueCreateInfo.sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO;
-        queueCreateInfo.queueFamilyIndex = indices.graphicsFamily.value();
+        queueCreateInfo.queueFamilyIndex = queueFamily;
         queueCreateInfo.queueCount = 1;
         queueCreateInfo.pQueuePriorities = &queuePriority;
         queueCreateInfos.push_back(queueCreateInfo);
@@ -322,7 +413,7 @@ void TriangleRenderer::createLogicalDevice() {
 
 
     // Deals with device extensions
-    createInfo.enabledExtensionCount = static_cast<uint32_t>(deviceExtensions.size());
+    createInfo.enabledExtensionCount = offscreen ? 0 : static_cast<uint32_t>(deviceExtensions.size());
     createInfo.ppEnabledExtensionNames = deviceExtensions.data();
 
     // The same validation layers should work on device and instance, so this is deprecated.
@@ -341,6 +432,9 @@ void TriangleRenderer::createLogicalDevice() {
     // Gives us the pointers to the queues we need
     vkGetDeviceQueue(device, indices.graphicsFamily.value(), 0, &graphicsQueue);
     vkGetDeviceQueue(device, indices.presentFamily.value(), 0, &presentQueue);
+    vkGetDeviceQueue(device, transferQueueFamily, 0, &transferQueue);
+
+    memoryAllocator.init(physicalDevice, device, MEMORY_BLOCK_SIZE);
 }
 
 // WINDOW SURFACE CREATION
@@ -484,32 +578,65 @@ void TriangleRenderer::createSwapChain() {
     swapChainExtent = extent;
 }
 
+void TriangleRenderer::createOffscreenImages() {
+    // sRGB like the swap chain, so that the read back bytes are what the window would show
+    const size_t imageCount = OFFSCREEN_FRAMES_IN_FLIGHT;
+    swapChainImageFormat = VK_FORMAT_R8G8B8A8_SRGB;
+    swapChainExtent = offscreenExtent;
+    swapChainImages.resize(imageCount);
+    offscreenImageMemory.resize(imageCount);
+    readbackBuffers.resize(imageCount);
+    readbackBufferMemory.resize(imageCount);
+    readbackFences.resize(imageCount);
+    for (size_t i = 0; i < imageCount; i++) {
+        createImage(swapChainExtent.width, swapChainExtent.height, swapChainImageFormat, VK_IMAGE_TILING_OPTIMAL,
+                    VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+                    swapChainImages[i], offscreenImageMemory[i]);
+        // Tightly packed RGBA rows, mapped for as long as the buffer lives
+        createBuffer(4 * (VkDeviceSize)swapChainExtent.width * swapChainExtent.height, VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+                     VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, readbackBuffers[i], readbackBufferMemory[i]);
+
+        VkFenceCreateInfo fenceInfo{};
+        fenceInfo.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+        fenceInfo.flags = VK_FENCE_CREATE_SIGNALED_BIT;
+        if (vkCreateFence(device, &fenceInfo, nullptr, &readbackFences[i]) != VK_SUCCESS)
+            throw std::runtime_error("Failed to create read back fence!");
+    }
+}
+
 void TriangleRenderer::cleanupSwapChain() {
     vkDestroyImageView(device, depthImageView, nullptr);
     vkDestroyImage(device, depthImage, nullptr);
-    vkFreeMemory(device, depthImageMemory, nullptr);
+    memoryAllocator.free(depthImageMemory);
 
     for (size_t i = 0; i < swapChainFramebuffers.size(); i++) {
         vkDestroyFramebuffer(device, swapChainFramebuffers[i], nullptr);
     }
 
     vkFreeCommandBuffers(device, commandPool, static_cast<uint32_t>(commandBuffers.size()), commandBuffers.data());
+    // Also frees the layer command buffers
+    for (VkCommandPool layerCommandPool : layerCommandPools)
+        vkDestroyCommandPool(device, layerCommandPool, nullptr);
 
-    for (size_t i = 0; i < swapChainImages.size(); i++) { 
-        vkDestroyBuffer(device, uniformBuffers[i], nullptr);
-        vkFreeMemory(device, uniformBuffersMemory[i], nullptr);
-    }
+    vkDestroyBuffer(device, uniformBuffer, nullptr);
+    memoryAllocator.free(uniformBufferMemory);
 
     vkDestroyDescriptorPool(device, descriptorPool, nullptr);
 
-    vkDestroyPipeline(device, graphicsPipeline, nullptr);
-    vkDestroyPipelineLayout(device, pipelineLayout, nullptr);
-    vkDestroyRenderPass(device, renderPass, nullptr);
-
     for (size_t i = 0; i < swapChainImageViews.size(); i++) {
         vkDestroyImageView(device, swapChainImageViews[i], nullptr);
     }
 
+    if (offscreen) {
+        for (size_t i = 0; i < swapChainImages.size(); i++) {
+            vkDestroyImage(device, swapChainImages[i], nullptr);
+            memoryAllocator.free(offscreenImageMemory[i]);
+            vkDestroyBuffer(device, readbackBuffers[i], nullptr);
+            memoryAllocator.free(readbackBufferMemory[i]);
+            vkDestroyFence(device, readbackFences[i], nullptr);
+        }
+        return;
+    }
     vkDestroySwapchainKHR(device, swapChain, nullptr); 
 }
 
@@ -527,17 +654,24 @@ void TriangleRenderer::recreateSwapChain() {
 
     // now we wait until the GPU isn't working on the pipeline
     vkDeviceWaitIdle(device); // heuristic for resources being freed up
+    cleanupSwapChain();
 
+    const VkFormat previousImageFormat = swapChainImageFormat;
     createSwapChain();
     createImageViews(); // direct dependence
-    createRenderPass(); // format of swap chain images
-    createGraphicsPipeline(); // viewport and scissor rectangle size
+    // Viewport and scissor are set when drawing, so the render pass and pipeline are kept unless the image format changed
+    if (swapChainImageFormat != previousImageFormat) {
+        destroyGraphicsPipeline();
+        createRenderPass(); // format of swap chain images
+        createGraphicsPipeline();
+    }
     createDepthResources();
     createFramebuffers(); // direct dependence
     createUniformBuffers(); // direct dependence
     createDescriptorPool(); // direct dependence
     createDescriptorSets();
     createCommandBuffers(); // direct dependence
+    imagesInFlight.assign(swapChainImages.size(), VK_NULL_HANDLE); // idle, and there may be more images now
 }
 
 // IMAGE VIEWS
@@ -588,16 +722,25 @@ void TriangleRenderer::drawFrame() {
 #ifndef DEBUG_TRIANGLES
     updateVertexAndIndexBuffer(time);
 #endif
+    // The image is not in flight any more, its command buffer can be recorded again with the current geometry
+    if (commandBufferGenerations[imageIndex] != geometryGeneration)
+        recordCommandBuffer(imageIndex);
     updateUniformBuffer(time, imageIndex); // TODO: maybe put this right after the vkAcquireNextImageKHR?
 
     // 2.
     VkSubmitInfo submitInfo{};
     submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
 
-    // wait semaphores are the ones the command buffer waits on
-    VkSemaphore waitSemaphores[] = {imageAvailableSemaphores[currentFrame]};
-    VkPipelineStageFlags waitStages[] = {VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT};
+    // wait semaphores are the ones the command buffer waits on, the last upload is waited before reading vertices
+    VkSemaphore waitSemaphores[] = {imageAvailableSemaphores[currentFrame], VK_NULL_HANDLE};
+    VkPipelineStageFlags waitStages[] = {VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT, VK_PIPELINE_STAGE_VERTEX_INPUT_BIT};
     submitInfo.waitSemaphoreCount = 1;
+    if (pendingUpload >= 0) {
+        waitSemaphores[1] = uploadSemaphores[pendingUpload];
+        uploadSemaphoreWaitFences[pendingUpload] = inFlightFences[currentFrame];
+        submitInfo.waitSemaphoreCount = 2;
+        pendingUpload = -1;
+    }
     submitInfo.pWaitSemaphores = waitSemaphores;
     submitInfo.pWaitDstStageMask = waitStages;
 
@@ -640,6 +783,32 @@ void TriangleRenderer::drawFrame() {
     currentFrame = (currentFrame + 1) % MAX_FRAMES_IN_FLIGHT; // update frame
 }
 
+void TriangleRenderer::drawOffscreenFrame(int i_frame, size_t i) {
+    updateGeometry(i_frame);
+    if (commandBufferGenerations[i] != geometryGeneration)
+        recordCommandBuffer(i);
+    updateUniformBuffer(0.f, static_cast<uint32_t>(i));
+    imagesInFlight[i] = readbackFences[i];
+
+    // No image to acquire, only the last upload to wait
+    VkSubmitInfo submitInfo{};
+    submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+    const VkPipelineStageFlags waitStage = VK_PIPELINE_STAGE_VERTEX_INPUT_BIT;
+    if (pendingUpload >= 0) {
+        submitInfo.waitSemaphoreCount = 1;
+        submitInfo.pWaitSemaphores = &uploadSemaphores[pendingUpload];
+        submitInfo.pWaitDstStageMask = &waitStage;
+        uploadSemaphoreWaitFences[pendingUpload] = readbackFences[i];
+        pendingUpload = -1;
+    }
+    submitInfo.commandBufferCount = 1;
+    submitInfo.pCommandBuffers = &commandBuffers[i];
+
+    vkResetFences(device, 1, &readbackFences[i]);
+    if (vkQueueSubmit(graphicsQueue, 1, &submitInfo, readbackFences[i]) != VK_SUCCESS)
+        throw std::runtime_error("Failed to submit offscreen command buffer!");
+}
+
 //  MAIN LOOP
 
 // Event loop to keep window open until it should be closed
@@ -657,13 +826,32 @@ void TriangleRenderer::mainLoop()
 
 void TriangleRenderer::cleanup() {
     cleanupSwapChain();
+    destroyGraphicsPipeline();
+    savePipelineCache();
+    vkDestroyPipelineCache(device, pipelineCache, nullptr);
 
     vkDestroyDescriptorSetLayout(device, descriptorSetLayout, nullptr);
 
-    vkDestroyBuffer(device, vertexBuffer, nullptr);
-    vkFreeMemory(device, vertexBufferMemory, nullptr);
-    vkDestroyBuffer(device, indexBuffer, nullptr);
-    vkFreeMemory(device, indexBufferMemory, nullptr);
+    waitForBufferUpdates(); // also destroys their staging buffers
+    for (GeometryBuffers& geometry : geometryBuffers) {
+        vkDestroyBuffer(device, geometry.vertexBuffer, nullptr);
+        memoryAllocator.free(geometry.vertexBufferMemory);
+        vkDestroyBuffer(device, geometry.indexBuffer, nullptr);
+        memoryAllocator.free(geometry.indexBufferMemory);
+        vkDestroyBuffer(device, geometry.instanceBuffer, nullptr);
+        memoryAllocator.free(geometry.instanceBufferMemory);
+    }
+    vkDestroyBuffer(device, moleculeMeshVertexBuffer, nullptr);
+    memoryAllocator.free(moleculeMeshVertexBufferMemory);
+    vkDestroyBuffer(device, moleculeMeshIndexBuffer, nullptr);
+    memoryAllocator.free(moleculeMeshIndexBufferMemory);
+    vkDestroyBuffer(device, stagingRingBuffer, nullptr);
+    memoryAllocator.free(stagingRingMemory);
+    for (VkFence uploadFence : uploadFences)
+        vkDestroyFence(device, uploadFence, nullptr);
+    for (VkSemaphore uploadSemaphore : uploadSemaphores)
+        vkDestroySemaphore(device, uploadSemaphore, nullptr);
+    vkDestroyCommandPool(device, transferCommandPool, nullptr);
 
     for (size_t i = 0; i < MAX_FRAMES_IN_FLIGHT; i++) {
         vkDestroySemaphore(device, renderFinishedSemaphores[i], nullptr);
@@ -673,12 +861,20 @@ void TriangleRenderer::cleanup() {
 
     vkDestroyCommandPool(device, commandPool, nullptr);
 
+    // Debug builds only, and on stderr so that a video streamed to stdout stays intact
+    if (enableValidationLayers)
+        memoryAllocator.printStatistics(std::cerr);
+    memoryAllocator.destroy();
     vkDestroyDevice(device, nullptr);
 
     if (enableValidationLayers) {
         DestroyDebugUtilsMessengerEXT(instance, debugMessenger, nullptr);
     }
 
+    if (offscreen) {
+        vkDestroyInstance(instance, nullptr);
+        return;
+    }
     vkDestroySurfaceKHR(instance, surface, nullptr);
     vkDestroyInstance(instance, nullptr);
 
@@ -712,9 +908,11 @@ bool TriangleRenderer::checkValidationLayerSupport() {
 // This gets a list of all required extensions, including both GLFW required ones and 
 // ones specified for the validation layers we want
 std::vector<const char*> TriangleRenderer::getRequiredExtensions() {
+    // GLFW is not initialized offscreen, no surface extension is needed
     uint32_t glfwExtensionCount = 0;
-    const char** glfwExtensions;
-    glfwExtensions = glfwGetRequiredInstanceExtensions(&glfwExtensionCount);
+    const char** glfwExtensions = nullptr;
+    if (!offscreen)
+        glfwExtensions = glfwGetRequiredInstanceExtensions(&glfwExtensionCount);
 
     std::vector<const char*> extensions(glfwExtensions, glfwExtensions + glfwExtensionCount);
 
@@ -743,7 +941,7 @@ VkShaderModule TriangleRenderer::createShaderModule(const std::vector<char>& cod
 }
 
 void TriangleRenderer::createGraphicsPipeline() {
-    auto vertShaderCode = readFile("../obj/hardcoded.vert.spv"); 
+    auto vertShaderCode = readFile(COMPACT_VERTICES ? "../obj/hardcoded.vert.compact.spv" : "../obj/hardcoded.vert.spv");
     auto fragShaderCode = readFile("../obj/hardcoded.frag.spv"); 
 
     VkShaderModule vertShaderModule = createShaderModule(vertShaderCode);
@@ -769,11 +967,14 @@ void TriangleRenderer::createGraphicsPipeline() {
     VkPipelineVertexInputStateCreateInfo vertexInputInfo{};
     vertexInputInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO;
 
-    // Get the vertex pipeline descriptions from our struct vertex buffer
-    auto bindingDescription = Vertex::getBindingDescription();
-    auto attributeDescriptions = Vertex::getAttributeDescriptions();
-    vertexInputInfo.vertexBindingDescriptionCount = 1;
-    vertexInputInfo.pVertexBindingDescriptions = &bindingDescription;
+    // Get the vertex pipeline descriptions from our struct vertex buffer, and the per instance ones in binding 1
+    std::array<VkVertexInputBindingDescription, 2> bindingDescriptions{ COMPACT_VERTICES ? CompactVertex::getBindingDescription() : Vertex::getBindingDescription(), MoleculeInstance::getBindingDescription() };
+    auto vertexAttributeDescriptions = COMPACT_VERTICES ? CompactVertex::getAttributeDescriptions() : Vertex::getAttributeDescriptions();
+    auto instanceAttributeDescriptions = MoleculeInstance::getAttributeDescriptions();
+    std::vector<VkVertexInputAttributeDescription> attributeDescriptions(vertexAttributeDescriptions.begin(), vertexAttributeDescriptions.end());
+    attributeDescriptions.insert(attributeDescriptions.end(), instanceAttributeDescriptions.begin(), instanceAttributeDescriptions.end());
+    vertexInputInfo.vertexBindingDescriptionCount = static_cast<uint32_t>(bindingDescriptions.size());
+    vertexInputInfo.pVertexBindingDescriptions = bindingDescriptions.data();
     vertexInputInfo.vertexAttributeDescriptionCount = static_cast<uint32_t>(attributeDescriptions.size());
     vertexInputInfo.pVertexAttributeDescriptions = attributeDescriptions.data();
 
@@ -783,27 +984,14 @@ void TriangleRenderer::createGraphicsPipeline() {
     inputAssembly.topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST; // Every 3 points makes a triangle
     inputAssembly.primitiveRestartEnable = VK_FALSE; // no idea what this is
 
-    // Viewport specification (usually (0,0) -> (width, height))
-    VkViewport viewport{};
-    viewport.x = 0.;
-    viewport.y = 0.;
-    viewport.width = (float) swapChainExtent.width; // swapChain used for framebuffers
-    viewport.height = (float) swapChainExtent.height;
-    viewport.minDepth = 0.;
-    viewport.maxDepth = 1.; // These have to be in [0, 1] for some reason
-
-    // Scissor rectanlge crops input image as much as we want
-    VkRect2D scissor{};
-    scissor.offset = {0,0};
-    scissor.extent = swapChainExtent; // Covers full image because we don't want a crop
-
-    // Combine viewport and scissor into Viewport State
+    // One viewport and scissor rectangle, both dynamic state set by the command buffers to the swap chain extent, so that
+    // the pipeline outlives swap chain recreation
     VkPipelineViewportStateCreateInfo viewportState{};
     viewportState.sType = VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO;
     viewportState.viewportCount = 1; // sometimes possible to use multiple
-    viewportState.pViewports = &viewport;
+    viewportState.pViewports = nullptr;
     viewportState.scissorCount = 1;
-    viewportState.pScissors = &scissor;
+    viewportState.pScissors = nullptr;
 
     // Rasterizer turns geometry from vertex shader and turns it into fragments for the frament shader
     // More advanced feature selection requires turning on GPU features
@@ -872,7 +1060,7 @@ void TriangleRenderer::createGraphicsPipeline() {
     // This specifies which ones
     VkDynamicState dynamicStates[] = {
         VK_DYNAMIC_STATE_VIEWPORT,
-        VK_DYNAMIC_STATE_LINE_WIDTH
+        VK_DYNAMIC_STATE_SCISSOR
     };
     VkPipelineDynamicStateCreateInfo dynamicState{};
     dynamicState.sType = VK_STRUCTURE_TYPE_PIPELINE_DYNAMIC_STATE_CREATE_INFO;
@@ -884,8 +1072,13 @@ void TriangleRenderer::createGraphicsPipeline() {
     pipelineLayoutInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
     pipelineLayoutInfo.setLayoutCount = 1;
     pipelineLayoutInfo.pSetLayouts = &descriptorSetLayout;
-    pipelineLayoutInfo.pushConstantRangeCount = 0; // Optional
-    pipelineLayoutInfo.pPushConstantRanges = nullptr; // Optional
+    // The bounds of the compact vertices, unused by the shader otherwise
+    VkPushConstantRange pushConstantRange{};
+    pushConstantRange.stageFlags = VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_FRAGMENT_BIT;
+    pushConstantRange.offset = 0;
+    pushConstantRange.size = sizeof(DrawConstants);
+    pipelineLayoutInfo.pushConstantRangeCount = 1;
+    pipelineLayoutInfo.pPushConstantRanges = &pushConstantRange;
     if (vkCreatePipelineLayout(device, &pipelineLayoutInfo, nullptr, &pipelineLayout) != VK_SUCCESS)
         throw std::runtime_error("failed to create pipeline layout!");
 
@@ -902,7 +1095,7 @@ void TriangleRenderer::createGraphicsPipeline() {
     pipelineInfo.pMultisampleState = &multisampling;
     pipelineInfo.pDepthStencilState = &depthStencil;
     pipelineInfo.pColorBlendState = &colorBlending;
-    pipelineInfo.pDynamicState = nullptr; // Optional
+    pipelineInfo.pDynamicState = &dynamicState;
 
     pipelineInfo.layout = pipelineLayout; // fixed-function stage
     pipelineInfo.renderPass = renderPass; // Can potentially swap in another render pass
@@ -914,15 +1107,126 @@ void TriangleRenderer::createGraphicsPipeline() {
     pipelineInfo.basePipelineIndex = -1;
 
     // Can make multiple pipelines at once.
-    // Second argument is a pipeline cache that can be used to store and reuse data. Advanced technique
-    if (vkCreateGraphicsPipelines(device, VK_NULL_HANDLE, 1, &pipelineInfo, nullptr, &graphicsPipeline) 
+    // The pipeline cache skips the shader compilation when an earlier run already did it
+    if (vkCreateGraphicsPipelines(device, pipelineCache, 1, &pipelineInfo, nullptr, &graphicsPipeline) 
         != VK_SUCCESS)
         throw std::runtime_error("Failed to create graphics pipeline!");
 
+    // The impostors write their own depth, which turns off early depth testing, so only their layers get that fragment shader
+    if (IMPOSTOR_MOLECULE) {
+        auto impostorShaderCode = readFile("../obj/hardcoded.frag.impostor.spv");
+        VkShaderModule impostorShaderModule = createShaderModule(impostorShaderCode);
+        shaderStages[1].module = impostorShaderModule;
+        const VkResult result = vkCreateGraphicsPipelines(device, pipelineCache, 1, &pipelineInfo, nullptr, &impostorPipeline);
+        vkDestroyShaderModule(device, impostorShaderModule, nullptr);
+        if (result != VK_SUCCESS)
+            throw std::runtime_error("Failed to create impostor graphics pipeline!");
+    }
+
     vkDestroyShaderModule(device, fragShaderModule, nullptr);
     vkDestroyShaderModule(device, vertShaderModule, nullptr);
 }
 
+void TriangleRenderer::destroyGraphicsPipeline() {
+    vkDestroyPipeline(device, graphicsPipeline, nullptr);
+    vkDestroyPipeline(device, impostorPipeline, nullptr);
+    impostorPipeline = VK_NULL_HANDLE;
+    vkDestroyPipelineLayout(device, pipelineLayout, nullptr);
+    vkDestroyRenderPass(device, renderPass, nullptr);
+}
+
+// The saved cache is prefixed by the properties of the device and driver that wrote it. Vulkan also checks the header of
+// the data, but drivers are not all strict about it and a stale cache can crash them rather than be rejected.
+struct PipelineCachePrefix {
+    uint32_t magic = 0x43505652; // "RVPC"
+    uint32_t vendorID;
+    uint32_t deviceID;
+    uint32_t driverVersion;
+    uint8_t pipelineCacheUUID[VK_UUID_SIZE];
+    uint64_t dataSize;
+};
+
+inline PipelineCachePrefix getPipelineCachePrefix(const VkPhysicalDeviceProperties& properties, const uint64_t dataSize) {
+    PipelineCachePrefix prefix{};
+    prefix.vendorID = properties.vendorID;
+    prefix.deviceID = properties.deviceID;
+    prefix.driverVersion = properties.driverVersion;
+    memcpy(prefix.pipelineCacheUUID, properties.pipelineCacheUUID, VK_UUID_SIZE);
+    prefix.dataSize = dataSize;
+    return prefix;
+}
+
+void TriangleRenderer::createPipelineCache() {
+    VkPhysicalDeviceProperties properties;
+    vkGetPhysicalDeviceProperties(physicalDevice, &properties);
+
+    // Anything missing, truncated or from another device or driver starts an empty cache
+    std::vector<char> data;
+    std::ifstream file(PIPELINE_CACHE_FILE, std::ios::binary);
+    PipelineCachePrefix prefix{};
+    if (file.read(reinterpret_cast<char*>(&prefix), sizeof(prefix))) {
+        const PipelineCachePrefix expected = getPipelineCachePrefix(properties, prefix.dataSize);
+        if (memcmp(&prefix, &expected, sizeof(prefix)) == 0 && prefix.dataSize <= (64u << 20)) {
+            data.resize((size_t)prefix.dataSize);
+            if (!file.read(data.data(), data.size()))
+                data.clear();
+        }
+    }
+
+    // The data starts with the header of VK_PIPELINE_CACHE_HEADER_VERSION_ONE: its size, version, vendor, device and UUID
+    const size_t headerSize = 16 + VK_UUID_SIZE;
+    if (data.size() >= headerSize) {
+        uint32_t header[4];
+        memcpy(header, data.data(), sizeof(header));
+        if (header[0] < headerSize || header[1] != VK_PIPELINE_CACHE_HEADER_VERSION_ONE || header[2] != properties.vendorID ||
+            header[3] != properties.deviceID || memcmp(data.data() + 16, properties.pipelineCacheUUID, VK_UUID_SIZE) != 0)
+            data.clear();
+    }
+    else
+        data.clear();
+
+    VkPipelineCacheCreateInfo cacheInfo{};
+    cacheInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO;
+    cacheInfo.initialDataSize = data.size();
+    cacheInfo.pInitialData = data.empty() ? nullptr : data.data();
+    if (vkCreatePipelineCache(device, &cacheInfo, nullptr, &pipelineCache) != VK_SUCCESS)
+        throw std::runtime_error("Failed to create pipeline cache!");
+}
+
+void TriangleRenderer::savePipelineCache() {
+    size_t dataSize = 0;
+    if (vkGetPipelineCacheData(device, pipelineCache, &dataSize, nullptr) != VK_SUCCESS || dataSize == 0)
+        return;
+    std::vector<char> data(dataSize);
+    if (vkGetPipelineCacheData(device, pipelineCache, &dataSize, data.data()) != VK_SUCCESS)
+        return;
+
+    // Not saving only costs the next start its compilation
+    VkPhysicalDeviceProperties properties;
+    vkGetPhysicalDeviceProperties(physicalDevice, &properties);
+    const PipelineCachePrefix prefix = getPipelineCachePrefix(properties, dataSize);
+
+    // Written to a file of this process, then renamed over the cache, so that runs from the same tree saving at the same
+    // time replace it in turn and a start only ever reads the whole cache of one of them
+#ifdef _WIN32
+    const int processId = _getpid();
+#else
+    const int processId = (int)getpid();
+#endif
+    const std::string temporaryFile = std::string(PIPELINE_CACHE_FILE) + "." + std::to_string(processId) + ".tmp";
+    std::ofstream file(temporaryFile, std::ios::binary | std::ios::trunc);
+    file.write(reinterpret_cast<const char*>(&prefix), sizeof(prefix));
+    file.write(data.data(), dataSize);
+    file.close();
+    std::error_code error;
+    if (file)
+        std::filesystem::rename(temporaryFile, PIPELINE_CACHE_FILE, error); // replaces an existing cache on Windows too
+    if (!file || error) {
+        std::filesystem::remove(temporaryFile, error);
+        std::cerr << "Failed to save the pipeline cache to " << PIPELINE_CACHE_FILE << std::endl;
+    }
+}
+
 // These are not the actual framebuffers, I think they are objects describing what
 // frame buffers the swap chain will render to
 void TriangleRenderer::createRenderPass() {
@@ -942,6 +1246,8 @@ void TriangleRenderer::createRenderPass() {
     // We are presenting from the swap chain so we use that one
     colorAttachment.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED; // We don't use data from existing render pass
     colorAttachment.finalLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR; // We get it from swap chain
+    if (offscreen) // copied to the read back buffer instead
+        colorAttachment.finalLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
 
     VkAttachmentDescription depthAttachment{};
     depthAttachment.format = findDepthFormat();
@@ -983,6 +1289,15 @@ void TriangleRenderer::createRenderPass() {
     dependency.dstStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT | VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT;
     dependency.dstAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
 
+    // Offscreen, the copy to the read back buffer waits for the color writes and the transition to the final layout
+    std::array<VkSubpassDependency, 2> dependencies = { dependency, {} };
+    dependencies[1].srcSubpass = 0;
+    dependencies[1].dstSubpass = VK_SUBPASS_EXTERNAL;
+    dependencies[1].srcStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
+    dependencies[1].srcAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
+    dependencies[1].dstStageMask = VK_PIPELINE_STAGE_TRANSFER_BIT;
+    dependencies[1].dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+
     std::array<VkAttachmentDescription, 2> attachments = { colorAttachment, depthAttachment };
     VkRenderPassCreateInfo renderPassInfo{};
     renderPassInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO;
@@ -990,8 +1305,8 @@ void TriangleRenderer::createRenderPass() {
     renderPassInfo.pAttachments = attachments.data(); // strange that we need attachment here too
     renderPassInfo.subpassCount = 1;
     renderPassInfo.pSubpasses = &subpass;
-    renderPassInfo.dependencyCount = 1;
-    renderPassInfo.pDependencies = &dependency;
+    renderPassInfo.dependencyCount = offscreen ? 2 : 1;
+    renderPassInfo.pDependencies = dependencies.data();
 
     if (vkCreateRenderPass(device, &renderPassInfo, nullptr, &renderPass) != VK_SUCCESS)
         throw std::runtime_error("failed to create render pass!");
@@ -1050,11 +1365,132 @@ void TriangleRenderer::createCommandBuffers() {
 
     if (vkAllocateCommandBuffers(device, &allocInfo, commandBuffers.data()) != VK_SUCCESS)
         throw std::runtime_error("Failed to allocate command buffers!");
+    commandBufferGenerations.assign(commandBuffers.size(), UINT64_MAX); // recorded when first acquired
+
+    // Secondary command buffers of the layers, a pool each since a pool is used by one thread at a time
+    layerCommandPools.resize(commandBuffers.size() * LAYER_COUNT);
+    layerCommandBuffers.resize(layerCommandPools.size());
+    layerDraws.assign(layerCommandPools.size(), {});
+    for (size_t i_layer = 0; i_layer < layerCommandPools.size(); i_layer++) {
+        VkCommandPoolCreateInfo poolInfo{};
+        poolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+        poolInfo.queueFamilyIndex = graphicsQueueFamily;
+        poolInfo.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
+        if (vkCreateCommandPool(device, &poolInfo, nullptr, &layerCommandPools[i_layer]) != VK_SUCCESS)
+            throw std::runtime_error("Failed to create layer command pool!");
+
+        VkCommandBufferAllocateInfo layerAllocInfo{};
+        layerAllocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+        layerAllocInfo.commandPool = layerCommandPools[i_layer];
+        layerAllocInfo.level = VK_COMMAND_BUFFER_LEVEL_SECONDARY; // only executed by the primary ones
+        layerAllocInfo.commandBufferCount = static_cast<uint32_t>(layerCommandBuffers[i_layer].size());
+        if (vkAllocateCommandBuffers(device, &layerAllocInfo, layerCommandBuffers[i_layer].data()) != VK_SUCCESS)
+            throw std::runtime_error("Failed to allocate layer command buffers!");
+    }
 }
 
-void TriangleRenderer::renderCommandBuffers()
+TriangleRenderer::LayerDraw TriangleRenderer::getLayerDraw(const int layer, const GeometryBuffers& geometry)
 {
-    for (size_t i = 0; i < commandBuffers.size(); i++) { 
+    // Atoms then half bonds, each the shared mesh drawn once per instance. The cylinder indices start after the sphere ones
+    // and count from the first cylinder vertex.
+    LayerDraw draw;
+    draw.constants.model = glm::mat4(1.0f); // no transformation in object space, a layer could have its own
+    if (layer == ATOM_LAYER || layer == BOND_LAYER) {
+        draw.vertexBuffer = moleculeMeshVertexBuffer;
+        draw.instanceBuffer = geometry.instanceBuffer;
+        draw.indexBuffer = moleculeMeshIndexBuffer;
+        draw.constants.vertexBounds = moleculeMeshBounds;
+        if (layer == ATOM_LAYER) {
+            draw.constants.render_type = IMPOSTOR_MOLECULE ? 4 : 2;
+            draw.indexCount = sphereIndexCount;
+            draw.instanceCount = atomInstanceCount;
+        }
+        else {
+            draw.constants.render_type = IMPOSTOR_MOLECULE ? 5 : 3;
+            draw.indexCount = moleculeMeshIndexCount - sphereIndexCount;
+            draw.instanceCount = static_cast<uint32_t>(instances.size()) - atomInstanceCount;
+            draw.firstIndex = sphereIndexCount;
+            draw.vertexOffset = static_cast<int32_t>(sphereVertexCount);
+            draw.firstInstance = atomInstanceCount;
+        }
+        if (draw.instanceCount == 0)
+            draw.indexCount = 0;
+    }
+    else {
+        // The pipeline also reads binding 1, the instance buffer is bound there but unused by these render types
+        draw.vertexBuffer = geometry.vertexBuffer;
+        draw.instanceBuffer = geometry.instanceBuffer;
+        draw.indexBuffer = geometry.indexBuffer;
+        draw.constants.vertexBounds = geometry.vertexBounds; // render types of the vertices, molecule and orbital ones mixed
+        draw.indexCount = geometry.indexCount;
+        draw.instanceCount = 1;
+    }
+    return draw;
+}
+
+void TriangleRenderer::recordLayerCommandBuffer(size_t i, const int layer, size_t i_set, const LayerDraw& draw)
+{
+    VkCommandBuffer commandBuffer = layerCommandBuffers[i * LAYER_COUNT + layer][i_set];
+
+    // Continues the render pass of the primary command buffer, in its framebuffer
+    VkCommandBufferInheritanceInfo inheritanceInfo{};
+    inheritanceInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_INFO;
+    inheritanceInfo.renderPass = renderPass;
+    inheritanceInfo.subpass = 0;
+    inheritanceInfo.framebuffer = swapChainFramebuffers[i];
+
+    VkCommandBufferBeginInfo beginInfo{};
+    beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+    beginInfo.flags = VK_COMMAND_BUFFER_USAGE_RENDER_PASS_CONTINUE_BIT;
+    beginInfo.pInheritanceInfo = &inheritanceInfo;
+    if (vkBeginCommandBuffer(commandBuffer, &beginInfo) != VK_SUCCESS)
+        throw std::runtime_error("Failed to begin recording layer command buffer!");
+
+    // Bound and dynamic state are not inherited from the primary command buffer
+    const bool impostorLayer = IMPOSTOR_MOLECULE && (layer == ATOM_LAYER || layer == BOND_LAYER);
+    vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, impostorLayer ? impostorPipeline : graphicsPipeline);
+    VkViewport viewport{};
+    viewport.x = 0.;
+    viewport.y = 0.;
+    viewport.width = (float) swapChainExtent.width; // swapChain used for framebuffers
+    viewport.height = (float) swapChainExtent.height;
+    viewport.minDepth = 0.;
+    viewport.maxDepth = 1.;
+    vkCmdSetViewport(commandBuffer, 0, 1, &viewport);
+    VkRect2D scissor{};
+    scissor.offset = {0,0};
+    scissor.extent = swapChainExtent; // Covers full image because we don't want a crop
+    vkCmdSetScissor(commandBuffer, 0, 1, &scissor);
+    vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipelineLayout, 0, 1, &descriptorSets[i], 0, nullptr);
+    VkBuffer vertexBuffers[] = {draw.vertexBuffer, draw.instanceBuffer};
+    VkDeviceSize offsets[] = {0, 0};
+    vkCmdBindVertexBuffers(commandBuffer, 0, 2, vertexBuffers, offsets);
+    vkCmdBindIndexBuffer(commandBuffer, draw.indexBuffer, 0, VK_INDEX_TYPE_UINT32);
+    vkCmdPushConstants(commandBuffer, pipelineLayout, VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_FRAGMENT_BIT, 0, sizeof(DrawConstants), &draw.constants);
+    vkCmdDrawIndexed(commandBuffer, draw.indexCount, draw.instanceCount, draw.firstIndex, draw.vertexOffset, draw.firstInstance);
+    if (vkEndCommandBuffer(commandBuffer) != VK_SUCCESS)
+        throw std::runtime_error("Failed to record layer command buffer!");
+    layerDraws[i * LAYER_COUNT + layer][i_set] = draw;
+}
+
+void TriangleRenderer::recordCommandBuffers(const std::vector<size_t>& images)
+{
+    const size_t i_set = geometryGeneration % geometryBuffers.size();
+    std::array<LayerDraw, LAYER_COUNT> draws;
+    for (int layer = 0; layer < LAYER_COUNT; layer++)
+        draws[layer] = getLayerDraw(layer, geometryBuffers[i_set]);
+
+    // Only the layers whose draw changed since their command buffer for this set was recorded, on worker threads
+    std::vector<std::pair<size_t, int>> changedLayers;
+    for (size_t i : images)
+        for (int layer = 0; layer < LAYER_COUNT; layer++)
+            if (draws[layer].indexCount > 0 && !(layerDraws[i * LAYER_COUNT + layer][i_set] == draws[layer]))
+                changedLayers.emplace_back(i, layer);
+    ThreadPool::parallelFor(static_cast<int>(changedLayers.size()), [&](const int i_task) {
+        recordLayerCommandBuffer(changedLayers[i_task].first, changedLayers[i_task].second, i_set, draws[changedLayers[i_task].second]);
+    });
+
+    for (size_t i : images) {
         VkCommandBufferBeginInfo beginInfo{};
         beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
         beginInfo.flags = 0; // need to set these for special types of behavior
@@ -1064,7 +1500,6 @@ void TriangleRenderer::renderCommandBuffers()
         if (vkBeginCommandBuffer(commandBuffers[i], &beginInfo) != VK_SUCCESS)
             throw std::runtime_error("Failed to begin recording command buffer!");
 
-      
         VkRenderPassBeginInfo renderPassInfo{};
         renderPassInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
         renderPassInfo.renderPass = renderPass;
@@ -1082,27 +1517,61 @@ void TriangleRenderer::renderCommandBuffers()
         renderPassInfo.clearValueCount = static_cast<uint32_t>(clearValues.size());
         renderPassInfo.pClearValues = clearValues.data();
 
-        // Does the render pass
-        vkCmdBeginRenderPass(commandBuffers[i], &renderPassInfo, VK_SUBPASS_CONTENTS_INLINE);
-        // Binds the pipeline to the command buffer
-        vkCmdBindPipeline(commandBuffers[i], VK_PIPELINE_BIND_POINT_GRAPHICS, graphicsPipeline);
-
-        // Need to bind vertex buffer to command buffer :)
-        VkBuffer vertexBuffers[] = {vertexBuffer};
-        VkDeviceSize offsets[] = {0};
-        vkCmdBindVertexBuffers(commandBuffers[i], 0, 1, vertexBuffers, offsets);
-        vkCmdBindIndexBuffer(commandBuffers[i], indexBuffer, 0, VK_INDEX_TYPE_UINT32);
-        vkCmdBindDescriptorSets(commandBuffers[i], VK_PIPELINE_BIND_POINT_GRAPHICS, pipelineLayout, 0, 1, &descriptorSets[i], 0, nullptr);
-        // Draws the triangle: nvertices, num_instances, vertex offset, instance offset
-        /* vkCmdDraw(commandBuffers[i], static_cast<uint32_t>(vertices.size()), 1, 0, 0); */
-        // The command buffer has the vertex buffer so it knows what to draw with the indices
-        vkCmdDrawIndexed(commandBuffers[i], static_cast<uint32_t>(indices.size()), 1, 0, 0,0);
+        // Does the render pass, the draws are all in the layer command buffers
+        vkCmdBeginRenderPass(commandBuffers[i], &renderPassInfo, VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS);
+        std::vector<VkCommandBuffer> layers;
+        for (int layer = 0; layer < LAYER_COUNT; layer++)
+            if (draws[layer].indexCount > 0)
+                layers.push_back(layerCommandBuffers[i * LAYER_COUNT + layer][i_set]);
+        if (!layers.empty())
+            vkCmdExecuteCommands(commandBuffers[i], static_cast<uint32_t>(layers.size()), layers.data());
         vkCmdEndRenderPass(commandBuffers[i]);
+
+        if (offscreen) {
+            // The render pass dependency orders the copy after the color writes, the barrier makes it visible to the host
+            VkBufferImageCopy region{};
+            region.bufferOffset = 0;
+            region.bufferRowLength = 0; // tightly packed
+            region.bufferImageHeight = 0;
+            region.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+            region.imageSubresource.mipLevel = 0;
+            region.imageSubresource.baseArrayLayer = 0;
+            region.imageSubresource.layerCount = 1;
+            region.imageOffset = { 0, 0, 0 };
+            region.imageExtent = { swapChainExtent.width, swapChainExtent.height, 1 };
+            vkCmdCopyImageToBuffer(commandBuffers[i], swapChainImages[i], VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, readbackBuffers[i], 1, &region);
+
+            VkBufferMemoryBarrier barrier{};
+            barrier.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+            barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+            barrier.dstAccessMask = VK_ACCESS_HOST_READ_BIT;
+            barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+            barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+            barrier.buffer = readbackBuffers[i];
+            barrier.offset = 0;
+            barrier.size = VK_WHOLE_SIZE;
+            vkCmdPipelineBarrier(commandBuffers[i], VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_HOST_BIT, 0, 0, nullptr, 1, &barrier, 0, nullptr);
+        }
         if (vkEndCommandBuffer(commandBuffers[i]) != VK_SUCCESS)
             throw std::runtime_error("Failed to record command buffer!");
+        commandBufferGenerations[i] = geometryGeneration;
     }
 }
 
+void TriangleRenderer::recordCommandBuffer(size_t i)
+{
+    recordCommandBuffers({ i });
+}
+
+// Records every command buffer, when none is in flight
+void TriangleRenderer::renderCommandBuffers()
+{
+    std::vector<size_t> images(commandBuffers.size());
+    for (size_t i = 0; i < images.size(); i++)
+        images[i] = i;
+    recordCommandBuffers(images);
+}
+
 // Drawing
 
 void TriangleRenderer::createSyncObjects() {
@@ -1130,31 +1599,22 @@ void TriangleRenderer::createSyncObjects() {
 
 // Vertex Buffer
 
-// returns the index of the memory type in the physical device that satisfies the
-// flags in typeFilter and the properties in properties
-uint32_t TriangleRenderer::findMemoryType(uint32_t typeFilter, VkMemoryPropertyFlags properties) {
-    // query available memory types in GPU
-    VkPhysicalDeviceMemoryProperties memProperties;
-    vkGetPhysicalDeviceMemoryProperties(physicalDevice, &memProperties);
-    // there are memoryTypes and memoryHeaps, but this is where it gets pretty complicated
-    for (uint32_t i = 0; i < memProperties.memoryTypeCount; i++) { 
-        // memory type i must be one of the allowed ones
-        bool satisfiesType = typeFilter & (1 << i); 
-        // all our desired properties must be satisfied
-        bool satisfiesProperties = (memProperties.memoryTypes[i].propertyFlags & properties)  == properties;
-        if (satisfiesType && satisfiesProperties)
-            return i;
-    }
-    throw std::runtime_error("Failed to find a suitable memory type");
-}
-
-void TriangleRenderer::createBuffer(VkDeviceSize size, VkBufferUsageFlags usage, VkMemoryPropertyFlags properties, VkBuffer& buffer, VkDeviceMemory& bufferMemory) {
+void TriangleRenderer::createBuffer(VkDeviceSize size, VkBufferUsageFlags usage, VkMemoryPropertyFlags properties, VkBuffer& buffer, MemoryAllocation& bufferMemory,
+                                    DeviceMemoryAllocator::Strategy strategy) {
     VkBufferCreateInfo bufferInfo{};
     bufferInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
     bufferInfo.size = size;
     bufferInfo.usage = usage; // different types of buffers
     bufferInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE; // we want only the graphics queue to use this buffer
     bufferInfo.flags = 0; // configures sparse buffer memory if needed
+    // Buffers written by the transfer queue and read by the graphics one are shared by both families, which saves the
+    // ownership transfer barriers on each queue
+    const uint32_t sharingFamilies[] = {graphicsQueueFamily, transferQueueFamily};
+    if ((usage & VK_BUFFER_USAGE_TRANSFER_DST_BIT) && graphicsQueueFamily != transferQueueFamily) {
+        bufferInfo.sharingMode = VK_SHARING_MODE_CONCURRENT;
+        bufferInfo.queueFamilyIndexCount = 2;
+        bufferInfo.pQueueFamilyIndices = sharingFamilies;
+    }
 
     if (vkCreateBuffer(device, &bufferInfo, nullptr, &buffer) != VK_SUCCESS)
         throw std::runtime_error("Failed to create buffer!");
@@ -1165,73 +1625,239 @@ void TriangleRenderer::createBuffer(VkDeviceSize size, VkBufferUsageFlags usage,
     VkMemoryRequirements memRequirements;
     vkGetBufferMemoryRequirements(device, buffer, &memRequirements);
 
-    // We allow any memory type in GPU and we require
-    // memory to be able to map to CPU memory and be "coherent". Don't know why yet
-    VkMemoryAllocateInfo allocInfo{};
-    allocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-    allocInfo.allocationSize = memRequirements.size;
-    allocInfo.memoryTypeIndex = findMemoryType(memRequirements.memoryTypeBits, properties);
-    /* allocInfo.memoryTypeIndex = findMemoryType(0, 0); */
-
-    if (vkAllocateMemory(device, &allocInfo, nullptr, &bufferMemory) != VK_SUCCESS)
-        throw std::runtime_error("Failed to allocate buffer memory!");
-    vkBindBufferMemory(device, buffer, bufferMemory, 0); // offset must be divisible by alignment
+    // A sub-range of a larger block of a memory type with the properties
+    bufferMemory = memoryAllocator.allocate(memRequirements, properties, strategy, false);
+    vkBindBufferMemory(device, buffer, bufferMemory.memory, bufferMemory.offset); // offset must be divisible by alignment
 }
 
-void TriangleRenderer::createVertexBuffer()
+void TriangleRenderer::createDeviceLocalBuffer(const void* data, VkDeviceSize size, VkBufferUsageFlags usage, VkBuffer& buffer, MemoryAllocation& bufferMemory)
 {
-    VkDeviceSize bufferSize = sizeof(vertices[0])*vertices.size();
-
     // Will want to copy from CPU to GPU staging buffer and then later copy from
-    // staging buffer to actual vertex buffer, which uses unmappable but faster GPU memory
+    // staging buffer to actual buffer, which uses unmappable but faster GPU memory
+    // Buffers cannot be empty, a frame without isosurface still gets a small one that nothing reads
+    VkDeviceSize bufferSize = std::max<VkDeviceSize>(size, 4);
     VkBuffer stagingBuffer;
-    VkDeviceMemory stagingBufferMemory;
-    createBuffer(bufferSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, stagingBuffer, stagingBufferMemory);
-    // Copy vertices into buffer memory
-    // Gives us a pointer to the buffer memory I think, but maybe also allocates it?
-    void *data;
-    vkMapMemory(device, stagingBufferMemory, 0, bufferSize, 0, &data);
-    memcpy(data, vertices.data(), (size_t) bufferSize);
-    vkUnmapMemory(device, stagingBufferMemory);
+    MemoryAllocation stagingBufferMemory;
+    createBuffer(bufferSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, stagingBuffer, stagingBufferMemory, DeviceMemoryAllocator::Strategy::Linear);
+    // Copy the data into buffer memory, host visible blocks stay mapped
+    if (size > 0)
+        memcpy(stagingBufferMemory.mapped, data, (size_t) size);
 
     // Want device-local after the transfer
-    createBuffer(bufferSize, VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_VERTEX_BUFFER_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, vertexBuffer, vertexBufferMemory);
+    createBuffer(bufferSize, VK_BUFFER_USAGE_TRANSFER_DST_BIT | usage, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, buffer, bufferMemory);
     // NOTE: driver might not actually write to memory right away, so to guarantee that it does we
     // use host coherence and don't worry about that weird case.
     // Another solution is to explicitly flush the memory afterwards and before reading
     // Driver transfers data between CPU and GPU on the backend, which is pretty cool.
 
-    copyBuffer(stagingBuffer, vertexBuffer, bufferSize);
-    vkDestroyBuffer(device, stagingBuffer, nullptr);
-    vkFreeMemory(device, stagingBufferMemory, nullptr);
+    // Goes with the next upload submission, the staging buffer is freed once it is done
+    VkBufferCopy copyRegion{};
+    copyRegion.srcOffset = 0;
+    copyRegion.dstOffset = 0;
+    copyRegion.size = bufferSize;
+    vkCmdCopyBuffer(getUploadCommandBuffer(), stagingBuffer, buffer, 1, &copyRegion);
+    uploadStagingBuffers[currentUpload].emplace_back(stagingBuffer, stagingBufferMemory);
 }
 
-void TriangleRenderer::createIndexBuffer()
+void TriangleRenderer::createStagingRing(VkDeviceSize size)
 {
-    VkDeviceSize bufferSize = sizeof(indices[0])*indices.size();
+    stagingRingCapacity = size;
+    stagingRingHead = 0;
+    createBuffer(size, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, stagingRingBuffer, stagingRingMemory);
+    // The allocator keeps it mapped, coherent so that the copies see the writes without flushing
+}
 
-    // Will want to copy from CPU to GPU staging buffer and then later copy from
-    // staging buffer to actual index buffer, which uses unmappable but faster GPU memory
-    VkBuffer stagingBuffer;
-    VkDeviceMemory stagingBufferMemory;
-    createBuffer(bufferSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, stagingBuffer, stagingBufferMemory);
-    // Copy vertices into buffer memory
-    // Gives us a pointer to the buffer memory I think, but maybe also allocates it?
-    void *data;
-    vkMapMemory(device, stagingBufferMemory, 0, bufferSize, 0, &data);
-    memcpy(data, indices.data(), (size_t) bufferSize);
-    vkUnmapMemory(device, stagingBufferMemory);
+void TriangleRenderer::createUploadCommandBuffers()
+{
+    uploadCommandBuffers.resize(UPLOADS_IN_FLIGHT);
+    uploadFences.resize(UPLOADS_IN_FLIGHT);
+    uploadSemaphores.resize(UPLOADS_IN_FLIGHT);
+    uploadSemaphoreWaitFences.assign(UPLOADS_IN_FLIGHT, VK_NULL_HANDLE);
+    uploadStagingBuffers.resize(UPLOADS_IN_FLIGHT);
 
-    // Want device-local after the transfer
-    createBuffer(bufferSize, VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_INDEX_BUFFER_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, indexBuffer, indexBufferMemory);
-    // NOTE: driver might not actually write to memory right away, so to guarantee that it does we
-    // use host coherence and don't worry about that weird case.
-    // Another solution is to explicitly flush the memory afterwards and before reading
-    // Driver transfers data between CPU and GPU on the backend, which is pretty cool.
+    // The copies go to the transfer queue, from a pool of its family
+    VkCommandPoolCreateInfo poolInfo{};
+    poolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+    poolInfo.queueFamilyIndex = transferQueueFamily;
+    poolInfo.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
+    if (vkCreateCommandPool(device, &poolInfo, nullptr, &transferCommandPool) != VK_SUCCESS)
+        throw std::runtime_error("Failed to create transfer command pool!");
+
+    VkCommandBufferAllocateInfo allocInfo{};
+    allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+    allocInfo.commandPool = transferCommandPool;
+    allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+    allocInfo.commandBufferCount = static_cast<uint32_t>(uploadCommandBuffers.size());
+    if (vkAllocateCommandBuffers(device, &allocInfo, uploadCommandBuffers.data()) != VK_SUCCESS)
+        throw std::runtime_error("Failed to allocate upload command buffers!");
+
+    VkFenceCreateInfo fenceInfo{};
+    fenceInfo.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+    fenceInfo.flags = VK_FENCE_CREATE_SIGNALED_BIT; // no upload pending at first
+    for (VkFence& uploadFence : uploadFences)
+        if (vkCreateFence(device, &fenceInfo, nullptr, &uploadFence) != VK_SUCCESS)
+            throw std::runtime_error("Failed to create upload fence!");
 
-    copyBuffer(stagingBuffer, indexBuffer, bufferSize);
-    vkDestroyBuffer(device, stagingBuffer, nullptr);
-    vkFreeMemory(device, stagingBufferMemory, nullptr);
+    VkSemaphoreCreateInfo semaphoreInfo{};
+    semaphoreInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+    for (VkSemaphore& uploadSemaphore : uploadSemaphores)
+        if (vkCreateSemaphore(device, &semaphoreInfo, nullptr, &uploadSemaphore) != VK_SUCCESS)
+            throw std::runtime_error("Failed to create upload semaphore!");
+}
+
+VkCommandBuffer TriangleRenderer::getUploadCommandBuffer()
+{
+    VkCommandBuffer commandBuffer = uploadCommandBuffers[currentUpload];
+    if (!uploadRecording) {
+        // The last upload from this command buffer has to be done before it is recorded again, and the submission
+        // that waited its semaphore too before the semaphore is signalled again
+        releaseUpload(currentUpload);
+        if (uploadSemaphoreWaitFences[currentUpload] != VK_NULL_HANDLE) {
+            vkWaitForFences(device, 1, &uploadSemaphoreWaitFences[currentUpload], VK_TRUE, UINT64_MAX);
+            uploadSemaphoreWaitFences[currentUpload] = VK_NULL_HANDLE;
+        }
+        VkCommandBufferBeginInfo beginInfo{};
+        beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+        beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+        vkBeginCommandBuffer(commandBuffer, &beginInfo);
+        uploadRecording = true;
+    }
+    return commandBuffer;
+}
+
+void TriangleRenderer::stageBufferUpdate(const void* data, VkDeviceSize size, VkBufferUsageFlags usage, VkBuffer& buffer, MemoryAllocation& bufferMemory, VkDeviceSize& capacity)
+{
+    if (size > capacity || capacity == 0) {
+        // Grows geometrically, so that a growing trajectory reallocates a few times only. Draws in flight may still read
+        // the old buffer, and it cannot be empty.
+        if (capacity > 0) {
+            submitBufferUpdates();
+            vkDeviceWaitIdle(device);
+            vkDestroyBuffer(device, buffer, nullptr);
+            memoryAllocator.free(bufferMemory);
+            // The layer command buffers that bind it are invalid now, and the new buffer may get the same handle
+            for (auto& draws : layerDraws)
+                draws = {};
+        }
+        capacity = std::max<VkDeviceSize>({ size, 2 * capacity, 4 });
+        createBuffer(capacity, VK_BUFFER_USAGE_TRANSFER_DST_BIT | usage, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, buffer, bufferMemory);
+    }
+    if (size == 0)
+        return;
+
+    if (stagingRingHead + size > stagingRingCapacity) {
+        // The recorded copies read the ring, once they and every earlier upload are done all of it is free
+        submitBufferUpdates();
+        waitForBufferUpdates();
+        stagingRingHead = 0;
+        if (size > stagingRingCapacity) {
+            vkDestroyBuffer(device, stagingRingBuffer, nullptr);
+            memoryAllocator.free(stagingRingMemory);
+            createStagingRing(std::max(size, 2 * stagingRingCapacity));
+        }
+    }
+    memcpy(static_cast<char*>(stagingRingMemory.mapped) + stagingRingHead, data, (size_t) size);
+
+    VkBufferCopy copyRegion{};
+    copyRegion.srcOffset = stagingRingHead;
+    copyRegion.dstOffset = 0;
+    copyRegion.size = size;
+    vkCmdCopyBuffer(getUploadCommandBuffer(), stagingRingBuffer, buffer, 1, &copyRegion);
+
+    const VkDeviceSize copyAlignment = 16;
+    stagingRingHead = (stagingRingHead + size + copyAlignment - 1) / copyAlignment * copyAlignment;
+}
+
+void TriangleRenderer::submitBufferUpdates()
+{
+    if (!uploadRecording)
+        return;
+    VkCommandBuffer commandBuffer = uploadCommandBuffers[currentUpload];
+    vkEndCommandBuffer(commandBuffer);
+
+    // The next draw waits the semaphore before reading vertices, its wait makes the copies visible. Uploads submitted
+    // before that draw wait each other in turn, so that only the last one has a semaphore pending.
+    VkSubmitInfo submitInfo{};
+    submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+    submitInfo.commandBufferCount = 1;
+    submitInfo.pCommandBuffers = &commandBuffer;
+    const VkPipelineStageFlags waitStage = VK_PIPELINE_STAGE_TRANSFER_BIT;
+    if (pendingUpload >= 0) {
+        submitInfo.waitSemaphoreCount = 1;
+        submitInfo.pWaitSemaphores = &uploadSemaphores[pendingUpload];
+        submitInfo.pWaitDstStageMask = &waitStage;
+        uploadSemaphoreWaitFences[pendingUpload] = uploadFences[currentUpload];
+    }
+    submitInfo.signalSemaphoreCount = 1;
+    submitInfo.pSignalSemaphores = &uploadSemaphores[currentUpload];
+    vkResetFences(device, 1, &uploadFences[currentUpload]);
+    if (vkQueueSubmit(transferQueue, 1, &submitInfo, uploadFences[currentUpload]) != VK_SUCCESS)
+        throw std::runtime_error("Failed to submit buffer updates!");
+
+    uploadRecording = false;
+    pendingUpload = static_cast<int>(currentUpload);
+    currentUpload = (currentUpload + 1) % uploadCommandBuffers.size();
+}
+
+// Waits for the upload and frees its staging buffers
+void TriangleRenderer::releaseUpload(size_t i_upload)
+{
+    vkWaitForFences(device, 1, &uploadFences[i_upload], VK_TRUE, UINT64_MAX);
+    for (auto& stagingBuffer : uploadStagingBuffers[i_upload]) {
+        vkDestroyBuffer(device, stagingBuffer.first, nullptr);
+        memoryAllocator.free(stagingBuffer.second);
+    }
+    uploadStagingBuffers[i_upload].clear();
+}
+
+void TriangleRenderer::waitForBufferUpdates()
+{
+    for (size_t i_upload = 0; i_upload < uploadCommandBuffers.size(); i_upload++)
+        releaseUpload(i_upload);
+}
+
+void TriangleRenderer::uploadVertexBuffer(GeometryBuffers& geometry)
+{
+    if (COMPACT_VERTICES) {
+        MeshRenderer::compactVertices(vertices, compactVertices, geometry.vertexBounds);
+        stageBufferUpdate(compactVertices.data(), sizeof(compactVertices[0])*compactVertices.size(), VK_BUFFER_USAGE_VERTEX_BUFFER_BIT, geometry.vertexBuffer, geometry.vertexBufferMemory, geometry.vertexBufferCapacity);
+    }
+    else
+        stageBufferUpdate(vertices.data(), sizeof(vertices[0])*vertices.size(), VK_BUFFER_USAGE_VERTEX_BUFFER_BIT, geometry.vertexBuffer, geometry.vertexBufferMemory, geometry.vertexBufferCapacity);
+}
+
+void TriangleRenderer::uploadIndexBuffer(GeometryBuffers& geometry)
+{
+    stageBufferUpdate(indices.data(), sizeof(indices[0])*indices.size(), VK_BUFFER_USAGE_INDEX_BUFFER_BIT, geometry.indexBuffer, geometry.indexBufferMemory, geometry.indexBufferCapacity);
+    geometry.indexCount = static_cast<uint32_t>(indices.size());
+}
+
+// Uploaded once, the same for every frame
+void TriangleRenderer::createMoleculeMeshBuffers()
+{
+    std::vector<Vertex> meshVertices;
+    std::vector<uint32_t> meshIndices;
+    MeshRenderer::getMoleculeMeshes(IMPOSTOR_MOLECULE, meshVertices, meshIndices, sphereVertexCount, sphereIndexCount);
+    moleculeMeshIndexCount = static_cast<uint32_t>(meshIndices.size());
+
+    if (COMPACT_VERTICES) {
+        std::vector<CompactVertex> compactMeshVertices;
+        MeshRenderer::compactVertices(meshVertices, compactMeshVertices, moleculeMeshBounds);
+        createDeviceLocalBuffer(compactMeshVertices.data(), sizeof(compactMeshVertices[0])*compactMeshVertices.size(), VK_BUFFER_USAGE_VERTEX_BUFFER_BIT, moleculeMeshVertexBuffer, moleculeMeshVertexBufferMemory);
+    }
+    else
+        createDeviceLocalBuffer(meshVertices.data(), sizeof(meshVertices[0])*meshVertices.size(), VK_BUFFER_USAGE_VERTEX_BUFFER_BIT, moleculeMeshVertexBuffer, moleculeMeshVertexBufferMemory);
+    createDeviceLocalBuffer(meshIndices.data(), sizeof(meshIndices[0])*meshIndices.size(), VK_BUFFER_USAGE_INDEX_BUFFER_BIT, moleculeMeshIndexBuffer, moleculeMeshIndexBufferMemory);
+}
+
+void TriangleRenderer::uploadInstanceBuffer(GeometryBuffers& geometry)
+{
+    // At least one instance, the orbital draw reads binding 1 for its single instance
+    const MoleculeInstance unused{};
+    if (instances.empty())
+        stageBufferUpdate(&unused, sizeof(unused), VK_BUFFER_USAGE_VERTEX_BUFFER_BIT, geometry.instanceBuffer, geometry.instanceBufferMemory, geometry.instanceBufferCapacity);
+    else
+        stageBufferUpdate(instances.data(), sizeof(instances[0])*instances.size(), VK_BUFFER_USAGE_VERTEX_BUFFER_BIT, geometry.instanceBuffer, geometry.instanceBufferMemory, geometry.instanceBufferCapacity);
 }
 
 void TriangleRenderer::updateVertexAndIndexBuffer(float time)
@@ -1251,58 +1877,70 @@ void TriangleRenderer::updateVertexAndIndexBuffer(float time)
     else
         last_frame_rendered = i_frame;
 
+    updateGeometry(i_frame);
+}
+
+void TriangleRenderer::updateGeometry(int i_frame)
+{
     vertices.clear();
     indices.clear();
-    MeshRenderer::renderMolecule(trajectory[i_frame], vertices, indices);
-    MeshRenderer::renderOrbital(trajectory[i_frame], vertices, indices);
-
-    vkDestroyBuffer(device, vertexBuffer, nullptr);
-    vkFreeMemory(device, vertexBufferMemory, nullptr);
-    vkDestroyBuffer(device, indexBuffer, nullptr);
-    vkFreeMemory(device, indexBufferMemory, nullptr);
-
-    createVertexBuffer();
-    createIndexBuffer();
-
-    renderCommandBuffers();
+    instances.clear();
+    if (INSTANCED_MOLECULE) {
+        MeshRenderer::renderMoleculeInstances(trajectory[i_frame], instances);
+        atomInstanceCount = static_cast<uint32_t>(trajectory[i_frame]->n_atom);
+    }
+    else
+        MeshRenderer::renderMolecule(trajectory[i_frame], vertices, indices);
+    const size_t i_first_orbital_vertex = vertices.size(), i_first_orbital_index = indices.size();
+    MeshRenderer::renderOrbital<RENDERED_PRECISION>(trajectory[i_frame], vertices, indices, RENDERED_FIELD, RENDERED_MESHER);
+    if (ORBITAL_TRIANGLE_BUDGET > 0 || ORBITAL_SIMPLIFICATION_ERROR > 0)
+        MeshSimplifier::simplifyMesh(vertices, indices, i_first_orbital_index, ORBITAL_TRIANGLE_BUDGET, ORBITAL_SIMPLIFICATION_ERROR);
+    // Only the level of detail drawn at the current resolution is simplified down to and uploaded, after the molecule indices
+    const size_t orbitalTriangleCount = (indices.size() - i_first_orbital_index) / 3;
+    const int surfaceLevel = selectSurfaceLevel(i_first_orbital_vertex, orbitalTriangleCount);
+    if (surfaceLevel > 0)
+        MeshSimplifier::simplifyMesh(vertices, indices, i_first_orbital_index, orbitalTriangleCount >> surfaceLevel, 0.0f);
+    if (ORBITAL_TRIANGLE_BUDGET > 0 || ORBITAL_SIMPLIFICATION_ERROR > 0 || surfaceLevel > 0)
+        MeshSimplifier::removeUnusedVertices(vertices, indices, i_first_orbital_vertex, i_first_orbital_index);
+
+    // Frames in flight keep drawing the current set of buffers while the other one is written. Only the frames that still
+    // draw the other set, recorded two generations ago, are waited. The fence of the current frame is already signalled.
+    const size_t next = (geometryGeneration + 1) % geometryBuffers.size();
+    for (size_t i = 0; i < commandBuffers.size(); i++)
+        if (commandBufferGenerations[i] != UINT64_MAX && commandBufferGenerations[i] % geometryBuffers.size() == next && imagesInFlight[i] != VK_NULL_HANDLE)
+            vkWaitForFences(device, 1, &imagesInFlight[i], VK_TRUE, UINT64_MAX);
+
+    uploadVertexBuffer(geometryBuffers[next]);
+    uploadIndexBuffer(geometryBuffers[next]);
+    uploadInstanceBuffer(geometryBuffers[next]);
+    submitBufferUpdates();
+
+    // Command buffers are recorded again with the new set when their image is next drawn
+    geometryGeneration++;
 }
 
-// need to use command buffers to transfer the vertices from staging buffer to vertex buffer
-void TriangleRenderer::copyBuffer(VkBuffer srcBuffer, VkBuffer dstBuffer, VkDeviceSize size) {
-    VkCommandBufferAllocateInfo allocInfo{};
-    allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
-    allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
-    allocInfo.commandPool = commandPool; // potentially make new pool for transient commands
-    allocInfo.commandBufferCount = 1;
-
-    VkCommandBuffer commandBuffer;
-    vkAllocateCommandBuffers(device, &allocInfo, &commandBuffer);
-    
-    VkCommandBufferBeginInfo beginInfo{};
-    beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
-    beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT; // We only intend to use this once
-
-    vkBeginCommandBuffer(commandBuffer, &beginInfo);
-
-    // specifies where and how much to copy
-    VkBufferCopy copyRegion{};
-    copyRegion.srcOffset = 0;
-    copyRegion.dstOffset = 0;
-    copyRegion.size = size;
-    vkCmdCopyBuffer(commandBuffer, srcBuffer, dstBuffer, 1, &copyRegion);
-    vkEndCommandBuffer(commandBuffer);
-
-    // execute the command buffer
-    VkSubmitInfo submitInfo{};
-    submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
-    submitInfo.commandBufferCount = 1;
-    submitInfo.pCommandBuffers = &commandBuffer;
-
-    // want to transfer immediately, without waiting for other commands to execute
-    vkQueueSubmit(graphicsQueue, 1, &submitInfo, VK_NULL_HANDLE);
-    vkQueueWaitIdle(graphicsQueue); // fences might be more efficient if multiple memory transfers at once
+int TriangleRenderer::selectSurfaceLevel(const size_t i_first_orbital_vertex, const size_t orbitalTriangleCount)
+{
+    if (ORBITAL_LOD_LEVELS <= 1 || orbitalTriangleCount == 0)
+        return 0;
 
-    vkFreeCommandBuffers(device, commandPool, 1, &commandBuffer);
+    glm::vec3 lower(INFINITY), upper(-INFINITY);
+    for (size_t i_vertex = i_first_orbital_vertex; i_vertex < vertices.size(); i_vertex++) {
+        lower = glm::min(lower, vertices[i_vertex].pos);
+        upper = glm::max(upper, vertices[i_vertex].pos);
+    }
+    const float radius = glm::length(upper - lower) * 0.5f;
+    const float distance = glm::length((lower + upper) * 0.5f - CAMERA_POSITION);
+    if (distance <= radius)
+        return 0;
+
+    // Radius in pixels of the sphere around the isosurfaces, projected at the vertical field of view
+    const float pixelRadius = radius / (distance * tanf(CAMERA_FIELD_OF_VIEW / 2)) * (swapChainExtent.height / 2.0f);
+    const float triangleBudget = std::max(1.0f, glm::pi<float>() * pixelRadius * pixelRadius / ORBITAL_LOD_PIXELS_PER_TRIANGLE);
+    int level = 0;
+    while (level + 1 < ORBITAL_LOD_LEVELS && (orbitalTriangleCount >> (level + 1)) >= triangleBudget)
+        level++;
+    return level;
 }
 
 // Model View Projection
@@ -1325,42 +1963,35 @@ void TriangleRenderer::createDescriptorSetLayout() {
         throw std::runtime_error("Failed to create descriptor set layout!");
 }
 
-// There is one uniform buffer for every swap chain image
+// There is one uniform slice for every swap chain image, all in one buffer that stays mapped
 void TriangleRenderer::createUniformBuffers() {
-    VkDeviceSize bufferSize = sizeof(UniformBufferObject);
-    uniformBuffers.resize(swapChainImages.size());
-    uniformBuffersMemory.resize(swapChainImages.size());
+    VkPhysicalDeviceProperties deviceProperties;
+    vkGetPhysicalDeviceProperties(physicalDevice, &deviceProperties);
+    const VkDeviceSize alignment = std::max<VkDeviceSize>(deviceProperties.limits.minUniformBufferOffsetAlignment, 1);
+    uniformBufferStride = (sizeof(UniformBufferObject) + alignment - 1) / alignment * alignment;
 
-    for (size_t i = 0; i < swapChainImages.size(); i++) { 
-        // These bits necessary for direct transfer between host and device
-        createBuffer(bufferSize, VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, uniformBuffers[i], uniformBuffersMemory[i]);
-    }
+    // These bits necessary for direct transfer between host and device
+    createBuffer(uniformBufferStride * swapChainImages.size(), VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, uniformBuffer, uniformBufferMemory);
 }
 
 void TriangleRenderer::updateUniformBuffer(float time, uint32_t currentImage) {
 
     UniformBufferObject ubo{};
-    // Rotation of identity about the z axis of 90 degrees
-
-    //ubo.model = glm::rotate(glm::mat4(1.0f), time * glm::radians(90.0f), glm::vec3(0.,0.,1.)); // rotation
-    ubo.model = glm::mat4(1.0f); // no transformation in object space
+    // The model transform is pushed with each draw, see getLayerDraw
 
-    ubo.camera_pos = glm::vec3(0., 1., 7.); // Cannot be the same as the up vector in lookAt()
+    ubo.camera_pos = CAMERA_POSITION;
 
     // eye, point, and up vector. We never have to change our up :)
     ubo.view = glm::lookAt(ubo.camera_pos, glm::vec3(0., 0., 0.), glm::vec3(0., 0., 1.));
     // perspective projection with 45 degree FOV, the window aspect ratio, and z = 1, 20 as the near and far planes
-    ubo.proj = glm::perspective(glm::radians(45.f), swapChainExtent.width / (float) swapChainExtent.height, 1.0f, 20.f); // 20 is the max depth of view
+    ubo.proj = glm::perspective(CAMERA_FIELD_OF_VIEW, swapChainExtent.width / (float) swapChainExtent.height, 1.0f, 20.f); // 20 is the max depth of view
     ubo.proj[1][1] *= -1; // glm was designed for OpenGL, and in Vulkan -1 is the top and 1 is the bottom
 
     ubo.light_pos = ubo.camera_pos + glm::vec3(5,5,0);
     ubo.light_color = glm::vec3{ 1,1,1 };
 
-    void* data;
-    vkMapMemory(device, uniformBuffersMemory[currentImage], 0, sizeof(ubo), 0, &data);
-    memcpy(data, &ubo, sizeof(ubo));
-    vkUnmapMemory(device, uniformBuffersMemory[currentImage]);
-    // push constants are more efficient but I don't think this is a problem
+    // The fence of the image is signalled, nothing reads its slice
+    memcpy(static_cast<char*>(uniformBufferMemory.mapped) + currentImage * uniformBufferStride, &ubo, sizeof(ubo));
 
 }
 
@@ -1396,8 +2027,8 @@ void TriangleRenderer::createDescriptorSets() {
     // descriptors need to be configured. These are uniform buffer descriptors.
     for (size_t i = 0; i < swapChainImages.size(); i++) { 
         VkDescriptorBufferInfo bufferInfo{};
-        bufferInfo.buffer = uniformBuffers[i];
-        bufferInfo.offset = 0;
+        bufferInfo.buffer = uniformBuffer;
+        bufferInfo.offset = i * uniformBufferStride;
         bufferInfo.range = sizeof(UniformBufferObject);
 
         VkWriteDescriptorSet descriptorWrite{};
@@ -1473,7 +2104,7 @@ VkImageView TriangleRenderer::createImageView(VkImage image, VkFormat format, Vk
     return imageView;
 }
 
-void TriangleRenderer::createImage(uint32_t width, uint32_t height, VkFormat format, VkImageTiling tiling, VkImageUsageFlags usage, VkMemoryPropertyFlags properties, VkImage& image, VkDeviceMemory& imageMemory) {
+void TriangleRenderer::createImage(uint32_t width, uint32_t height, VkFormat format, VkImageTiling tiling, VkImageUsageFlags usage, VkMemoryPropertyFlags properties, VkImage& image, MemoryAllocation& imageMemory) {
     VkImageCreateInfo imageInfo{};
     imageInfo.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
     imageInfo.imageType = VK_IMAGE_TYPE_2D;
@@ -1496,16 +2127,8 @@ void TriangleRenderer::createImage(uint32_t width, uint32_t height, VkFormat for
     VkMemoryRequirements memRequirements;
     vkGetImageMemoryRequirements(device, image, &memRequirements);
 
-    VkMemoryAllocateInfo allocInfo{};
-    allocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-    allocInfo.allocationSize = memRequirements.size;
-    allocInfo.memoryTypeIndex = findMemoryType(memRequirements.memoryTypeBits, properties);
-
-    if (vkAllocateMemory(device, &allocInfo, nullptr, &imageMemory) != VK_SUCCESS) {
-        throw std::runtime_error("failed to allocate image memory!");
-    }
-
-    vkBindImageMemory(device, image, imageMemory, 0);
+    imageMemory = memoryAllocator.allocate(memRequirements, properties, DeviceMemoryAllocator::Strategy::FreeList, tiling == VK_IMAGE_TILING_OPTIMAL);
+    vkBindImageMemory(device, image, imageMemory.memory, imageMemory.offset);
 }
 
 void TriangleRenderer::createDepthResources()
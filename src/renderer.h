@@ -27,8 +27,11 @@
 #include <cstdint> // for UINT32_MAX
 #include <algorithm> // for std::min/max
 #include <fstream>
+#include <string>
 
 #include "molecule_struct.h"
+#include "memory_allocator.h"
+#include "frame_sink.h"
 
 
 // glm types match GLSL types exactly
@@ -36,7 +39,7 @@ struct Vertex {
     glm::vec3 pos;
     glm::vec3 color;
     glm::vec3 normal;
-    uint32_t render_type; // 0 for molecule, 1 for orbital
+    uint32_t render_type; // 0 for molecule, 1 for orbital, 2 and 3 for the sphere and cylinder meshes drawn per MoleculeInstance, 4 and 5 for their ray cast impostors
 
     static VkVertexInputBindingDescription getBindingDescription() {
         // The rate of memory loading throughout vertices and memory layout and access behavior
@@ -74,10 +77,88 @@ struct Vertex {
     }
 };
 
+// Vertex as uploaded with COMPACT_VERTICES, 16 bytes instead of the 64 of a padded Vertex. The position is quantized in the
+// bounding box of its buffer, given to the shader in VertexBounds, the normal is octahedral encoded, the color is RGBA8.
+struct CompactVertex {
+    uint16_t position[3]; // unorm in the bounding box
+    uint16_t render_type; // the spare 16 bits after the position
+    int16_t normal[2]; // snorm octahedral coordinates
+    uint32_t color; // RGBA8
+
+    static VkVertexInputBindingDescription getBindingDescription() {
+        VkVertexInputBindingDescription bindingDescription{};
+        bindingDescription.binding = 0;
+        bindingDescription.stride = sizeof(CompactVertex);
+        bindingDescription.inputRate = VK_VERTEX_INPUT_RATE_VERTEX;
+        return bindingDescription;
+    }
+
+    // Same locations as Vertex, decoded by the shader compiled with COMPACT_VERTEX
+    static std::array<VkVertexInputAttributeDescription, 4> getAttributeDescriptions() {
+        std::array<VkVertexInputAttributeDescription, 4> attributeDescriptions{};
+        // Four components since three 16 bit ones are not always supported, the shader reads three and the render type is also
+        // read as its own attribute
+        attributeDescriptions[0].binding = 0;
+        attributeDescriptions[0].location = 0;
+        attributeDescriptions[0].format = VK_FORMAT_R16G16B16A16_UNORM;
+        attributeDescriptions[0].offset = offsetof(CompactVertex, position);
+        attributeDescriptions[1].binding = 0;
+        attributeDescriptions[1].location = 1;
+        attributeDescriptions[1].format = VK_FORMAT_R8G8B8A8_UNORM;
+        attributeDescriptions[1].offset = offsetof(CompactVertex, color);
+        attributeDescriptions[2].binding = 0;
+        attributeDescriptions[2].location = 2;
+        attributeDescriptions[2].format = VK_FORMAT_R16G16_SNORM;
+        attributeDescriptions[2].offset = offsetof(CompactVertex, normal);
+        attributeDescriptions[3].binding = 0;
+        attributeDescriptions[3].location = 3;
+        attributeDescriptions[3].format = VK_FORMAT_R16_UINT;
+        attributeDescriptions[3].offset = offsetof(CompactVertex, render_type);
+        return attributeDescriptions;
+    }
+};
+
+// One atom, or one half bond from an atom to the bond middle, drawn as an instance of the shared sphere or cylinder mesh.
+// Plain floats instead of glm::vec3, which is padded to 16 bytes here, so that an instance is 32 bytes.
+struct MoleculeInstance {
+    float position[3]; // atom center, or the atom end of the half bond
+    float radius; // sphere radius, or cylinder mesh scale
+    float axis[3]; // from the atom to the bond middle, unused for atoms
+    uint32_t color; // RGBA8
+
+    static VkVertexInputBindingDescription getBindingDescription() {
+        VkVertexInputBindingDescription bindingDescription{};
+        bindingDescription.binding = 1;
+        bindingDescription.stride = sizeof(MoleculeInstance);
+        bindingDescription.inputRate = VK_VERTEX_INPUT_RATE_INSTANCE; // next element after each instance
+        return bindingDescription;
+    }
+
+    // Locations after the ones of Vertex
+    static std::array<VkVertexInputAttributeDescription, 3> getAttributeDescriptions() {
+        std::array<VkVertexInputAttributeDescription, 3> attributeDescriptions{};
+        // position and radius as one vec4
+        attributeDescriptions[0].binding = 1;
+        attributeDescriptions[0].location = 4;
+        attributeDescriptions[0].format = VK_FORMAT_R32G32B32A32_SFLOAT;
+        attributeDescriptions[0].offset = offsetof(MoleculeInstance, position);
+        attributeDescriptions[1].binding = 1;
+        attributeDescriptions[1].location = 5;
+        attributeDescriptions[1].format = VK_FORMAT_R32G32B32_SFLOAT;
+        attributeDescriptions[1].offset = offsetof(MoleculeInstance, axis);
+        // color arrives as a normalized vec4
+        attributeDescriptions[2].binding = 1;
+        attributeDescriptions[2].location = 6;
+        attributeDescriptions[2].format = VK_FORMAT_R8G8B8A8_UNORM;
+        attributeDescriptions[2].offset = offsetof(MoleculeInstance, color);
+        return attributeDescriptions;
+    }
+};
+
 // note that with glm, the data is EXACTLY the same as in the shaders, so we can wholesale copy it
 // The alignas is necessary because in the shaders it will be aligned to multiples of 16 bytes so we have to match that 
+// Per frame data, the per draw model transform is a push constant in DrawConstants
 struct UniformBufferObject {
-    alignas(16) glm::mat4 model;
     alignas(16) glm::mat4 view;
     alignas(16) glm::mat4 proj;
     alignas(16) glm::vec3 camera_pos;
@@ -85,12 +166,37 @@ struct UniformBufferObject {
     alignas(16) glm::vec3 light_color;
 };
 
+// Push constant of the vertex shader, the bounding box that the CompactVertex positions of the bound vertex buffer are quantized in
+struct VertexBounds {
+    alignas(16) glm::vec4 position_offset; // minimum corner
+    alignas(16) glm::vec4 position_scale; // size, positions are position_offset + position_scale * unorm
+};
+
+// Push constants of a draw, for the vertex and fragment shaders, within the 128 bytes every device supports
+struct DrawConstants {
+    alignas(16) glm::mat4 model = glm::mat4(1.0f); // object to world space
+    VertexBounds vertexBounds{};
+    int32_t render_type = -1; // of every vertex of the draw, -1 to take the render type of each vertex
+};
+
+// What TriangleRenderer::renderOffscreen renders
+struct OffscreenSettings {
+    uint32_t width = 1920;
+    uint32_t height = 1080;
+    int first_frame = 0;
+    int last_frame = -1; // included, -1 for the last frame of the trajectory
+};
+
 
 class TriangleRenderer
 {
 public:
     void run();
 
+    // Renders trajectory frames to sink, image files or a video stream, with no window, surface or swap chain, for
+    // machines without a display. Any Vulkan device works, lavapipe included.
+    void renderOffscreen(const OffscreenSettings& settings, FrameSink& sink);
+
     TriangleRenderer(const std::vector<MoleculeStruct::MolecularDataOneFrame*>& set_trajectory) : trajectory(set_trajectory) {
         vertices = {
 			{{-5.5f, -5.5f, 7.5f}, {1.0f, 1.0f, 1.0f}, {0, 1.f, 0}, 0},
@@ -114,6 +220,8 @@ private:
     std::vector<Vertex> vertices;
     // Each triple is a triangle
     std::vector<uint32_t> indices;
+    // vertices as uploaded with COMPACT_VERTICES, kept to reuse its memory
+    std::vector<CompactVertex> compactVertices;
 
     std::vector<MoleculeStruct::MolecularDataOneFrame*> trajectory;
 
@@ -125,6 +233,9 @@ private:
     VkDevice device; // physical devices can have multiple logical devices
     VkQueue graphicsQueue; // All operations are passed into this work queue that handles telling the device to actually run them
     VkQueue presentQueue; // Same as graphics queue but for operations that can be presented to the screen. Same queue.
+    VkQueue transferQueue; // Uploads, the graphics queue when there is no transfer only family
+    uint32_t graphicsQueueFamily = 0;
+    uint32_t transferQueueFamily = 0;
     // swapchain related variables
     VkSwapchainKHR swapChain;
     std::vector<VkImage> swapChainImages; // The image handles in the swap chain
@@ -139,12 +250,44 @@ private:
     VkDescriptorPool descriptorPool; // Where descriptors can be allocated
     std::vector<VkDescriptorSet> descriptorSets; // The descriptor sets themselves
     VkPipelineLayout pipelineLayout; // Graphics pipeline
-    VkPipeline graphicsPipeline;
+    VkPipeline graphicsPipeline; // kept across swap chain recreation, its viewport and scissor are dynamic
+    VkPipeline impostorPipeline = VK_NULL_HANDLE; // same state with the fragment shader that writes the depth, for the impostor layers
+    VkPipelineCache pipelineCache = VK_NULL_HANDLE; // loaded from and saved to PIPELINE_CACHE_FILE
     std::vector<VkFramebuffer> swapChainFramebuffers; // a frame buffer holds an image view for each pipeline attachment
   
     // Commands
     VkCommandPool commandPool;
-    std::vector<VkCommandBuffer> commandBuffers;
+    std::vector<VkCommandBuffer> commandBuffers; // primary, they only execute the layers in the render pass
+
+    // Layers of the scene, each drawn by a secondary command buffer that is recorded again only when its draw changes
+    enum DrawLayer { ATOM_LAYER, BOND_LAYER, SURFACE_LAYER, LAYER_COUNT };
+    // What a layer command buffer binds and draws, recorded again when any of it differs
+    struct LayerDraw {
+        VkBuffer vertexBuffer = VK_NULL_HANDLE;
+        VkBuffer instanceBuffer = VK_NULL_HANDLE;
+        VkBuffer indexBuffer = VK_NULL_HANDLE;
+        DrawConstants constants;
+        uint32_t indexCount = 0; // 0 when the layer has nothing to draw
+        uint32_t instanceCount = 0;
+        uint32_t firstIndex = 0;
+        int32_t vertexOffset = 0;
+        uint32_t firstInstance = 0;
+
+        bool operator==(const LayerDraw& other) const {
+            return vertexBuffer == other.vertexBuffer && instanceBuffer == other.instanceBuffer && indexBuffer == other.indexBuffer &&
+                   constants.model == other.constants.model &&
+                   constants.vertexBounds.position_offset == other.constants.vertexBounds.position_offset &&
+                   constants.vertexBounds.position_scale == other.constants.vertexBounds.position_scale &&
+                   constants.render_type == other.constants.render_type &&
+                   indexCount == other.indexCount && instanceCount == other.instanceCount && firstIndex == other.firstIndex &&
+                   vertexOffset == other.vertexOffset && firstInstance == other.firstInstance;
+        }
+    };
+    // Indexed by i_image * LAYER_COUNT + layer. Every swap chain image and layer has its own pool, so that they are
+    // recorded on several threads, with a command buffer per geometry set.
+    std::vector<VkCommandPool> layerCommandPools;
+    std::vector<std::array<VkCommandBuffer, 2>> layerCommandBuffers;
+    std::vector<std::array<LayerDraw, 2>> layerDraws; // what each one was recorded with
 
     // semaphores are for parts of the pipeline to wait until the last has been completed
     std::vector<VkSemaphore> imageAvailableSemaphores;
@@ -155,22 +298,84 @@ private:
 
     bool framebufferResized = false;
 
-    // Not sure why we need both of these. Maybe vertexBufferMemory is GPU memory?
-    VkBuffer vertexBuffer;
-    VkDeviceMemory vertexBufferMemory;
-    VkBuffer indexBuffer;
-    VkDeviceMemory indexBufferMemory;
-
-    // vectors containing a uniform buffer per swap chain, so that different frames in flight can
+    // Offscreen rendering: swapChainImages are color images of our own, read back to host visible buffers. Frames go
+    // through the images in turn, each signalling its fence once its pixels are in its buffer.
+    bool offscreen = false;
+    VkExtent2D offscreenExtent{};
+    std::vector<MemoryAllocation> offscreenImageMemory;
+    std::vector<VkBuffer> readbackBuffers;
+    std::vector<MemoryAllocation> readbackBufferMemory;
+    std::vector<VkFence> readbackFences;
+
+    // Every buffer and image takes its memory from here
+    DeviceMemoryAllocator memoryAllocator;
+
+    // The buffers that change with the trajectory frame, kept across frames and rewritten in place, reallocated only to grow
+    struct GeometryBuffers {
+        // Each device local buffer with its suballocation and the size it was allocated with, filled from the staging ring
+        VkBuffer vertexBuffer = VK_NULL_HANDLE;
+        MemoryAllocation vertexBufferMemory;
+        VkDeviceSize vertexBufferCapacity = 0;
+        VkBuffer indexBuffer = VK_NULL_HANDLE;
+        MemoryAllocation indexBufferMemory;
+        VkDeviceSize indexBufferCapacity = 0;
+        VkBuffer instanceBuffer = VK_NULL_HANDLE;
+        MemoryAllocation instanceBufferMemory;
+        VkDeviceSize instanceBufferCapacity = 0;
+        // With COMPACT_VERTICES, vertices are uploaded quantized in these bounds, pushed before drawing the vertex buffer
+        VertexBounds vertexBounds{};
+        // Size of indices when uploaded here, with the isosurfaces at the level of detail selected then
+        uint32_t indexCount = 0;
+    };
+    // Frame changes upload to the sets in turn, so that frames in flight keep drawing the previous frame from the other one.
+    // Geometry generation g, counting the frame changes, is in set g % 2.
+    std::array<GeometryBuffers, 2> geometryBuffers;
+    uint64_t geometryGeneration = 0;
+    // The geometry generation each command buffer was recorded with, it is recorded again when acquired with an older one
+    std::vector<uint64_t> commandBufferGenerations;
+
+    // Staging ring: persistently mapped host memory that buffer updates are written to from the head, and copied to their
+    // device local buffer by the upload command buffer. The head wraps to the start once every pending upload is done.
+    VkBuffer stagingRingBuffer = VK_NULL_HANDLE;
+    MemoryAllocation stagingRingMemory;
+    VkDeviceSize stagingRingCapacity = 0;
+    VkDeviceSize stagingRingHead = 0;
+    // Uploads, submitted to the transfer queue. Each one signals its semaphore, waited by the next upload or draw, whichever
+    // is submitted first, so that at most one is pending.
+    VkCommandPool transferCommandPool;
+    std::vector<VkCommandBuffer> uploadCommandBuffers; // used in turn, each with its fence and semaphore
+    std::vector<VkFence> uploadFences;
+    std::vector<VkSemaphore> uploadSemaphores;
+    std::vector<VkFence> uploadSemaphoreWaitFences; // of the submission that waited the semaphore, before it is signalled again
+    std::vector<std::vector<std::pair<VkBuffer, MemoryAllocation>>> uploadStagingBuffers; // destroyed once the upload is done
+    size_t currentUpload = 0;
+    bool uploadRecording = false; // copies recorded into uploadCommandBuffers[currentUpload] and not submitted yet
+    int pendingUpload = -1; // the submitted upload whose semaphore nothing waits yet, -1 for none
+
+    VertexBounds moleculeMeshBounds{};
+
+    // Instanced atoms and bonds: the sphere and cylinder meshes are uploaded once, only the instances change with the frame
+    std::vector<MoleculeInstance> instances; // atoms first, then half bonds
+    uint32_t atomInstanceCount = 0;
+    uint32_t sphereIndexCount = 0; // The cylinder indices follow the sphere ones in moleculeMeshIndexBuffer
+    uint32_t sphereVertexCount = 0;
+    uint32_t moleculeMeshIndexCount = 0;
+    VkBuffer moleculeMeshVertexBuffer;
+    MemoryAllocation moleculeMeshVertexBufferMemory;
+    VkBuffer moleculeMeshIndexBuffer;
+    MemoryAllocation moleculeMeshIndexBufferMemory;
+
+    // One persistently mapped buffer with a uniform slice per swap chain image, so that different frames in flight can
     // access and update concurrently without stepping on each others' toes.
     // This makes sense because different frames have different associated timestamps and different
     // perspective transforms
-    std::vector<VkBuffer> uniformBuffers;
-    std::vector<VkDeviceMemory> uniformBuffersMemory;
+    VkBuffer uniformBuffer;
+    MemoryAllocation uniformBufferMemory;
+    VkDeviceSize uniformBufferStride = 0; // sizeof(UniformBufferObject) rounded up to the offset alignment of the device
 
     // Depth related fields
     VkImage depthImage;
-    VkDeviceMemory depthImageMemory;
+    MemoryAllocation depthImageMemory;
     VkImageView depthImageView;
 
     // High level of customizability in this function, requires going through the Vulkan SDK
@@ -201,6 +406,7 @@ private:
     struct QueueFamilyIndices {
         std::optional<uint32_t> graphicsFamily; // The main thing
         std::optional<uint32_t> presentFamily; // Tells us if device can present images to the surface
+        std::optional<uint32_t> transferFamily; // Copies without graphics, the DMA engine of discrete GPUs. Optional.
 
         bool isComplete() {
             return graphicsFamily.has_value() && presentFamily.has_value();
@@ -256,6 +462,9 @@ private:
 
     void createSwapChain();
 
+    // In place of the swap chain when offscreen, with a buffer per image that the command buffer copies it to
+    void createOffscreenImages();
+
     void cleanupSwapChain();
 
     // Whenever somethinig changes we probably have to recreate the entire swap chain from scratch
@@ -273,6 +482,10 @@ private:
     // 3. Return the image to the swap chain for presentation to the window
     void drawFrame();
 
+    // Submits a trajectory frame to be rendered offscreen into swap chain image i and read back to readbackBuffers[i],
+    // which must not be in use. Signals readbackFences[i] once done.
+    void drawOffscreenFrame(int i_frame, size_t i);
+
     //  MAIN LOOP
 
     // Event loop to keep window open until it should be closed
@@ -320,6 +533,12 @@ private:
     VkShaderModule createShaderModule(const std::vector<char>& code);
 
     void createGraphicsPipeline();
+    // The pipeline, its layout and render pass
+    void destroyGraphicsPipeline();
+
+    // The cache starts from the file saved by an earlier run, when that run had the same device and driver
+    void createPipelineCache();
+    void savePipelineCache();
 
     // These are not the actual framebuffers, I think they are objects describing what
     // frame buffers the swap chain will render to
@@ -336,6 +555,15 @@ private:
 
     void createCommandBuffers();
 
+    // The draw of a layer from a set of geometry buffers
+    LayerDraw getLayerDraw(const int layer, const GeometryBuffers& geometry);
+    void recordLayerCommandBuffer(size_t i, const int layer, size_t i_set, const LayerDraw& draw);
+
+    // Records the current geometry into the command buffers of swap chain images that are not in flight. The layers that
+    // changed are recorded in parallel, then the primary command buffers that execute them.
+    void recordCommandBuffers(const std::vector<size_t>& images);
+    void recordCommandBuffer(size_t i);
+
     void renderCommandBuffers();
 
     // Drawing
@@ -345,20 +573,49 @@ private:
 
     // Vertex Buffer
 
-    // returns the index of the memory type in the physical device that satisfies the
-    // flags in typeFilter and the properties in properties
-    uint32_t findMemoryType(uint32_t typeFilter, VkMemoryPropertyFlags properties);
+    // The memory of the buffer is a sub-range of memoryAllocator, Linear for transient buffers
+    void createBuffer(VkDeviceSize size, VkBufferUsageFlags usage, VkMemoryPropertyFlags properties, VkBuffer& buffer, MemoryAllocation& bufferMemory,
+                      DeviceMemoryAllocator::Strategy strategy = DeviceMemoryAllocator::Strategy::FreeList);
+
+    void uploadVertexBuffer(GeometryBuffers& geometry);
+
+    void uploadIndexBuffer(GeometryBuffers& geometry);
+
+    // Device local buffer filled through its own staging buffer, for data uploaded once. The copy is recorded with the buffer
+    // updates and the staging buffer is destroyed once it is done.
+    void createDeviceLocalBuffer(const void* data, VkDeviceSize size, VkBufferUsageFlags usage, VkBuffer& buffer, MemoryAllocation& bufferMemory);
+
+    void createMoleculeMeshBuffers();
+
+    void uploadInstanceBuffer(GeometryBuffers& geometry);
+
+    void createStagingRing(VkDeviceSize size);
+
+    void createUploadCommandBuffers();
+
+    // Writes data to the staging ring and records its copy to the start of buffer, a persistent device local buffer whose
+    // capacity grows geometrically when data does not fit. Nothing is allocated while the data fits.
+    void stageBufferUpdate(const void* data, VkDeviceSize size, VkBufferUsageFlags usage, VkBuffer& buffer, MemoryAllocation& bufferMemory, VkDeviceSize& capacity);
+
+    // The upload command buffer being recorded, begun once the last upload from it is done
+    VkCommandBuffer getUploadCommandBuffer();
 
-    void createBuffer(VkDeviceSize size, VkBufferUsageFlags usage, VkMemoryPropertyFlags properties, VkBuffer& buffer, VkDeviceMemory& bufferMemory);
+    // Submits the recorded copies to the transfer queue. The next draw waits for them on the GPU, the CPU does not.
+    void submitBufferUpdates();
 
-    void createVertexBuffer();
+    // Waits for an upload and destroys its staging buffers
+    void releaseUpload(size_t i_upload);
 
-    void createIndexBuffer();
+    // Waits for every submitted upload, after which the whole staging ring is free
+    void waitForBufferUpdates();
 
     void updateVertexAndIndexBuffer(float time);
 
-    // need to use command buffers to transfer the vertices from staging buffer to vertex buffer
-    void copyBuffer(VkBuffer srcBuffer, VkBuffer dstBuffer, VkDeviceSize size);
+    // Meshes a trajectory frame and uploads it to the geometry set that is not drawn
+    void updateGeometry(int i_frame);
+    // The coarsest level of detail of the isosurfaces in vertices from i_first_orbital_vertex on that keeps a triangle per
+    // ORBITAL_LOD_PIXELS_PER_TRIANGLE pixels they cover in the swap chain images, 0 for the full mesh
+    int selectSurfaceLevel(const size_t i_first_orbital_vertex, const size_t orbitalTriangleCount);
 
     // Model View Projection
 
@@ -377,6 +634,6 @@ private:
     VkFormat findDepthFormat();
     VkFormat findSupportedFormat(const std::vector<VkFormat>& candidates, VkImageTiling tiling, VkFormatFeatureFlags features);
     VkImageView createImageView(VkImage image, VkFormat format, VkImageAspectFlags aspectFlags);
-    void createImage(uint32_t width, uint32_t height, VkFormat format, VkImageTiling tiling, VkImageUsageFlags usage, VkMemoryPropertyFlags properties, VkImage& image, VkDeviceMemory& imageMemory);
+    void createImage(uint32_t width, uint32_t height, VkFormat format, VkImageTiling tiling, VkImageUsageFlags usage, VkMemoryPropertyFlags properties, VkImage& image, MemoryAllocation& imageMemory);
 };
 
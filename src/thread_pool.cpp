@@ -0,0 +1,168 @@
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "thread_pool.h"
+
+namespace ThreadPool
+{
+    // Worker threads started once and reused by every parallelFor, the calling thread takes tasks as well. One parallelFor
+    // runs at a time, a parallelFor called from a task or while another one runs takes its tasks on the calling thread.
+    class WorkerPool
+    {
+    public:
+        ~WorkerPool()
+        {
+            resize(0);
+        }
+
+        // Keeps n_thread - 1 workers for the next parallelFor, 0 for one thread per hardware thread
+        void setThreadCount(const int n_thread)
+        {
+            // From a task the running parallelFor holds run_mutex, possibly on this very thread
+            std::unique_lock<std::mutex> run_lock;
+            if (!in_parallel_for)
+                run_lock = std::unique_lock<std::mutex>(run_mutex);
+            thread_count = n_thread;
+        }
+
+        void run(const int n_task, const std::function<void(const int)>& task)
+        {
+            // Checked first, a task running on the calling thread of a parallelFor would try_lock the run_mutex it holds
+            if (in_parallel_for || n_task <= 1)
+            {
+                for (int i_task = 0; i_task < n_task; i_task++)
+                    task(i_task);
+                return;
+            }
+            std::unique_lock<std::mutex> run_lock(run_mutex, std::try_to_lock);
+            if (!run_lock.owns_lock())
+            {
+                for (int i_task = 0; i_task < n_task; i_task++)
+                    task(i_task);
+                return;
+            }
+            const int requested_thread_count = thread_count;
+            const int n_thread = requested_thread_count > 0 ? requested_thread_count : std::max(1, (int)std::thread::hardware_concurrency());
+            if ((int)workers.size() != n_thread - 1)
+                resize(n_thread - 1);
+            if (workers.empty())
+            {
+                for (int i_task = 0; i_task < n_task; i_task++)
+                    task(i_task);
+                return;
+            }
+
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                job_task = &task;
+                job_task_count = n_task;
+                next_task = 0;
+                busy_workers = (int)workers.size();
+                job_error = nullptr;
+                job_generation++;
+            }
+            job_available.notify_all();
+            in_parallel_for = true;
+            runTasks();
+            in_parallel_for = false;
+            std::unique_lock<std::mutex> lock(mutex);
+            job_done.wait(lock, [this]() { return busy_workers == 0; });
+            job_task = nullptr;
+            if (job_error)
+                std::rethrow_exception(job_error);
+        }
+
+    private:
+        // Joins the workers and starts n_worker new ones, with no job running
+        void resize(const int n_worker)
+        {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                stopping = true;
+            }
+            job_available.notify_all();
+            for (std::thread& worker : workers)
+                worker.join();
+            workers.clear();
+            stopping = false;
+            for (int i_worker = 0; i_worker < n_worker; i_worker++)
+                workers.emplace_back(&WorkerPool::work, this);
+        }
+
+        void work()
+        {
+            in_parallel_for = true;
+            uint64_t generation = 0;
+            std::unique_lock<std::mutex> lock(mutex);
+            while (true)
+            {
+                job_available.wait(lock, [&]() { return stopping || job_generation != generation; });
+                if (stopping)
+                    return;
+                generation = job_generation;
+                lock.unlock();
+                runTasks();
+                lock.lock();
+                if (--busy_workers == 0)
+                    job_done.notify_one();
+            }
+        }
+
+        // Takes tasks of the current job until there are none left
+        void runTasks()
+        {
+            for (int i_task = next_task++; i_task < job_task_count; i_task = next_task++)
+            {
+                try
+                {
+                    (*job_task)(i_task);
+                }
+                catch (...)
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    if (!job_error)
+                        job_error = std::current_exception();
+                }
+            }
+        }
+
+        std::mutex run_mutex; // held by the parallelFor running
+        std::atomic<int> thread_count{ 0 }; // set without run_mutex from inside a task
+        std::vector<std::thread> workers;
+
+        std::mutex mutex;
+        std::condition_variable job_available, job_done;
+        const std::function<void(const int)>* job_task = nullptr;
+        int job_task_count = 0;
+        std::atomic<int> next_task{ 0 };
+        int busy_workers = 0;
+        uint64_t job_generation = 0;
+        std::exception_ptr job_error;
+        bool stopping = false;
+
+        static thread_local bool in_parallel_for; // always on the workers, around its tasks on the calling thread
+    };
+
+    thread_local bool WorkerPool::in_parallel_for = false;
+
+    WorkerPool& getWorkerPool()
+    {
+        static WorkerPool pool;
+        return pool;
+    }
+
+    void setThreadCount(const int n_thread)
+    {
+        getWorkerPool().setThreadCount(n_thread);
+    }
+
+    void parallelFor(const int n_task, const std::function<void(const int)>& task)
+    {
+        getWorkerPool().run(n_task, task);
+    }
+}
@@ -0,0 +1,16 @@
+#pragma once
+
+#include <functional>
+
+// Worker threads shared by the isosurface extraction, the mesh simplifier and the command buffer recording
+namespace ThreadPool
+{
+    // Threads of parallelFor, the caller included, 0 for one per hardware thread.
+    // The worker threads are started by the first parallelFor after a change and reused by the following ones,
+    // it waits for a running parallelFor unless called from one of its tasks.
+    void setThreadCount(const int n_thread);
+
+    // Runs task(i_task) for every i_task in [0, n_task), spread over the worker threads and the calling thread.
+    // Rethrows the first exception of a task once all tasks are done.
+    void parallelFor(const int n_task, const std::function<void(const int)>& task);
+}